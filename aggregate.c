@@ -0,0 +1,284 @@
+/*
+ * Route aggregation; see Aggregator in dat.h.
+ *
+ * Our routes are sorted by address and then by length, so that
+ * the routes under any prefix form a run that starts with the
+ * prefix itself, if we have it.  We walk the binary trie of
+ * prefixes over those runs, bottom-up, and each node reports
+ * the tunnel its whole range goes to, or that it is mixed.  A
+ * uniform node needs no route of its own, as its parent covers
+ * it; two uniform siblings on the same tunnel thus merge.  A
+ * mixed node needs a route for each uniform child that goes
+ * elsewhere than the node itself, and one for its own range if
+ * any of it is left to that route, unless the route above
+ * already goes the same way.
+ *
+ * Routes whose tunnel is still being brought up are left out
+ * until it is ready.
+ */
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dat.h"
+#include "fns.h"
+
+typedef struct Aggdiff Aggdiff;
+struct Aggdiff {
+	Aggregator *a;
+	IPMap *want;		// Of Aggent.
+	IPMap *stale;
+	time_t now;
+};
+
+static Tunnel mixed;		// A range that goes more than one way.
+
+static void collect(uint32_t key, size_t keylen, void *routep, void *aggp);
+static int entcmp(const void *ap, const void *bp);
+static Tunnel *aggregate(Aggregator *a, uint32_t ipnet, size_t cidr, size_t lo, size_t hi, Tunnel *above, int *relies);
+static void emit(Aggregator *a, uint32_t ipnet, size_t cidr, Tunnel *tunnel);
+static void apply(uint32_t key, size_t keylen, void *entp, void *diffp);
+static void prune(uint32_t key, size_t keylen, void *routep, void *diffp);
+static void withdraw(uint32_t key, size_t keylen, void *routep, void *diffp);
+
+void
+initaggregator(Aggregator *a, IPMap *routes, int rtable, int enabled)
+{
+	memset(a, 0, sizeof(*a));
+	a->routes = routes;
+	a->fib = mkipmap();
+	a->rtable = rtable;
+	a->enabled = enabled;
+}
+
+// Notes that our table has changed.
+void
+aggchanged(Aggregator *a)
+{
+	a->dirty = 1;
+}
+
+// Records a route found in the kernel at startup as installed.
+void
+aggadopt(Aggregator *a, Route *route)
+{
+	Route *r;
+
+	if (!a->enabled)
+		return;
+	r = malloc(sizeof(*r));
+	if (r == NULL)
+		fatal("malloc");
+	*r = *route;
+	r->rnext = NULL;
+	r->installed = 1;
+	ipmapinsert(a->fib, r->ipnet, netmask2cidr(r->subnetmask), r);
+	a->dirty = 1;
+}
+
+/*
+ * If our table has changed, recomputes the aggregates and
+ * brings the kernel in line with them: new and moved
+ * aggregates first, so that traffic is never left without a
+ * route, then those no longer wanted.
+ */
+void
+aggflush(Aggregator *a, time_t now)
+{
+	Aggdiff d = { a, NULL, NULL, now };
+	Tunnel *all;
+	int relies;
+
+	if (!a->enabled || !a->dirty)
+		return;
+	a->dirty = 0;
+	a->runs++;
+	a->nin = 0;
+	a->nout = 0;
+	ipmapdo(a->routes, collect, a);
+	qsort(a->in, a->nin, sizeof(*a->in), entcmp);
+	all = aggregate(a, 0, 0, 0, a->nin, NULL, &relies);
+	if (all != &mixed && all != NULL)
+		emit(a, 0, 0, all);
+	d.want = mkipmap();
+	for (size_t k = 0; k < a->nout; k++)
+		ipmapinsert(d.want, a->out[k].ipnet, a->out[k].cidr, &a->out[k]);
+	ipmapdo(d.want, apply, &d);
+	ipmapdo(a->fib, prune, &d);
+	if (d.stale != NULL) {
+		ipmapdo(d.stale, withdraw, &d);
+		freeipmap(d.stale, NULL);
+	}
+	freeipmap(d.want, NULL);
+	a->nroutes = a->nin;
+	a->naggregates = a->nout;
+}
+
+static void
+collect(uint32_t key, size_t keylen, void *routep, void *aggp)
+{
+	Route *route = routep;
+	Aggregator *a = aggp;
+	Aggent *ent;
+
+	if (route->tunnel == NULL || route->tunnel->pending != 0)
+		return;
+	if (a->nin == a->maxin) {
+		size_t max = (a->maxin == 0) ? 256 : a->maxin*2;
+		Aggent *in = reallocarray(a->in, max, sizeof(*in));
+
+		if (in == NULL)
+			fatal("malloc");
+		a->in = in;
+		a->maxin = max;
+	}
+	ent = &a->in[a->nin++];
+	ent->ipnet = key;
+	ent->cidr = keylen;
+	ent->tunnel = route->tunnel;
+}
+
+static int
+entcmp(const void *ap, const void *bp)
+{
+	const Aggent *a = ap, *b = bp;
+
+	if (a->ipnet != b->ipnet)
+		return (a->ipnet < b->ipnet) ? -1 : 1;
+	if (a->cidr != b->cidr)
+		return (a->cidr < b->cidr) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Aggregates in[lo, hi), the routes within ipnet/cidr, where
+ * the kernel sends the range to `above` on our behalf.
+ * Returns the tunnel the whole range goes to, or &mixed; in
+ * the latter case, sets *relies if some of the range is left
+ * to the route above.
+ */
+static Tunnel *
+aggregate(Aggregator *a, uint32_t ipnet, size_t cidr, size_t lo, size_t hi,
+    Tunnel *above, int *relies)
+{
+	Tunnel *here, *left, *right;
+	uint32_t bit;
+	size_t mid, top;
+	int lrelies, rrelies, needed;
+
+	here = above;
+	if (lo < hi && a->in[lo].ipnet == ipnet && a->in[lo].cidr == cidr)
+		here = a->in[lo++].tunnel;
+	if (lo == hi)
+		return here;
+	assert(cidr < 32);
+	bit = 1U << (31 - cidr);
+	// The routes in the upper half come last.
+	mid = lo;
+	top = hi;
+	while (mid < top) {
+		size_t m = mid + (top - mid)/2;
+
+		if (a->in[m].ipnet & bit)
+			top = m;
+		else
+			mid = m + 1;
+	}
+	lrelies = rrelies = 0;
+	left = aggregate(a, ipnet, cidr + 1, lo, mid, here, &lrelies);
+	right = aggregate(a, ipnet | bit, cidr + 1, mid, hi, here, &rrelies);
+	if (left == right && left != &mixed)
+		return left;
+	if (left != &mixed && left != here)
+		emit(a, ipnet, cidr + 1, left);
+	if (right != &mixed && right != here)
+		emit(a, ipnet | bit, cidr + 1, right);
+	// Our own route is wanted only if some of our range falls to it.
+	needed = (left == &mixed) ? lrelies : (left == here);
+	needed |= (right == &mixed) ? rrelies : (right == here);
+	if (needed && here != above)
+		emit(a, ipnet, cidr, here);
+	*relies = needed && here == above;
+
+	return &mixed;
+}
+
+static void
+emit(Aggregator *a, uint32_t ipnet, size_t cidr, Tunnel *tunnel)
+{
+	Aggent *ent;
+
+	if (a->nout == a->maxout) {
+		size_t max = (a->maxout == 0) ? 256 : a->maxout*2;
+		Aggent *out = reallocarray(a->out, max, sizeof(*out));
+
+		if (out == NULL)
+			fatal("malloc");
+		a->out = out;
+		a->maxout = max;
+	}
+	ent = &a->out[a->nout++];
+	ent->ipnet = ipnet;
+	ent->cidr = cidr;
+	ent->tunnel = tunnel;
+}
+
+static void
+apply(uint32_t key, size_t keylen, void *entp, void *diffp)
+{
+	Aggent *ent = entp;
+	Aggdiff *d = diffp;
+	Aggregator *a = d->a;
+	Route *r;
+
+	r = ipmapfind(a->fib, key, keylen);
+	if (r != NULL && r->tunnel == ent->tunnel)
+		return;
+	if (r == NULL) {
+		r = calloc(1, sizeof(*r));
+		if (r == NULL)
+			fatal("malloc");
+		r->ipnet = key;
+		r->subnetmask = cidr2netmask(keylen);
+		r->gateway = ent->tunnel->remote;
+		addroute(r, ent->tunnel, a->rtable);
+		ipmapinsert(a->fib, key, keylen, r);
+		a->adds++;
+	} else {
+		r->gateway = ent->tunnel->remote;
+		chroute(r, ent->tunnel, a->rtable);
+		a->changes++;
+	}
+	r->tunnel = ent->tunnel;
+	r->installed = 1;
+	r->refreshed = d->now;
+}
+
+static void
+prune(uint32_t key, size_t keylen, void *routep, void *diffp)
+{
+	Aggdiff *d = diffp;
+
+	if (ipmapfind(d->want, key, keylen) != NULL)
+		return;
+	if (d->stale == NULL)
+		d->stale = mkipmap();
+	ipmapinsert(d->stale, key, keylen, routep);
+}
+
+static void
+withdraw(uint32_t key, size_t keylen, void *routep, void *diffp)
+{
+	Aggdiff *d = diffp;
+	Route *r = routep;
+
+	ipmapremove(d->a->fib, key, keylen);
+	rmroute(r, d->a->rtable);
+	free(r);
+	d->a->removes++;
+}
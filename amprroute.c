@@ -74,6 +74,8 @@ main(int argc, char *argv[])
 	strlcpy(tunnel.ifname, ifname, sizeof(tunnel.ifname));
 
 	addroute(&route, &tunnel, rdomain);
+	sysflush();
+	sysinput();
 
 	return 0;
 }
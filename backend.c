@@ -0,0 +1,262 @@
+/*
+ * Dispatch kernel operations to the selected backend.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+
+extern Backend kernbackend;
+extern Backend simbackend;
+
+static Backend *backends[] = {
+	&kernbackend,
+	&simbackend,
+};
+
+static Backend *backend = &kernbackend;
+static Sched *sched;
+
+/*
+ * Selects a backend by name.  Options for the backend may
+ * follow the name after a colon, as in "sim:route=100".
+ */
+int
+setbackend(const char *spec)
+{
+	const char *colon;
+	size_t len;
+
+	colon = strchr(spec, ':');
+	len = (colon == NULL) ? strlen(spec) : (size_t)(colon - spec);
+	for (size_t k = 0; k < sizeof(backends)/sizeof(backends[0]); k++) {
+		Backend *b = backends[k];
+		if (strlen(b->name) != len || strncmp(b->name, spec, len) != 0)
+			continue;
+		if (colon != NULL && b != &simbackend)
+			return -1;
+		if (colon != NULL && simconfig(colon + 1) < 0)
+			return -1;
+		backend = b;
+		return 0;
+	}
+
+	return -1;
+}
+
+const char *
+backendname(void)
+{
+	return backend->name;
+}
+
+// Whether the backend can route through one shared tunnel.
+int
+sysmultipoint(void)
+{
+	return backend->multipoint;
+}
+
+void
+initsys(int rtable)
+{
+	backend->initsys(rtable);
+}
+
+int
+uptunnel(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint)
+{
+	uint64_t t0;
+	int r;
+
+	probe1(tunnel_up_start, tunnel->remote);
+	t0 = profstart();
+	r = backend->uptunnel(tunnel, rdomain, tunneldomain, endpoint);
+	profend(STAGE_TUNNEL, t0);
+	probe2(tunnel_up_done, tunnel->remote, r);
+	trace(TRACE_TUNNEL_UP, tunnel->remote, tunnel->local, tunnel->ifnum,
+	    (r < 0) ? errno : 0);
+
+	return r;
+}
+
+int
+downtunnel(Tunnel *tunnel)
+{
+	int r;
+
+	probe1(tunnel_down_start, tunnel->remote);
+	r = backend->downtunnel(tunnel);
+	probe2(tunnel_down_done, tunnel->remote, r);
+	trace(TRACE_TUNNEL_DOWN, tunnel->remote, tunnel->local, tunnel->ifnum,
+	    (r < 0) ? errno : 0);
+
+	return r;
+}
+
+int
+retunnel(Tunnel *tunnel)
+{
+	if (backend->retunnel == NULL) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return backend->retunnel(tunnel);
+}
+
+/*
+ * Route operations go through the scheduler, if there is one;
+ * see Sched in dat.h.
+ */
+void
+setsched(Sched *s)
+{
+	sched = s;
+}
+
+int
+addroute(Route *route, Tunnel *tunnel, int rtable)
+{
+	if (sched != NULL)
+		return schedroute(sched, SCHED_ADD, PRIO_NEW, route, tunnel, rtable);
+	return sysroute(SCHED_ADD, route, tunnel, rtable);
+}
+
+int
+chroute(Route *route, Tunnel *tunnel, int rtable)
+{
+	if (sched != NULL)
+		return schedroute(sched, SCHED_CHANGE, PRIO_CHANGE, route, tunnel, rtable);
+	return sysroute(SCHED_CHANGE, route, tunnel, rtable);
+}
+
+int
+rmroute(Route *route, int rtable)
+{
+	if (sched != NULL)
+		return schedroute(sched, SCHED_REMOVE, PRIO_WITHDRAW, route, NULL, rtable);
+	return sysroute(SCHED_REMOVE, route, NULL, rtable);
+}
+
+/*
+ * Re-asserts a route the kernel should already have, adding
+ * it if it does not; the scheduler gets to it last.
+ */
+int
+refreshroute(Route *route, Tunnel *tunnel, int rtable)
+{
+	if (sched != NULL)
+		return schedroute(sched, SCHED_CHANGE, PRIO_REFRESH, route, tunnel, rtable);
+	return sysroute(SCHED_CHANGE, route, tunnel, rtable);
+}
+
+// Hands a route operation straight to the backend.
+int
+sysroute(int op, Route *route, Tunnel *tunnel, int rtable)
+{
+	int r;
+
+	trace(TRACE_KOP, route->ipnet, route->subnetmask,
+	    (tunnel != NULL) ? tunnel->remote : 0, op);
+	probe3(route_op_start, op, route->ipnet, route->subnetmask);
+	switch (op) {
+	case SCHED_ADD:
+		r = backend->addroute(route, tunnel, rtable);
+		break;
+	case SCHED_CHANGE:
+		r = backend->chroute(route, tunnel, rtable);
+		break;
+	case SCHED_REMOVE:
+		r = backend->rmroute(route, rtable);
+		break;
+	default:
+		errno = EINVAL;
+		r = -1;
+		break;
+	}
+	probe2(route_op_done, op, r);
+
+	return r;
+}
+
+/*
+ * Ends a transaction, sending whatever queued operations the
+ * scheduler lets through.
+ */
+void
+sysflush(void)
+{
+	uint64_t t0;
+
+	probe(flush_start);
+	t0 = profstart();
+	if (sched != NULL)
+		schedrun(sched);
+	if (backend->flush != NULL)
+		backend->flush();
+	profend(STAGE_INSTALL, t0);
+	probe(flush_done);
+}
+
+// Returns a descriptor to poll for kernel replies, or -1.
+int
+sysfd(void)
+{
+	if (backend->pollfd == NULL)
+		return -1;
+	return backend->pollfd();
+}
+
+void
+sysinput(void)
+{
+	if (backend->input != NULL)
+		backend->input();
+}
+
+/*
+ * Returns whether route operations are waiting for the
+ * scheduler or for the kernel to acknowledge them.
+ */
+int
+sysbusy(void)
+{
+	if (sched != NULL && sched->depth != 0)
+		return 1;
+	return backend->busy != NULL && backend->busy();
+}
+
+void
+statsbackend(FILE *fp)
+{
+	if (fp != NULL && backend->stats != NULL)
+		backend->stats(fp);
+}
+
+/*
+ * Reports the tunnels already in the kernel to `fn`.
+ * Returns the number found, or -1.
+ */
+int
+scantunnels(void (*fn)(Kif *kif, void *arg), void *arg)
+{
+	if (backend->scantunnels == NULL) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return backend->scantunnels(fn, arg);
+}
+
+// Likewise for the routes in `rtable`.
+int
+scanroutes(int rtable, void (*fn)(Kroute *kr, void *arg), void *arg)
+{
+	if (backend->scanroutes == NULL) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return backend->scanroutes(rtable, fn, arg);
+}
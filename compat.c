@@ -37,4 +37,29 @@ recallocarray(void *p, size_t oelem, size_t nelem, size_t size)
 	return np;
 }
 
+size_t
+strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size != 0) {
+		size_t n = (len < size - 1) ? len : size - 1;
+		memmove(dst, src, n);
+		dst[n] = '\0';
+	}
+
+	return len;
+}
+
+size_t
+strlcat(char *dst, const char *src, size_t size)
+{
+	size_t len = strnlen(dst, size);
+
+	if (len == size)
+		return len + strlen(src);
+
+	return len + strlcpy(dst + len, src, size - len);
+}
+
 #endif  // USE_COMPAT
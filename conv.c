@@ -0,0 +1,148 @@
+/*
+ * Convergence tracking.  We note when each route change was
+ * announced, that is, when the datagram carrying it arrived,
+ * and when the kernel confirmed it.  A backend acknowledges
+ * whole batches, so a change counts as confirmed the first
+ * time nothing is left queued, in flight to the workers, or
+ * awaiting acknowledgement.
+ *
+ * Changes are grouped into episodes, one per broadcast: an
+ * episode starts with the first datagram after the last one
+ * ended, and ends once the feeds have gone quiet and nothing
+ * is outstanding.  Its convergence time runs from that first
+ * datagram to the last confirmation.  The first episode also
+ * gives the cold start time, from startup until the table the
+ * upstream announced was installed.
+ */
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+
+static int u64cmp(const void *ap, const void *bp);
+static uint64_t percentile(uint64_t *sorted, size_t n, int percent);
+static void endepisode(Conv *c);
+
+void
+initconv(Conv *c, uint64_t now)
+{
+	free(c->times);
+	memset(c, 0, sizeof(*c));
+	c->started = now;
+}
+
+// Notes the arrival of a datagram.
+void
+convrx(Conv *c, uint64_t now)
+{
+	if (c->firstrx == 0)
+		c->firstrx = now;
+	if (c->begin == 0)
+		c->begin = now;
+}
+
+// Notes a route change announced by a datagram that arrived then.
+void
+convchange(Conv *c, uint64_t announced)
+{
+	if (c->nchanges == c->cap) {
+		size_t cap = (c->cap == 0) ? 256 : c->cap*2;
+		uint64_t *times = reallocarray(c->times, cap, sizeof(*times));
+
+		if (times == NULL)
+			fatal("malloc");
+		c->times = times;
+		c->cap = cap;
+	}
+	c->times[c->nchanges++] = announced;
+}
+
+/*
+ * Confirms the changes made so far unless the kernel is `busy`
+ * with them, and ends the episode if the feeds are no longer
+ * `bursting` either.
+ */
+void
+convcheck(Conv *c, uint64_t now, int busy, int bursting)
+{
+	if (busy)
+		return;
+	if (c->nconfirmed < c->nchanges) {
+		for (size_t k = c->nconfirmed; k < c->nchanges; k++)
+			c->times[k] = now - c->times[k];
+		c->nconfirmed = c->nchanges;
+		c->settled = now;
+	}
+	if (!bursting && c->begin != 0)
+		endepisode(c);
+}
+
+static void
+endepisode(Conv *c)
+{
+	uint64_t *lat = c->times;
+	size_t n = c->nchanges;
+	uint64_t done;
+
+	done = (n != 0) ? c->settled : c->begin;
+	if (c->episodes++ == 0) {
+		c->coldstart = done - c->started;
+		notice("cold start converged in %.3f s, %.3f s after the "
+		    "first datagram", c->coldstart/1e9,
+		    (done - c->firstrx)/1e9);
+	}
+	if (n == 0) {
+		c->quiet++;
+		c->begin = 0;
+		return;
+	}
+	qsort(lat, n, sizeof(*lat), u64cmp);
+	c->changes += n;
+	c->last = done - c->begin;
+	c->lastp50 = percentile(lat, n, 50);
+	c->lastp90 = percentile(lat, n, 90);
+	c->lastp99 = percentile(lat, n, 99);
+	c->lastmax = lat[n - 1];
+	if (c->last > c->maxepisode)
+		c->maxepisode = c->last;
+	info("Converged in %.3f s: %zu route changes, per route "
+	    "p50 %.1f p90 %.1f p99 %.1f max %.1f ms", c->last/1e9, n,
+	    c->lastp50/1e6, c->lastp90/1e6, c->lastp99/1e6, c->lastmax/1e6);
+	c->nchanges = 0;
+	c->nconfirmed = 0;
+	c->begin = 0;
+}
+
+void
+statsconv(FILE *fp, Conv *c)
+{
+	fprintf(fp, "conv_episodes %" PRIu64 "\n", c->episodes);
+	fprintf(fp, "conv_quiet %" PRIu64 "\n", c->quiet);
+	fprintf(fp, "conv_changes %" PRIu64 "\n", c->changes);
+	fprintf(fp, "conv_coldstart_ns %" PRIu64 "\n", c->coldstart);
+	fprintf(fp, "conv_last_ns %" PRIu64 "\n", c->last);
+	fprintf(fp, "conv_last_p50_ns %" PRIu64 "\n", c->lastp50);
+	fprintf(fp, "conv_last_p90_ns %" PRIu64 "\n", c->lastp90);
+	fprintf(fp, "conv_last_p99_ns %" PRIu64 "\n", c->lastp99);
+	fprintf(fp, "conv_last_max_ns %" PRIu64 "\n", c->lastmax);
+	fprintf(fp, "conv_max_ns %" PRIu64 "\n", c->maxepisode);
+}
+
+static int
+u64cmp(const void *ap, const void *bp)
+{
+	uint64_t a = *(const uint64_t *)ap, b = *(const uint64_t *)bp;
+
+	return (a < b) ? -1 : (a > b);
+}
+
+static uint64_t
+percentile(uint64_t *sorted, size_t n, int percent)
+{
+	return sorted[(n*percent + 99)/100 - 1];
+}
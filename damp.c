@@ -0,0 +1,231 @@
+/*
+ * Route flap damping; see Damper in dat.h.  We only keep state
+ * for prefixes that have flapped at least once, and forget it
+ * once they have been quiet long enough.
+ *
+ * A suppressed prefix stays as it is in our table and in the
+ * kernel: announcements that agree with it refresh it as usual,
+ * and those that would change it are ignored.  If it is not
+ * announced at all, it expires as usual, and is not brought
+ * back until it is reused.
+ */
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dat.h"
+#include "fns.h"
+
+typedef struct Sweep Sweep;
+struct Sweep {
+	Damper *d;
+	time_t now;
+	IPMap *forget;
+};
+
+static Damp *track(Damper *d, uint32_t ipnet, size_t cidr, time_t now);
+static Damp *newdamp(Damper *d, uint32_t ipnet, size_t cidr, uint32_t gateway, time_t now);
+static void penalize(Damper *d, Damp *dp, uint32_t ipnet, size_t cidr, unsigned int penalty, time_t now);
+static void reuse(Damper *d, Damp *dp, uint32_t ipnet, size_t cidr, unsigned int penalty);
+static void sweepone(uint32_t key, size_t keylen, void *dampp, void *sweepp);
+static void forgetone(uint32_t key, size_t keylen, void *dampp, void *damperp);
+
+// 1024*2^(-k/8), to interpolate the decay within a half-life.
+static const unsigned int eighths[] = {
+	1024, 939, 861, 790, 724, 664, 609, 558, 512
+};
+
+void
+initdamper(Damper *d, int enabled)
+{
+	memset(d, 0, sizeof(*d));
+	d->prefixes = mkipmap();
+	d->enabled = enabled;
+}
+
+// Returns `penalty` decayed over `dt` seconds.
+unsigned int
+decay(unsigned int penalty, time_t dt)
+{
+	uint64_t r, k, f;
+
+	if (dt <= 0)
+		return penalty;
+	if (dt/DAMP_HALFLIFE >= 32)
+		return 0;
+	penalty >>= dt/DAMP_HALFLIFE;
+	r = (dt % DAMP_HALFLIFE)*8;
+	k = r/DAMP_HALFLIFE;
+	f = eighths[k] -
+	    (eighths[k] - eighths[k + 1])*(r - k*DAMP_HALFLIFE)/DAMP_HALFLIFE;
+
+	return (uint64_t)penalty*f/1024;
+}
+
+/*
+ * Accounts for an announcement of `ipnet/cidr` via `gateway`,
+ * where `route` is what we have for it, if anything.  Returns
+ * true if the announcement is to be ignored.
+ */
+bool
+damped(Damper *d, Route *route, uint32_t ipnet, size_t cidr,
+    uint32_t gateway, time_t now)
+{
+	Damp *dp;
+
+	if (!d->enabled)
+		return false;
+	dp = track(d, ipnet, cidr, now);
+	if (dp == NULL) {
+		if (route == NULL || route->gateway == gateway)
+			return false;
+		dp = newdamp(d, ipnet, cidr, route->gateway, now);
+	}
+	if (dp->gateway != gateway)
+		penalize(d, dp, ipnet, cidr, DAMP_CHANGE, now);
+	dp->gateway = gateway;
+	if (!dp->suppressed || (route != NULL && route->gateway == gateway))
+		return false;
+	d->ignored++;
+
+	return true;
+}
+
+// Accounts for the withdrawal of a prefix.
+void
+dampwithdraw(Damper *d, uint32_t ipnet, size_t cidr, uint32_t gateway,
+    time_t now)
+{
+	Damp *dp;
+
+	if (!d->enabled)
+		return;
+	dp = track(d, ipnet, cidr, now);
+	if (dp == NULL)
+		dp = newdamp(d, ipnet, cidr, gateway, now);
+	penalize(d, dp, ipnet, cidr, DAMP_WITHDRAW, now);
+}
+
+// Returns true if the prefix has no damping history.
+bool
+dampquiet(Damper *d, uint32_t ipnet, size_t cidr)
+{
+	return !d->enabled || d->ntracked == 0 ||
+	    ipmapfind(d->prefixes, ipnet, cidr) == NULL;
+}
+
+// Reuses prefixes that have decayed, and forgets those that are quiet.
+void
+dampsweep(Damper *d, time_t now)
+{
+	Sweep s = { d, now, NULL };
+
+	if (!d->enabled)
+		return;
+	ipmapdo(d->prefixes, sweepone, &s);
+	if (s.forget != NULL) {
+		ipmapdo(s.forget, forgetone, d);
+		freeipmap(s.forget, free);
+	}
+}
+
+/*
+ * The penalty is stored as of the last time one was added and
+ * decayed from there when needed, so that frequent updates do
+ * not lose it to rounding.
+ */
+static unsigned int
+penaltyat(Damp *dp, time_t now)
+{
+	return decay(dp->penalty, now - dp->updated);
+}
+
+// Finds the state for a prefix and reuses it if it has decayed.
+static Damp *
+track(Damper *d, uint32_t ipnet, size_t cidr, time_t now)
+{
+	Damp *dp;
+
+	dp = ipmapfind(d->prefixes, ipnet, cidr);
+	if (dp == NULL)
+		return NULL;
+	reuse(d, dp, ipnet, cidr, penaltyat(dp, now));
+
+	return dp;
+}
+
+static Damp *
+newdamp(Damper *d, uint32_t ipnet, size_t cidr, uint32_t gateway,
+    time_t now)
+{
+	Damp *dp;
+
+	dp = calloc(1, sizeof(*dp));
+	if (dp == NULL)
+		fatal("malloc");
+	dp->gateway = gateway;
+	dp->updated = now;
+	ipmapinsert(d->prefixes, ipnet, cidr, dp);
+	d->ntracked++;
+
+	return dp;
+}
+
+static void
+penalize(Damper *d, Damp *dp, uint32_t ipnet, size_t cidr,
+    unsigned int penalty, time_t now)
+{
+	dp->penalty = penaltyat(dp, now) + penalty;
+	dp->updated = now;
+	if (dp->penalty > DAMP_MAX)
+		dp->penalty = DAMP_MAX;
+	if (dp->suppressed || dp->penalty < DAMP_SUPPRESS)
+		return;
+	dp->suppressed = 1;
+	d->nsuppressed++;
+	d->suppressions++;
+	notice("Suppressing flapping route %I/%zu (penalty %u)",
+	    ipnet, cidr, dp->penalty);
+}
+
+static void
+reuse(Damper *d, Damp *dp, uint32_t ipnet, size_t cidr,
+    unsigned int penalty)
+{
+	if (!dp->suppressed || penalty >= DAMP_REUSE)
+		return;
+	dp->suppressed = 0;
+	d->nsuppressed--;
+	d->reuses++;
+	notice("Reusing route %I/%zu", ipnet, cidr);
+}
+
+static void
+sweepone(uint32_t key, size_t keylen, void *dampp, void *sweepp)
+{
+	Damp *dp = dampp;
+	Sweep *s = sweepp;
+	unsigned int penalty;
+
+	penalty = penaltyat(dp, s->now);
+	reuse(s->d, dp, key, keylen, penalty);
+	if (dp->suppressed || penalty >= DAMP_FORGET)
+		return;
+	if (s->forget == NULL)
+		s->forget = mkipmap();
+	ipmapinsert(s->forget, key, keylen, dp);
+}
+
+static void
+forgetone(uint32_t key, size_t keylen, void *dampp, void *damperp)
+{
+	Damper *d = damperp;
+
+	(void)dampp;
+	ipmapremove(d->prefixes, key, keylen);
+	d->ntracked--;
+}
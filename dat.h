@@ -1,19 +1,70 @@
 #include <inttypes.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <time.h>
 
 typedef unsigned char octet;
+typedef struct Aggent Aggent;
+typedef struct Aggregator Aggregator;
+typedef struct Backend Backend;
 typedef struct Bitvec Bitvec;
+typedef struct Bpfinsn Bpfinsn;
+typedef struct Conv Conv;
+typedef struct Damp Damp;
+typedef struct Damper Damper;
+typedef struct Feed Feed;
 typedef struct IPMap IPMap;
+typedef struct Kif Kif;
+typedef struct Kroute Kroute;
+typedef struct Logsite Logsite;
+typedef struct Pktcache Pktcache;
+typedef struct Pktent Pktent;
+typedef struct Reconciler Reconciler;
 typedef struct RIPPacket RIPPacket;
 typedef struct RIPResponse RIPResponse;
 typedef struct Route Route;
+typedef struct Rxstats Rxstats;
+typedef struct Sched Sched;
+typedef struct Schedop Schedop;
+typedef struct Traceev Traceev;
+typedef struct Tracehdr Tracehdr;
 typedef struct Tunnel Tunnel;
+typedef struct Tunpool Tunpool;
 
 enum {
 	MIN_RIP_PACKET_SIZE = 4,
 };
 
+enum {
+	MAX_LOG_MSG = 1024,	// Longer messages are truncated.
+	LOG_RING = 4096,	// Records held for the logger; a power of two.
+	LOG_BURST = 5,		// Messages per call site per period.
+	LOG_PERIOD = 60,	// Seconds.
+	LOG_KEY_QUIET = 600,	// Seconds before a key is reported again.
+	LOG_SITE_KEYS = 64,	// Keys remembered per call site; a power of two.
+};
+
+/*
+ * A rate-limited logging call site.  Each site logs at most
+ * LOG_BURST messages a period, and a message about the same
+ * key at most once every LOG_KEY_QUIET seconds.  Suppressed
+ * messages are counted and summarized when the period ends.
+ */
+struct Logsite {
+	const char *file;
+	int line;
+	int level;
+	int linked;
+	Logsite *next;
+	time_t period;		// When the current period began.
+	int sent;		// Messages logged this period.
+	uint64_t suppressed;	// Since the last summary.
+	struct {
+		uint64_t key;
+		time_t quiet;	// Until when the key is not reported.
+	} keys[LOG_SITE_KEYS];
+};
+
 /*
  * We use a bit vector to keep track of allocated interfaces.
  */
@@ -49,6 +100,29 @@ enum {
 	RIP_RESPONSE_SIZE = 20,
 };
 
+/*
+ * A classic BPF instruction, laid out as the kernel expects
+ * for socket filters.  We generate a filter that passes only
+ * authenticated RIPv2 responses, so that junk never wakes
+ * the daemon.  Socket filters on UDP sockets see the UDP
+ * header in front of the payload.
+ */
+struct Bpfinsn {
+	uint16_t code;
+	uint8_t jt;
+	uint8_t jf;
+	uint32_t k;
+};
+
+enum {
+	MAX_RIP_FILTER = 48,
+	UDP_HEADER_SIZE = 8,
+	RIP_COMMAND_RESPONSE = 2,
+	RIP_VERSION_2 = 2,
+	RIP_AUTH_PASSWORD = 2,
+	RIP_PASSWORD_SIZE = 16,
+};
+
 struct RIPResponse {
 	uint16_t addrfamily;
 	uint16_t routetag;
@@ -63,6 +137,9 @@ struct Route {
 	uint32_t subnetmask;
 	uint32_t gateway;
 	time_t expires;		// Seconds.
+	time_t refreshed;
+	int feed;		// Feed that last refreshed us.
+	int installed;		// In the kernel.
 	Route *rnext;
 	Tunnel *tunnel;
 };
@@ -78,4 +155,471 @@ struct Tunnel {
 	int nref;
 	char ifname[MAX_TUN_IFNAME];
 	unsigned int ifnum;
+	unsigned int ifindex;	// Kernel's index; 0 if not yet known.
+	Tunnel *pnext;		// In the pool, if parked.
+	time_t parked;
+	int pending;		// Operations in flight; see workers.c.
+	int multipoint;		// A peer on the shared interface.
+};
+
+/*
+ * Tunnel interfaces may be brought up and torn down by a pool
+ * of worker threads.  A tunnel's routes are installed once it
+ * is up.
+ */
+enum {
+	MAX_WORKERS = 64,
+};
+
+/*
+ * Peers come and go, and creating a tunnel interface takes
+ * several ioctls, so an interface whose last route goes away
+ * is parked in a pool rather than destroyed.  A parked
+ * interface is reused as is if its peer returns, or pointed
+ * at a new peer.  Parked interfaces keep their bits in the
+ * interface bitmap.  Those idle for POOL_IDLE are destroyed,
+ * but only down to the pool's low-water mark.
+ *
+ * Interfaces to be destroyed are only marked as doomed until
+ * the end of the update cycle, so that a peer that collapses
+ * and comes back within one cycle keeps its interface and the
+ * kernel sees nothing.
+ */
+enum {
+	POOL_MAX = 32,
+	POOL_IDLE = 30*60,	// Seconds.
+};
+
+struct Tunpool {
+	Tunnel *parked;		// Most recently parked first.
+	int nparked;
+	int max;		// 0 disables the pool.
+	int min;
+	Bitvec *interfaces;
+	IPMap *doomed;		// Of Tunnel, by remote.
+	int ndoomed;
+	uint64_t parks;
+	uint64_t reuses;	// By the same peer.
+	uint64_t repoints;	// By another.
+	uint64_t misses;	// Nothing parked.
+	uint64_t destroys;
+	uint64_t revivals;	// Doomed, then wanted again.
+};
+
+/*
+ * Receive-side accounting for a listening socket.  The upstream
+ * sends the whole table as a burst of back-to-back datagrams; a
+ * burst ends when the socket has been idle for BURST_GAP_MS.
+ * The socket receive buffer is sized from the largest burst.
+ */
+enum {
+	BURST_GAP_MS = 2000,
+	MIN_RCVBUF = 256*1024,
+	MAX_RCVBUF = 16*1024*1024,
+	RCVBUF_SLACK = 4,	// Kernel buffer accounting overhead.
+};
+
+struct Rxstats {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t drops;		// Datagrams the kernel dropped.
+	uint64_t bursts;
+	size_t qhiwat;		// Receive queue high-water mark.
+	size_t burstpkts;	// Current burst.
+	size_t burstbytes;
+	uint32_t burstdrops;
+	size_t lastburstpkts;	// Last completed burst.
+	size_t lastburstbytes;
+	uint32_t lastburstdrops;
+	size_t maxburstbytes;
+	uint32_t kdrops;	// Cumulative kernel drop counter.
+	int rcvbuf;		// Current SO_RCVBUF.
+	uint64_t lastrx;	// Nanoseconds.
+};
+
+/*
+ * The upstream rebroadcasts the whole table every few minutes,
+ * and almost every datagram is identical to the one before.  A
+ * feed remembers recent datagrams each of whose entries
+ * refreshed a route.  When one comes again, and no route has
+ * been moved, removed or damped since (the route table's
+ * generation is the same), only the routes' expiry needs
+ * pushing back.  Datagrams are found by a hash of their
+ * entries, and then compared in full.
+ */
+enum {
+	PKTCACHE_SLOTS = 256,
+};
+
+struct Pktent {
+	uint64_t hash;
+	uint64_t gen;
+	octet *data;
+	size_t len;
+	size_t maxlen;
+	Route **routes;
+	size_t nroutes;
+	size_t maxroutes;
+};
+
+struct Pktcache {
+	Pktent slots[PKTCACHE_SLOTS];
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t stale;		// Found, but the table has changed.
+};
+
+/*
+ * A feed is a socket listening for RIP broadcasts on some
+ * interface, group and port.  All feeds update the same
+ * route table.  Redundant feeds usually carry the same
+ * announcements a few seconds apart; an entry that some
+ * other feed refreshed within DUP_WINDOW is skipped.
+ */
+enum {
+	MAX_FEEDS = 8,
+	DUP_WINDOW = 60,	// Seconds.
+};
+
+struct Feed {
+	int id;
+	int sd;
+	const char *iface;
+	const char *group;
+	int port;
+	Rxstats rx;
+	uint64_t parseerrs;
+	uint64_t authfails;
+	uint64_t entries;
+	uint64_t badentries;
+	uint64_t dups;		// Entries another feed already refreshed.
+	uint64_t conflicts;	// ...to a different gateway.
+	uint64_t unchanged;	// Entries that only refreshed a route.
+	uint64_t bulk;		// Entries refreshed from the cache.
+	Pktcache cache;
+};
+
+/*
+ * What a backend finds already in the kernel: a tunnel
+ * interface, or a route out of some interface.
+ */
+struct Kif {
+	char ifname[MAX_TUN_IFNAME];
+	unsigned int ifindex;
+	uint32_t local;
+	uint32_t remote;
+};
+
+struct Kroute {
+	uint32_t ipnet;
+	uint32_t subnetmask;
+	unsigned int ifindex;
+	uint32_t gateway;	// 0 for an interface route.
+};
+
+/*
+ * The operations that change kernel state.  The daemon drives
+ * whichever backend is selected at startup: the platform's
+ * own, or a simulation that keeps its state in memory.
+ *
+ * A backend may queue route operations until `flush` ends the
+ * transaction, and may deliver kernel replies asynchronously
+ * on `pollfd`, which the event loop hands to `input` when it
+ * is readable.  `busy` says whether any operations are queued
+ * or not yet acknowledged.  Those four, and `stats`, may be
+ * nil.
+ *
+ * `retunnel` points an existing tunnel interface at the
+ * tunnel's current endpoints; without it, parked interfaces
+ * can only be reused by the same peer.  It may be nil.
+ *
+ * `scantunnels` and `scanroutes` report the tunnels and the
+ * routes in `rtable` that are already in the kernel, so the
+ * daemon can adopt them at startup.  They may be nil too.
+ *
+ * A backend with `multipoint` set can bring up a tunnel with no
+ * remote, through which any peer can be reached.  Routes on a
+ * tunnel marked multipoint go out that shared interface with
+ * the tunnel's remote as an on-link gateway.
+ */
+struct Backend {
+	const char *name;
+	int multipoint;
+	void (*initsys)(int rtable);
+	int (*uptunnel)(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint);
+	int (*downtunnel)(Tunnel *tunnel);
+	int (*retunnel)(Tunnel *tunnel);
+	int (*addroute)(Route *route, Tunnel *tunnel, int rtable);
+	int (*chroute)(Route *route, Tunnel *tunnel, int rtable);
+	int (*rmroute)(Route *route, int rtable);
+	void (*flush)(void);
+	int (*pollfd)(void);
+	void (*input)(void);
+	int (*busy)(void);
+	void (*stats)(FILE *fp);
+	int (*scantunnels)(void (*fn)(Kif *kif, void *arg), void *arg);
+	int (*scanroutes)(int rtable, void (*fn)(Kroute *kr, void *arg), void *arg);
+};
+
+/*
+ * The reconciler periodically compares the kernel's routing
+ * table with ours and corrects any drift.  A run snapshots
+ * the kernel's table, then examines RECONCILE_CHUNK entries
+ * per step, issuing at most RECONCILE_OPS kernel operations
+ * and stopping early once a step has taken RECONCILE_STEP_NS.
+ */
+enum {
+	RECONCILE_INTERVAL = 10*60,	// Seconds.
+	RECONCILE_CHUNK = 256,
+	RECONCILE_OPS = 64,
+	RECONCILE_STEP_NS = 2*1000*1000,
+	RECONCILE_PAUSE_MS = 10,	// Between steps.
+};
+
+struct Reconciler {
+	IPMap *routes;
+	IPMap *tunnels;
+	int rtable;
+	int interval;		// Seconds; 0 disables.
+	int phase;		// 0 if idle.
+	uint64_t nextrun;	// Nanoseconds.
+	uint64_t nextstep;
+	time_t snaptime;
+	Kroute *kroutes;	// The kernel's table at snaptime.
+	size_t nkroutes;
+	size_t maxkroutes;
+	Kroute *ours;		// Prefixes in our table at snaptime.
+	size_t nours;
+	size_t maxours;
+	size_t cursor;
+	IPMap *kfib;		// Of kroutes, by prefix.
+	IPMap *ifindices;	// Our tunnels' interfaces.
+	uint64_t runs;
+	uint64_t steps;
+	uint64_t checked;
+	uint64_t missing;	// Routes re-added.
+	uint64_t moved;		// Routes on the wrong interface.
+	uint64_t stale;		// Routes removed.
+	uint64_t deferred;	// Steps cut short by the budget.
+};
+
+/*
+ * Flap damping, after BGP's (RFC 2439).  Each time a prefix
+ * is withdrawn or its announced gateway changes, it accrues a
+ * penalty that decays with a half-life of DAMP_HALFLIFE.  Once
+ * the penalty passes DAMP_SUPPRESS, announcements that would
+ * change the prefix are ignored until it decays below
+ * DAMP_REUSE.  The cap, DAMP_MAX, bounds suppression to four
+ * half-lives.  State is forgotten once the penalty is below
+ * DAMP_FORGET.
+ */
+enum {
+	DAMP_WITHDRAW = 1000,
+	DAMP_CHANGE = 500,
+	DAMP_SUPPRESS = 2000,
+	DAMP_REUSE = 750,
+	DAMP_FORGET = DAMP_REUSE/2,
+	DAMP_MAX = DAMP_REUSE*16,
+	DAMP_HALFLIFE = 15*60,	// Seconds.
+};
+
+struct Damp {
+	uint32_t gateway;	// Last announced.
+	unsigned int penalty;	// As of `updated`.
+	time_t updated;		// When it was last penalized.
+	int suppressed;
+};
+
+struct Damper {
+	IPMap *prefixes;	// Of Damp.
+	int enabled;
+	size_t ntracked;
+	size_t nsuppressed;
+	uint64_t suppressions;
+	uint64_t reuses;
+	uint64_t ignored;	// Announcements not acted on.
+};
+
+/*
+ * Route aggregation.  Rather than one kernel route per prefix
+ * in our table, the kernel gets the smallest set we can find
+ * that forwards every address the same way: siblings on the
+ * same tunnel are merged into their parent, and prefixes whose
+ * nearest covering route already goes to the same tunnel are
+ * left out.  The set is recomputed when the table has changed
+ * and only the differences are sent to the kernel.
+ */
+struct Aggent {
+	uint32_t ipnet;
+	size_t cidr;
+	Tunnel *tunnel;
+};
+
+struct Aggregator {
+	IPMap *routes;		// Ours.
+	IPMap *fib;		// Routes installed in the kernel.
+	int rtable;
+	int enabled;
+	int dirty;
+	Aggent *in;		// Scratch: our routes, sorted.
+	size_t nin;
+	size_t maxin;
+	Aggent *out;		// Scratch: the aggregates.
+	size_t nout;
+	size_t maxout;
+	size_t nroutes;		// In the last run.
+	size_t naggregates;
+	uint64_t runs;
+	uint64_t adds;
+	uint64_t changes;
+	uint64_t removes;
+};
+
+/*
+ * The scheduler sits between the daemon's decisions and the
+ * kernel.  Route operations are queued by priority, highest
+ * first: new reachability, then changes, withdrawals, and last
+ * refreshes that only re-assert what the kernel should already
+ * have.  They are issued at no more than `rate` per second,
+ * with bursts of up to `burst`, so that a mass change cannot
+ * saturate the routing socket and starve packet processing.
+ * A rate of 0 means no limit.
+ *
+ * At most one operation per prefix is queued: a later one is
+ * merged with it into their net effect.  An add then a remove
+ * cancel out; a remove then an add is a change; otherwise the
+ * later operation wins.  The merged operation keeps the higher
+ * of the two classes, but a remove is always a withdrawal.
+ */
+enum {
+	SCHED_ADD,
+	SCHED_CHANGE,
+	SCHED_REMOVE,
+
+	PRIO_NEW = 0,
+	PRIO_CHANGE,
+	PRIO_WITHDRAW,
+	PRIO_REFRESH,
+	NPRIO,
+};
+
+struct Schedop {
+	int op;
+	int prio;
+	Route route;		// Copies; the originals may be gone
+	Tunnel tunnel;		// by the time we get to them.
+	int hastunnel;
+	int rtable;
+	uint64_t queued;	// When, in ns.
+	Schedop *prev;
+	Schedop *next;
+};
+
+struct Sched {
+	unsigned int rate;	// Per second.
+	unsigned int burst;
+	uint64_t tokens;	// In millionths.
+	uint64_t refilled;	// When, in ns.
+	uint64_t started;	// Likewise.
+	Schedop *head[NPRIO];
+	Schedop *tail[NPRIO];
+	IPMap *pending;		// Of Schedop, by prefix.
+	size_t depth;
+	size_t maxdepth;
+	uint64_t queued[NPRIO];
+	uint64_t issued[NPRIO];
+	uint64_t coalesced;	// Merged into a queued one.
+	uint64_t cancelled;	// Of those, cancelled out.
+	uint64_t waitns;	// Total time queued.
+	uint64_t maxwaitns;
+};
+
+/*
+ * The event trace: a file-backed ring of fixed-size binary
+ * events, for working out after the fact what happened to a
+ * route during an incident.  Fields are raw: addresses and
+ * netmasks in host order, kernel sequence numbers as sent.
+ * See trace.c, and tracedump.c to read one.
+ */
+enum {
+	TRACE_PACKET = 1,	// a: feed, b: length.
+	TRACE_ENTRY,		// a: ipaddr, b: subnetmask, c: nexthop, d: feed.
+	TRACE_ROUTE_ADD,	// a: ipnet, b: subnetmask, c: gateway, d: feed.
+	TRACE_ROUTE_CHANGE,	// Likewise, but d: the old gateway.
+	TRACE_ROUTE_REFRESH,	// Likewise, d: feed.
+	TRACE_ROUTE_BULK,	// a: feed, b: routes refreshed.
+	TRACE_ROUTE_EXPIRE,	// a: ipnet, b: subnetmask, c: gateway.
+	TRACE_ROUTE_DESTROY,	// Likewise.
+	TRACE_TUNNEL_UP,	// a: remote, b: local, c: ifnum, d: errno.
+	TRACE_TUNNEL_DOWN,	// Likewise.
+	TRACE_TUNNEL_IDLE,	// a: remote, c: ifnum; its last route went.
+	TRACE_KOP,		// a: ipnet, b: subnetmask, c: gateway, d: op.
+	TRACE_KSEND,		// a: first seq, b: last seq, c: messages.
+	TRACE_KACK,		// a: seq, b: errno, c: ipnet, d: subnetmask.
+	NTRACE,
+};
+
+enum {
+	TRACE_EVENTS = 65536,	// In the ring; a power of two.
+	TRACE_VERSION = 1,
+};
+
+#define TRACE_MAGIC	"44ripdtr"
+
+struct Tracehdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t evsize;
+	uint64_t nevents;
+	_Atomic uint64_t head;	// Events ever written.
+	octet pad[32];
+};
+
+struct Traceev {
+	_Atomic uint64_t seq;	// Position + 1, once written.
+	uint64_t ns;		// Since the epoch.
+	uint32_t type;
+	uint32_t a, b, c, d;
+	uint32_t pad;
+};
+
+/*
+ * Stages whose latencies are profiled; see prof.c.  Stages
+ * nest: an entry includes any tunnel it brings up, and a
+ * packet includes everything done for it.
+ */
+enum {
+	STAGE_PACKET,		// All of ripinput.
+	STAGE_RECV,
+	STAGE_PARSE,
+	STAGE_AUTH,
+	STAGE_ENTRY,		// Deciding what to do with one entry.
+	STAGE_TUNNEL,		// Bringing up a tunnel interface.
+	STAGE_INSTALL,		// Handing route changes to the kernel.
+	STAGE_EXPIRE,		// Walking the routes for expired ones.
+	NSTAGE,
+};
+
+/*
+ * Convergence tracking; see conv.c.  An episode runs from the
+ * first datagram of a broadcast until the feeds have gone quiet
+ * and the kernel has acknowledged everything asked of it.
+ * Times are nanoseconds on the monotonic clock.
+ */
+struct Conv {
+	uint64_t started;
+	uint64_t firstrx;	// First datagram ever, or 0.
+	uint64_t coldstart;	// Start to first convergence, or 0.
+	uint64_t begin;		// First datagram of the episode, or 0.
+	uint64_t settled;	// When nothing was last outstanding.
+	uint64_t *times;	// Announced at, then latency once confirmed.
+	size_t nchanges;
+	size_t nconfirmed;
+	size_t cap;
+	uint64_t episodes;
+	uint64_t quiet;		// Episodes that changed no route.
+	uint64_t changes;
+	uint64_t last;		// Duration of the last episode.
+	uint64_t lastp50, lastp90, lastp99, lastmax;	// Its per-route latencies.
+	uint64_t maxepisode;
 };
@@ -2,12 +2,16 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <syslog.h>
 
 uint32_t readnet32(const octet data[static 4]);
 uint16_t readnet16(const octet data[static 2]);
 int parserippkt(const octet *restrict data, size_t len, RIPPacket *restrict packet);
 int verifyripauth(RIPPacket *restrict packet, const char *restrict password);
 int parseripresponse(const RIPPacket *restrict pkt, int k, RIPResponse *restrict response);
+size_t mkripfilter(const char *password, size_t off, Bpfinsn *prog, size_t max);
 bool isvalidnetmask(uint32_t netmask);
 unsigned int netmask2cidr(uint32_t netmask);
 uint32_t cidr2netmask(unsigned int cidr);
@@ -23,12 +27,70 @@ void *ipmapremove(IPMap *map, uint32_t key, size_t keylen);
 void *ipmapnearest(IPMap *map, uint32_t key, size_t keylen);
 void *ipmapfind(IPMap *map, uint32_t key, size_t keylen);
 int initsock(const char *restrict iface, const char *restrict group, int port, int rtable);
+int setbackend(const char *spec);
+const char *backendname(void);
+int sysmultipoint(void);
 void initsys(int rtable);
+void sysflush(void);
+int sysfd(void);
+void sysinput(void);
+int sysbusy(void);
+void statsbackend(FILE *fp);
+int scantunnels(void (*fn)(Kif *kif, void *arg), void *arg);
+int scanroutes(int rtable, void (*fn)(Kroute *kr, void *arg), void *arg);
+ssize_t recvpkt(int sd, octet *buf, size_t size, uint32_t *drops);
+size_t rxqueued(int sd);
+int rxdrops(int sd, uint32_t *drops);
+int setrcvbuf(int sd, int size);
+int attachfilter(int sd, const Bpfinsn *prog, size_t len);
 int uptunnel(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint);
 int downtunnel(Tunnel *tunnel);
+int retunnel(Tunnel *tunnel);
 int addroute(Route *route, Tunnel *tunnel, int rtable);
 int chroute(Route *route, Tunnel *tunnel, int rtable);
 int rmroute(Route *route, int rtable);
+int refreshroute(Route *route, Tunnel *tunnel, int rtable);
+int sysroute(int op, Route *route, Tunnel *tunnel, int rtable);
+void setsched(Sched *s);
+void initsched(Sched *s, unsigned int rate, unsigned int burst);
+int schedroute(Sched *s, int op, int prio, Route *route, Tunnel *tunnel, int rtable);
+int schedrun(Sched *s);
+void scheddrain(Sched *s);
+int schedwait(Sched *s);
+void initdamper(Damper *d, int enabled);
+bool damped(Damper *d, Route *route, uint32_t ipnet, size_t cidr, uint32_t gateway, time_t now);
+void dampwithdraw(Damper *d, uint32_t ipnet, size_t cidr, uint32_t gateway, time_t now);
+void dampsweep(Damper *d, time_t now);
+bool dampquiet(Damper *d, uint32_t ipnet, size_t cidr);
+uint64_t pkthash(const octet *data, size_t len);
+Pktent *pktlookup(Pktcache *c, uint64_t hash, const octet *data, size_t len, uint64_t gen);
+void pktfill(Pktcache *c, uint64_t hash, const octet *data, size_t len, uint64_t gen, Route **routes, size_t nroutes);
+void pktforget(Pktcache *c, uint64_t hash);
+unsigned int decay(unsigned int penalty, time_t dt);
+void initpool(Tunpool *pool, int max, Bitvec *interfaces);
+void park(Tunpool *pool, Tunnel *tunnel, time_t now);
+Tunnel *unpark(Tunpool *pool, uint32_t remote);
+void prunepool(Tunpool *pool, time_t now);
+void drainpool(Tunpool *pool);
+void poolflush(Tunpool *pool);
+void initworkers(int n, int rdomain, int tunneldomain, uint32_t endpoint, void (*ready)(Tunnel *tunnel, int err));
+void tunnelup(Tunnel *tunnel);
+void tunneldestroy(Tunnel *tunnel, Bitvec *interfaces);
+void tunnelsync(Tunnel *tunnel);
+int workersfd(void);
+void workersinput(void);
+int workersbusy(void);
+void statsworkers(FILE *fp);
+void initaggregator(Aggregator *a, IPMap *routes, int rtable, int enabled);
+void aggchanged(Aggregator *a);
+void aggadopt(Aggregator *a, Route *route);
+void aggflush(Aggregator *a, time_t now);
+void initreconcile(Reconciler *rc, IPMap *routes, IPMap *tunnels, int rtable, int interval);
+void reconcilestart(Reconciler *rc);
+int reconcilewait(Reconciler *rc);
+void reconcilestep(Reconciler *rc);
+int simconfig(const char *opts);
+int simverify(IPMap *routes, IPMap *tunnels);
 void ipaddrstr(uint32_t addr, char buf[static INET_ADDRSTRLEN]);
 void routestr(Route *route, Tunnel *tunnel, char *buf, size_t size);
 Bitvec *mkbitvec(void);
@@ -38,15 +100,123 @@ void bitset(Bitvec *bits, size_t bit);
 void bitclr(Bitvec *bits, size_t bit);
 size_t nextbit(Bitvec *bits);
 unsigned int strnum(const char *restrict str);
+uint64_t nsec(void);
+FILE *statsbegin(const char *path);
+void statsend(FILE *fp, const char *path);
+void statsrx(FILE *fp, const char *prefix, Rxstats *rx);
+void statsfeed(FILE *fp, Feed *feed);
+void statsreconcile(FILE *fp, Reconciler *rc);
+void statspool(FILE *fp, Tunpool *pool);
+void statsdamper(FILE *fp, Damper *d);
+void statsaggregator(FILE *fp, Aggregator *a);
+void statssched(FILE *fp, Sched *s);
+int readcapture(const char *path, void (*fn)(const octet *pkt, size_t len, uint64_t ts, void *arg), void *arg);
+
+/*
+ * Messages below the current level cost one comparison: the
+ * check comes before the arguments are evaluated.  Besides the
+ * usual conversions and %m, messages take %I for an address
+ * held as a uint32_t in host order, so that callers need not
+ * render addresses that may never be logged.
+ */
+#define logging(level)	((level) <= loglevel)
+#define debug(...)	do { if (logging(LOG_DEBUG)) logmsg(LOG_DEBUG, __VA_ARGS__); } while (0)
+#define info(...)	do { if (logging(LOG_INFO)) logmsg(LOG_INFO, __VA_ARGS__); } while (0)
+#define notice(...)	do { if (logging(LOG_NOTICE)) logmsg(LOG_NOTICE, __VA_ARGS__); } while (0)
+
+/*
+ * For anomalies that repeat with every broadcast.  `key` names
+ * what the message is about, such as a prefix, so that it is
+ * reported once and then only now and again; see Logsite.
+ */
+#define ratelog(level, key, now, ...)	do { \
+	static Logsite site_ = { __FILE__, __LINE__ }; \
+	if (logging(level) && logallow(&site_, (level), (key), (now))) \
+		logmsg((level), __VA_ARGS__); \
+} while (0)
+
+extern int loglevel;
+
+/*
+ * Costs one comparison unless tracing; the arguments are not
+ * evaluated.  See Traceev in dat.h.
+ */
+#define trace(type, a, b, c, d)	do { \
+	if (tracering != NULL) \
+		traceev((type), (a), (b), (c), (d)); \
+} while (0)
+
+extern Tracehdr *tracering;
+
+/*
+ * Static probes, in pairs around each stage of handling a
+ * datagram, for tools such as bpftrace, perf and SystemTap to
+ * attach to as usdt:44ripd:ripd:name.  Where <sys/sdt.h> is to
+ * be had, each probe is a nop and a note in the binary; there
+ * or elsewhere, -DNO_PROBES (make PROBES=no) leaves nothing.
+ */
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define probe(name)			DTRACE_PROBE(ripd, name)
+#define probe1(name, a)			DTRACE_PROBE1(ripd, name, a)
+#define probe2(name, a, b)		DTRACE_PROBE2(ripd, name, a, b)
+#define probe3(name, a, b, c)		DTRACE_PROBE3(ripd, name, a, b, c)
+#define probe4(name, a, b, c, d)	DTRACE_PROBE4(ripd, name, a, b, c, d)
+#else
+#define probe(name)			do { } while (0)
+#define probe1(name, a)			do { } while (0)
+#define probe2(name, a, b)		do { } while (0)
+#define probe3(name, a, b, c)		do { } while (0)
+#define probe4(name, a, b, c, d)	do { } while (0)
+#endif
+
+/*
+ * Time a stage with t0 = profstart(); ... profend(stage, t0).
+ * When not profiling, this costs a test.
+ */
+#define profstart()	(profiling ? profclock() : 0)
+#define profend(stage, t0)	do { \
+	if ((t0) != 0) \
+		profadd((stage), profclock() - (t0)); \
+} while (0)
+
+extern int profiling;
+
+uint64_t profclock(void);
+void profadd(int stage, uint64_t ns);
+void profdump(int reset);
+void statsprof(FILE *fp);
+
+void initconv(Conv *c, uint64_t now);
+void convrx(Conv *c, uint64_t now);
+void convchange(Conv *c, uint64_t announced);
+void convcheck(Conv *c, uint64_t now, int busy, int bursting);
+void statsconv(FILE *fp, Conv *c);
+
+void starttrace(const char *path, size_t nevents);
+void traceev(uint32_t type, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+void statstrace(FILE *fp);
 
 void initlog(void);
-void debug(const char *restrict fmt, ...);
-void info(const char *restrict fmt, ...);
-void notice(const char *restrict fmt, ...);
+void startlogger(const char *path, int threaded);
+void logmsg(int level, const char *restrict fmt, ...);
+void logdrain(void);
+int logallow(Logsite *site, int level, uint64_t key, time_t now);
+void logsummary(time_t now);
+void statslog(FILE *fp);
+size_t vlogfmt(char *buf, size_t size, const char *restrict fmt, va_list ap);
 void error(const char *restrict fmt, ...);
 void fatal(const char *restrict fmt, ...);
 
 #ifdef USE_COMPAT
 void *reallocarray(void *p, size_t nelem, size_t size);
 void *recallocarray(void *p, size_t oelem, size_t nelem, size_t size);
+size_t strlcpy(char *dst, const char *src, size_t size);
+size_t strlcat(char *dst, const char *src, size_t size);
 #endif  // USE_COMPAT
@@ -1,10 +1,9 @@
 #include <assert.h>
 #include <inttypes.h>
-#include <stdarg.h>
 #include <stddef.h>
 #include <stdlib.h>
-#include <syslog.h>
 #include <string.h>
+#include <time.h>
 
 #include "dat.h"
 #include "fns.h"
@@ -71,6 +70,13 @@ revbits(uint32_t w)
 	return w;
 }
 
+// Mask of the low `len` bits; shifting by the full width is undefined.
+static inline uint32_t
+lowmask(size_t len)
+{
+	return (len >= 32) ? ~0U : (1U << len) - 1;
+}
+
 void *
 ipmapnearest(IPMap *map, uint32_t key, size_t keylen)
 {
@@ -78,7 +84,7 @@ ipmapnearest(IPMap *map, uint32_t key, size_t keylen)
 	IPMap *parent = NULL;
 
 	while (map != NULL && map->keylen <= keylen) {
-		uint32_t rkeymask = (1 << map->keylen) - 1;
+		uint32_t rkeymask = lowmask(map->keylen);
 		uint32_t rkeyfrag = rkey & rkeymask;
 		if (map->key != rkeyfrag)
 			break;
@@ -102,7 +108,7 @@ ipmapfind(IPMap *map, uint32_t key, size_t keylen)
 	uint32_t rkey = revbits(key);
 
 	while (map != NULL && map->keylen <= keylen) {
-		uint32_t rkeymask = (1 << map->keylen) - 1;
+		uint32_t rkeymask = lowmask(map->keylen);
 		uint32_t rkeyfrag = rkey & rkeymask;
 		if (map->key != rkeyfrag)
 			break;
@@ -167,13 +173,13 @@ freeipmap(IPMap *map, void (*freedatum)(void *datum))
 	if (map == NULL) return;
 	freeipmap(map->left, freedatum);
 	freeipmap(map->right, freedatum);
-	if (map->datum != NULL)
+	if (map->datum != NULL && freedatum != NULL)
 		freedatum(map->datum);
 	free(map);
 }
 
-void *
-ipmapinsert(IPMap *root, uint32_t key, size_t keylen, void *datum)
+static void *
+insertnode(IPMap *root, uint32_t key, size_t keylen, void *datum)
 {
 	IPMap *map;
 	uint32_t rkey = revbits(key);		// Reverse key bits.
@@ -253,14 +259,24 @@ ipmapinsert(IPMap *root, uint32_t key, size_t keylen, void *datum)
 }
 
 void *
-ipmapremove(IPMap *root, uint32_t key, size_t akeylen)
+ipmapinsert(IPMap *root, uint32_t key, size_t keylen, void *datum)
+{
+	void *r;
+
+	probe2(ipmap_insert_start, key, keylen);
+	r = insertnode(root, key, keylen, datum);
+	probe1(ipmap_insert_done, r == datum);
+
+	return r;
+}
+
+static void *
+removenode(IPMap *root, uint32_t key, size_t akeylen)
 {
 	IPMap *map, *parent, **pmap;
 	uint32_t rkey = revbits(key);		// Reverse key bits.
 	size_t keylen = akeylen;
-	char pkey[INET_ADDRSTRLEN];
 
-	ipaddrstr(key, pkey);
 	pmap = NULL;
 	parent = NULL;
 	map = root;
@@ -326,8 +342,8 @@ ipmapremove(IPMap *root, uint32_t key, size_t akeylen)
                 }
 		nkcp = cprefix(nmin(keylen, map->keylen), rkey, map->key);
 		if (nkcp != 0 && nkcp != map->keylen) {
-			notice("ipmapremove: divergent key for %s/%zu (nkcp = %zu, keylen = %zu)",
-			    pkey, akeylen, nkcp, map->keylen);
+			notice("ipmapremove: divergent key for %I/%zu (nkcp = %zu, keylen = %zu)",
+			    key, akeylen, nkcp, map->keylen);
 			return NULL;
 		}
 		assert(nkcp < keylen);
@@ -342,11 +358,23 @@ ipmapremove(IPMap *root, uint32_t key, size_t akeylen)
 			map = map->right;
 		}
 	}
-	notice("ipmapremove: key %s/%zu not found", pkey, akeylen);
+	notice("ipmapremove: key %I/%zu not found", key, akeylen);
 
 	return NULL;
 }
 
+void *
+ipmapremove(IPMap *root, uint32_t key, size_t keylen)
+{
+	void *r;
+
+	probe2(ipmap_remove_start, key, keylen);
+	r = removenode(root, key, keylen);
+	probe1(ipmap_remove_done, r != NULL);
+
+	return r;
+}
+
 enum
 {
 	IPMAP_PREORDER = -1,
@@ -532,54 +560,13 @@ strnum(const char *restrict str)
 	return (unsigned int)r;
 }
 
-void
-initlog(void)
-{
-	openlog("44ripd", LOG_CONS | LOG_PERROR | LOG_PID, LOG_LOCAL0);
-}
-
-void
-debug(const char *fmt, ...)
+// Returns a monotonic timestamp in nanoseconds.
+uint64_t
+nsec(void)
 {
-	va_list ap;
-	va_start(ap, fmt);
-	vsyslog(LOG_DEBUG, fmt, ap);
-	va_end(ap);
-}
+	struct timespec ts;
 
-void
-info(const char *fmt, ...)
-{
-	va_list ap;
-	va_start(ap, fmt);
-	vsyslog(LOG_INFO, fmt, ap);
-	va_end(ap);
-}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-void
-notice(const char *fmt, ...)
-{
-	va_list ap;
-	va_start(ap, fmt);
-	vsyslog(LOG_NOTICE, fmt, ap);
-	va_end(ap);
-}
-
-void
-error(const char *fmt, ...)
-{
-	va_list ap;
-	va_start(ap, fmt);
-	vsyslog(LOG_ERR, fmt, ap);
-	va_end(ap);
-}
-
-void
-fatal(const char *fmt, ...)
-{
-	va_list ap;
-	va_start(ap, fmt);
-	vsyslog(LOG_ERR, fmt, ap);
-	va_end(ap);
-	exit(EXIT_FAILURE);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
 }
@@ -0,0 +1,1030 @@
+/*
+ * Linux support.  Tunnels are ipip interfaces and both they
+ * and routes are programmed through rtnetlink.  Route changes
+ * are packed back to back into a single buffer and handed to
+ * the kernel with one sendmsg when the daemon ends a
+ * transaction; only the last message of each batch asks for
+ * an acknowledgement, since the kernel reports failures
+ * whether or not we ask.  Replies are read from the event
+ * loop.
+ *
+ * With a multipoint tunnel, an ipip interface with no remote
+ * end, a peer's routes go out that one interface via the peer
+ * as an on-link gateway, so no interface is needed per peer.
+ *
+ * Linux has no routing domains.  Routes are installed in
+ * table `rtable`; the tunnel endpoints always route in the
+ * main table.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_link.h>
+#include <linux/if_tunnel.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "fns.h"
+
+static void kinitsys(int rtable);
+static int kuptunnel(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint);
+static int kdowntunnel(Tunnel *tunnel);
+static int kaddroute(Route *route, Tunnel *tunnel, int rtable);
+static int kchroute(Route *route, Tunnel *tunnel, int rtable);
+static int krmroute(Route *route, int rtable);
+static void kflush(void);
+static int kpollfd(void);
+static void kinput(void);
+static void kstats(FILE *fp);
+static int kscantunnels(void (*fn)(Kif *kif, void *arg), void *arg);
+static int kscanroutes(int rtable, void (*fn)(Kroute *kr, void *arg), void *arg);
+
+enum {
+	RTPROT_44RIPD = 44,		// Marks routes as ours.
+	NLBUF_SIZE = 64*1024,		// One batch.
+	NLRCVBUF_SIZE = 1024*1024,
+	MAX_NLOPS = 4096,		// Operations remembered for errors.
+	NLLINK_SIZE = 1024,		// One link request.
+	TUNNEL_TTL = 64,
+};
+
+/*
+ * What we asked the kernel to do, so that an error reply
+ * can be reported in terms of the route it refers to.
+ */
+typedef struct Nlop Nlop;
+struct Nlop {
+	uint32_t seq;
+	int type;
+	uint32_t ipnet;
+	uint32_t subnetmask;
+	uint32_t gateway;
+	char ifname[MAX_TUN_IFNAME];
+};
+
+typedef struct Nlstats Nlstats;
+struct Nlstats {
+	uint64_t batches;
+	uint64_t messages;
+	uint64_t sends;
+	uint64_t acks;
+	uint64_t errors;
+	uint64_t overruns;
+	uint64_t lostacks;	// Batches whose acknowledgement was lost.
+};
+
+/*
+ * Tunnels are set up with one synchronous request at a time,
+ * possibly from several worker threads at once, so each thread
+ * has its own socket and buffer for them.
+ */
+typedef struct Nllink Nllink;
+struct Nllink {
+	int fd;
+	uint32_t seq;
+	alignas(NLMSG_ALIGNTO) octet buf[NLLINK_SIZE];
+};
+
+static _Thread_local Nllink nllink = { .fd = -1 };
+static int nlfd = -1;
+static alignas(NLMSG_ALIGNTO) octet nlbuf[NLBUF_SIZE];
+static size_t nllen;		// Bytes queued in nlbuf.
+static size_t nllast;		// Offset of the last queued message.
+static size_t nlqueued;		// Messages queued in nlbuf.
+static uint32_t nlseq;
+static uint32_t nlacked;	// Highest sequence number acknowledged.
+static uint32_t nlsent;		// That of the last batch sent.
+static Nlop nlops[MAX_NLOPS];
+static Nlstats nlstats;
+
+static void
+kinitsys(int rtable)
+{
+	struct sockaddr_nl snl;
+	int size, on;
+
+	(void)rtable;
+	nlfd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nlfd < 0)
+		fatal("netlink socket: %m");
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	if (bind(nlfd, (struct sockaddr *)&snl, sizeof(snl)) < 0)
+		fatal("netlink bind: %m");
+	// Errors for a whole batch may arrive at once.
+	size = NLRCVBUF_SIZE;
+	if (setsockopt(nlfd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+	    setsockopt(nlfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+		error("netlink SO_RCVBUF: %m");
+#ifdef NETLINK_CAP_ACK
+	// Don't echo our requests back in error replies.
+	on = 1;
+	if (setsockopt(nlfd, SOL_NETLINK, NETLINK_CAP_ACK, &on, sizeof(on)) < 0)
+		error("netlink NETLINK_CAP_ACK: %m");
+#else
+	(void)on;
+#endif
+	nlseq = getpid();
+	nlacked = nlseq - 1;
+	nlsent = nlacked;
+}
+
+int
+initsock(const char *restrict iface, const char *restrict group, int port, int rtable)
+{
+	int sd, on;
+	uint32_t ifaddr;
+	struct sockaddr_in sin;
+	struct ip_mreq mr;
+
+	(void)rtable;
+	ifaddr = htonl(INADDR_ANY);
+	if (strcmp(iface, "*") != 0) {
+		struct in_addr addr;
+		memset(&addr, 0, sizeof(addr));
+		if (inet_pton(AF_INET, iface, &addr) < 0)
+			fatal("bad interface address: %m");
+		ifaddr = addr.s_addr;
+	}
+
+	sd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sd < 0)
+		fatal("socket: %m");
+	on = 1;
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+		fatal("setsockopt SO_REUSEADDR: %m");
+	// Several feeds may listen on the same port.
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+		fatal("setsockopt SO_REUSEPORT: %m");
+	// Have the kernel report its drop counter with each datagram.
+	if (setsockopt(sd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+		error("setsockopt SO_RXQ_OVFL: %m");
+	/*
+	 * Linux otherwise delivers every group any socket has joined
+	 * to each socket on the port, whatever it joined itself.
+	 */
+	on = 0;
+	if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_ALL, &on, sizeof(on)) < 0)
+		fatal("setsockopt IP_MULTICAST_ALL: %m");
+	memset(&mr, 0, sizeof(mr));
+	if (inet_pton(AF_INET, group, &mr.imr_multiaddr.s_addr) != 1)
+		fatal("bad group address: %s", group);
+	mr.imr_interface.s_addr = ifaddr;
+	/*
+	 * Bind to the group, not the interface address: a socket
+	 * bound to a unicast address receives no multicast.  The
+	 * membership selects the interface.
+	 */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr = mr.imr_multiaddr;
+	if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+		fatal("bind: %m");
+	if (setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0)
+		fatal("setsockopt IP_ADD_MEMBERSHIP: %m");
+
+	return sd;
+}
+
+/*
+ * Receive a datagram.  If the kernel attached its count of
+ * datagrams dropped on the socket, store it in `drops`.
+ */
+ssize_t
+recvpkt(int sd, octet *buf, size_t size, uint32_t *drops)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(uint32_t))];
+	} cmsgbuf;
+	ssize_t n;
+
+	assert(drops != NULL);
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+	n = recvmsg(sd, &msg, 0);
+	if (n < 0)
+		return n;
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	    cm != NULL;
+	    cm = CMSG_NXTHDR(&msg, cm))
+	{
+		if (cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SO_RXQ_OVFL)
+			memmove(drops, CMSG_DATA(cm), sizeof(*drops));
+	}
+
+	return n;
+}
+
+/*
+ * Returns the number of bytes waiting in the receive queue.
+ * FIONREAD on a UDP socket only reports the first datagram,
+ * so ask for the memory charged to the socket instead.
+ */
+size_t
+rxqueued(int sd)
+{
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t len;
+	int nbytes;
+
+	len = sizeof(mem);
+	if (getsockopt(sd, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0 &&
+	    len > SK_MEMINFO_RMEM_ALLOC*sizeof(mem[0]))
+		return mem[SK_MEMINFO_RMEM_ALLOC];
+	if (ioctl(sd, FIONREAD, &nbytes) < 0 || nbytes < 0)
+		return 0;
+
+	return nbytes;
+}
+
+// Linux keeps a drop counter for each socket.
+int
+rxdrops(int sd, uint32_t *drops)
+{
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t len;
+
+	len = sizeof(mem);
+	if (getsockopt(sd, SOL_SOCKET, SO_MEMINFO, mem, &len) < 0)
+		return -1;
+	if (len <= SK_MEMINFO_DROPS*sizeof(mem[0])) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	*drops = mem[SK_MEMINFO_DROPS];
+
+	return 0;
+}
+
+/*
+ * Sets the receive buffer size and returns the size granted.
+ * Linux doubles the request to allow for its own overhead and
+ * reports the doubled size; we halve it again so the result
+ * is comparable with what was asked for.  A privileged daemon
+ * may exceed net.core.rmem_max.
+ */
+int
+setrcvbuf(int sd, int size)
+{
+	socklen_t len;
+
+	if (setsockopt(sd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+	    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+		return -1;
+	len = sizeof(size);
+	if (getsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, &len) < 0)
+		return -1;
+
+	return size/2;
+}
+
+int
+attachfilter(int sd, const Bpfinsn *prog, size_t len)
+{
+	struct sock_filter insns[MAX_RIP_FILTER];
+	struct sock_fprog fprog;
+
+	if (len > MAX_RIP_FILTER) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (size_t k = 0; k < len; k++) {
+		insns[k].code = prog[k].code;
+		insns[k].jt = prog[k].jt;
+		insns[k].jf = prog[k].jf;
+		insns[k].k = prog[k].k;
+	}
+	memset(&fprog, 0, sizeof(fprog));
+	fprog.len = len;
+	fprog.filter = insns;
+
+	return setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+}
+
+/*
+ * Starts a new message at the end of the batch, sending the
+ * batch first if there is no room for `size` more bytes.
+ */
+static struct nlmsghdr *
+nlbegin(int type, int flags, size_t size)
+{
+	struct nlmsghdr *nh;
+
+	if (nllen + NLMSG_ALIGN(size) > sizeof(nlbuf))
+		kflush();
+	assert(nllen + NLMSG_ALIGN(size) <= sizeof(nlbuf));
+	nh = (struct nlmsghdr *)(nlbuf + nllen);
+	memset(nh, 0, NLMSG_ALIGN(size));
+	nh->nlmsg_len = NLMSG_LENGTH(0);
+	nh->nlmsg_type = type;
+	nh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nh->nlmsg_seq = ++nlseq;
+	nllast = nllen;
+
+	return nh;
+}
+
+static void *
+nlput(struct nlmsghdr *nh, size_t len)
+{
+	void *p = (octet *)nh + NLMSG_ALIGN(nh->nlmsg_len);
+
+	nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + len;
+
+	return p;
+}
+
+static struct rtattr *
+nlattr(struct nlmsghdr *nh, int type, const void *data, size_t len)
+{
+	struct rtattr *rta;
+
+	rta = nlput(nh, RTA_LENGTH(len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	if (data != NULL)
+		memmove(RTA_DATA(rta), data, len);
+
+	return rta;
+}
+
+static void
+nlattr32(struct nlmsghdr *nh, int type, uint32_t w)
+{
+	nlattr(nh, type, &w, sizeof(w));
+}
+
+// Closes a nested attribute opened with nlattr(nh, type, NULL, 0).
+static void
+nlnestend(struct nlmsghdr *nh, struct rtattr *nest)
+{
+	nest->rta_len = (octet *)nh + nh->nlmsg_len - (octet *)nest;
+}
+
+static void
+nlend(struct nlmsghdr *nh, Route *route, const char *ifname)
+{
+	Nlop *op = &nlops[nh->nlmsg_seq%MAX_NLOPS];
+
+	assert(nllen + NLMSG_ALIGN(nh->nlmsg_len) <= sizeof(nlbuf));
+	nllen += NLMSG_ALIGN(nh->nlmsg_len);
+	nlqueued++;
+	memset(op, 0, sizeof(*op));
+	op->seq = nh->nlmsg_seq;
+	op->type = nh->nlmsg_type;
+	if (route != NULL) {
+		op->ipnet = route->ipnet;
+		op->subnetmask = route->subnetmask;
+		op->gateway = route->gateway;
+	}
+	if (ifname != NULL)
+		strlcpy(op->ifname, ifname, sizeof(op->ifname));
+}
+
+static const char *
+nlopname(int type)
+{
+	switch (type) {
+	case RTM_NEWROUTE:	return "route add";
+	case RTM_DELROUTE:	return "route remove";
+	}
+	return "request";
+}
+
+static void
+nlerror(uint32_t seq, int err)
+{
+	Nlop *op = &nlops[seq%MAX_NLOPS];
+	char what[128];
+
+	if (op->seq != seq) {
+		nlstats.errors++;
+		error("netlink request %" PRIu32 " failed: %s", seq, strerror(err));
+		return;
+	}
+	// Routes already gone are what we wanted.
+	if (op->type == RTM_DELROUTE && (err == ESRCH || err == ENOENT))
+		return;
+	nlstats.errors++;
+	if (op->type == RTM_NEWROUTE || op->type == RTM_DELROUTE) {
+		Route route;
+
+		memset(&route, 0, sizeof(route));
+		route.ipnet = op->ipnet;
+		route.subnetmask = op->subnetmask;
+		route.gateway = op->gateway;
+		routestr(&route, NULL, what, sizeof(what));
+		if (op->ifname[0] != '\0') {
+			strlcat(what, " on ", sizeof(what));
+			strlcat(what, op->ifname, sizeof(what));
+		}
+	} else
+		strlcpy(what, op->ifname, sizeof(what));
+	error("%s failure (%s): %s", nlopname(op->type), what, strerror(err));
+}
+
+// Reads and handles replies until the socket would block.
+static void
+nlreplies(void)
+{
+	alignas(NLMSG_ALIGNTO) octet buf[16*1024];
+
+	for (;;) {
+		struct nlmsghdr *nh;
+		ssize_t n;
+
+		n = recv(nlfd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == ENOBUFS) {
+				/*
+				 * Replies were lost, perhaps the ack we are
+				 * waiting for.  Stop waiting rather than seem
+				 * busy until some later batch is acked.
+				 */
+				nlstats.overruns++;
+				error("netlink replies lost: %m");
+				if ((int32_t)(nlsent - nlacked) > 0) {
+					nlstats.lostacks++;
+					nlacked = nlsent;
+				}
+				continue;
+			}
+			fatal("netlink recv: %m");
+		}
+		for (nh = (struct nlmsghdr *)buf;
+		    NLMSG_OK(nh, (size_t)n);
+		    nh = NLMSG_NEXT(nh, n))
+		{
+			struct nlmsgerr *e;
+
+			if (nh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			e = NLMSG_DATA(nh);
+			trace(TRACE_KACK, nh->nlmsg_seq, -e->error,
+			    nlops[nh->nlmsg_seq%MAX_NLOPS].ipnet,
+			    nlops[nh->nlmsg_seq%MAX_NLOPS].subnetmask);
+			probe2(kernel_ack, nh->nlmsg_seq, -e->error);
+			if (e->error == 0)
+				nlstats.acks++;
+			else
+				nlerror(nh->nlmsg_seq, -e->error);
+			// Replies come back in order.
+			if ((int32_t)(nh->nlmsg_seq - nlacked) > 0)
+				nlacked = nh->nlmsg_seq;
+		}
+	}
+}
+
+/*
+ * Sends the batch.  Only the last message asks for an
+ * acknowledgement; its arrival tells us the kernel has
+ * processed everything before it.
+ */
+static void
+kflush(void)
+{
+	struct sockaddr_nl snl;
+	struct iovec iov;
+	struct msghdr msg;
+	struct nlmsghdr *last;
+
+	if (nlqueued == 0)
+		return;
+	last = (struct nlmsghdr *)(nlbuf + nllast);
+	last->nlmsg_flags |= NLM_F_ACK;
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	iov.iov_base = nlbuf;
+	iov.iov_len = nllen;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &snl;
+	msg.msg_namelen = sizeof(snl);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	trace(TRACE_KSEND, ((struct nlmsghdr *)nlbuf)->nlmsg_seq,
+	    last->nlmsg_seq, nlqueued, 0);
+	probe2(kernel_send, last->nlmsg_seq, nlqueued);
+	nlstats.sends++;
+	while (sendmsg(nlfd, &msg, 0) < 0) {
+		if (errno == EINTR)
+			continue;
+		fatal("netlink sendmsg: %m");
+	}
+	nlsent = last->nlmsg_seq;
+	nlstats.batches++;
+	nlstats.messages += nlqueued;
+	nllen = 0;
+	nlqueued = 0;
+}
+
+// Starts a link request in this thread's buffer.
+static struct nlmsghdr *
+linkbegin(int type, int flags)
+{
+	struct nlmsghdr *nh = (struct nlmsghdr *)nllink.buf;
+
+	memset(nllink.buf, 0, sizeof(nllink.buf));
+	nh->nlmsg_len = NLMSG_LENGTH(0);
+	nh->nlmsg_type = type;
+	nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nh->nlmsg_seq = ++nllink.seq;
+
+	return nh;
+}
+
+/*
+ * Sends a link request on this thread's socket and waits for
+ * the kernel's answer.  On failure, sets errno and returns -1.
+ */
+static int
+linkrequest(struct nlmsghdr *nh)
+{
+	alignas(NLMSG_ALIGNTO) octet buf[4096];
+	struct nlmsghdr *rh;
+	ssize_t n;
+
+	assert(nh->nlmsg_len <= sizeof(nllink.buf));
+	if (nllink.fd < 0) {
+		nllink.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+		if (nllink.fd < 0)
+			return -1;
+	}
+	while (send(nllink.fd, nh, nh->nlmsg_len, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	for (;;) {
+		n = recv(nllink.fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (rh = (struct nlmsghdr *)buf;
+		    NLMSG_OK(rh, (size_t)n);
+		    rh = NLMSG_NEXT(rh, n))
+		{
+			struct nlmsgerr *e;
+
+			if (rh->nlmsg_type != NLMSG_ERROR ||
+			    rh->nlmsg_seq != nh->nlmsg_seq)
+				continue;
+			e = NLMSG_DATA(rh);
+			if (e->error == 0)
+				return 0;
+			errno = -e->error;
+			return -1;
+		}
+	}
+}
+
+// Whether route changes are queued, or sent and not yet acknowledged.
+static int
+kbusy(void)
+{
+	return nlqueued != 0 || (int32_t)(nlsent - nlacked) > 0;
+}
+
+static int
+kpollfd(void)
+{
+	return nlfd;
+}
+
+static void
+kinput(void)
+{
+	nlreplies();
+}
+
+/*
+ * Bring up an ipip tunnel.  The interface is created up with
+ * its endpoints in one request; we then learn its index and
+ * give it the local 44net address, so that ICMP errors and
+ * locally originated traffic have a sensible source.
+ */
+static int
+kuptunnel(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint)
+{
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+	struct ifaddrmsg *ifa;
+	struct rtattr *linkinfo, *data;
+
+	assert(tunnel != NULL);
+	(void)rdomain;
+	(void)tunneldomain;
+
+	nh = linkbegin(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL);
+	ifi = nlput(nh, sizeof(*ifi));
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_flags = IFF_UP;
+	ifi->ifi_change = IFF_UP;
+	nlattr(nh, IFLA_IFNAME, tunnel->ifname, strlen(tunnel->ifname) + 1);
+	linkinfo = nlattr(nh, IFLA_LINKINFO, NULL, 0);
+	nlattr(nh, IFLA_INFO_KIND, "ipip", 4);
+	data = nlattr(nh, IFLA_INFO_DATA, NULL, 0);
+	nlattr32(nh, IFLA_IPTUN_LOCAL, htonl(tunnel->local));
+	nlattr32(nh, IFLA_IPTUN_REMOTE, htonl(tunnel->remote));
+	nlattr(nh, IFLA_IPTUN_TTL, &(octet){TUNNEL_TTL}, 1);
+	nlnestend(nh, data);
+	nlnestend(nh, linkinfo);
+	if (linkrequest(nh) < 0)
+		fatal("create %s failed: %m", tunnel->ifname);
+
+	tunnel->ifindex = if_nametoindex(tunnel->ifname);
+	if (tunnel->ifindex == 0)
+		fatal("cannot find index of %s: %m", tunnel->ifname);
+
+	nh = linkbegin(RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE);
+	ifa = nlput(nh, sizeof(*ifa));
+	ifa->ifa_family = AF_INET;
+	ifa->ifa_prefixlen = 32;
+	ifa->ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa->ifa_index = tunnel->ifindex;
+	nlattr32(nh, IFA_LOCAL, htonl(endpoint));
+	nlattr32(nh, IFA_ADDRESS, htonl(endpoint));
+	if (linkrequest(nh) < 0)
+		fatal("dummy inet %s failed: %m", tunnel->ifname);
+
+	return 0;
+}
+
+// Points an existing tunnel at new endpoints.
+static int
+kretunnel(Tunnel *tunnel)
+{
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+	struct rtattr *linkinfo, *data;
+
+	assert(tunnel != NULL);
+	nh = linkbegin(RTM_NEWLINK, 0);
+	ifi = nlput(nh, sizeof(*ifi));
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_index = tunnel->ifindex;
+	nlattr(nh, IFLA_IFNAME, tunnel->ifname, strlen(tunnel->ifname) + 1);
+	linkinfo = nlattr(nh, IFLA_LINKINFO, NULL, 0);
+	nlattr(nh, IFLA_INFO_KIND, "ipip", 4);
+	data = nlattr(nh, IFLA_INFO_DATA, NULL, 0);
+	nlattr32(nh, IFLA_IPTUN_LOCAL, htonl(tunnel->local));
+	nlattr32(nh, IFLA_IPTUN_REMOTE, htonl(tunnel->remote));
+	nlnestend(nh, data);
+	nlnestend(nh, linkinfo);
+	if (linkrequest(nh) < 0) {
+		error("re-pointing tunnel %s failed: %m", tunnel->ifname);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+kdowntunnel(Tunnel *tunnel)
+{
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+
+	assert(tunnel != NULL);
+	nh = linkbegin(RTM_DELLINK, 0);
+	ifi = nlput(nh, sizeof(*ifi));
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_index = tunnel->ifindex;
+	nlattr(nh, IFLA_IFNAME, tunnel->ifname, strlen(tunnel->ifname) + 1);
+	if (linkrequest(nh) < 0)
+		fatal("destroying %s failed: %m", tunnel->ifname);
+	tunnel->ifindex = 0;
+
+	return 0;
+}
+
+static unsigned int
+tunnelindex(Tunnel *tunnel)
+{
+	if (tunnel->ifindex == 0)
+		tunnel->ifindex = if_nametoindex(tunnel->ifname);
+	return tunnel->ifindex;
+}
+
+static void
+mkroutemsg(int type, int flags, Route *route, Tunnel *tunnel, int rtable)
+{
+	struct nlmsghdr *nh;
+	struct rtmsg *rtm;
+
+	assert(route != NULL);
+	assert(rtable >= 0);
+	nh = nlbegin(type, flags, 128);
+	rtm = nlput(nh, sizeof(*rtm));
+	rtm->rtm_family = AF_INET;
+	rtm->rtm_dst_len = netmask2cidr(route->subnetmask);
+	rtm->rtm_table = (rtable < 256) ? rtable : RT_TABLE_UNSPEC;
+	rtm->rtm_protocol = RTPROT_44RIPD;
+	rtm->rtm_scope = RT_SCOPE_NOWHERE;	// Any, when deleting.
+	if (type == RTM_NEWROUTE) {
+		rtm->rtm_scope = RT_SCOPE_LINK;
+		rtm->rtm_type = RTN_UNICAST;
+	}
+	nlattr32(nh, RTA_DST, htonl(route->ipnet));
+	nlattr32(nh, RTA_TABLE, rtable);
+	if (tunnel != NULL)
+		nlattr32(nh, RTA_OIF, tunnelindex(tunnel));
+	if (tunnel != NULL && tunnel->multipoint) {
+		rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+		rtm->rtm_flags |= RTNH_F_ONLINK;
+		nlattr32(nh, RTA_GATEWAY, htonl(tunnel->remote));
+	}
+	nlend(nh, route, (tunnel != NULL) ? tunnel->ifname : NULL);
+}
+
+/*
+ * Route operations are only queued here; they go to the
+ * kernel when the daemon calls sysflush, or when the batch
+ * fills.  Failures are reported as the replies arrive.
+ */
+static int
+kaddroute(Route *route, Tunnel *tunnel, int rtable)
+{
+	assert(tunnel != NULL);
+	mkroutemsg(RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE,
+	    route, tunnel, rtable);
+
+	return 0;
+}
+
+static int
+kchroute(Route *route, Tunnel *tunnel, int rtable)
+{
+	return kaddroute(route, tunnel, rtable);
+}
+
+static int
+krmroute(Route *route, int rtable)
+{
+	mkroutemsg(RTM_DELROUTE, 0, route, NULL, rtable);
+
+	return 0;
+}
+
+static void
+kstats(FILE *fp)
+{
+	fprintf(fp, "netlink_batches %" PRIu64 "\n", nlstats.batches);
+	fprintf(fp, "netlink_messages %" PRIu64 "\n", nlstats.messages);
+	fprintf(fp, "netlink_sends %" PRIu64 "\n", nlstats.sends);
+	fprintf(fp, "netlink_acks %" PRIu64 "\n", nlstats.acks);
+	fprintf(fp, "netlink_errors %" PRIu64 "\n", nlstats.errors);
+	fprintf(fp, "netlink_overruns %" PRIu64 "\n", nlstats.overruns);
+	fprintf(fp, "netlink_lost_acks %" PRIu64 "\n", nlstats.lostacks);
+}
+
+/*
+ * Dumps a kernel table on a socket of its own, so that the
+ * dump does not mingle with replies to our batches, and hands
+ * each message to `fn`.  Returns the number of messages.
+ */
+static int
+nldump(int type, size_t hdrsize, int family,
+    int (*fn)(struct nlmsghdr *nh, void *arg), void *arg)
+{
+	alignas(NLMSG_ALIGNTO) octet buf[32*1024];
+	struct nlmsghdr *nh;
+	int fd, n;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+	memset(buf, 0, NLMSG_SPACE(hdrsize));
+	nh = (struct nlmsghdr *)buf;
+	nh->nlmsg_len = NLMSG_LENGTH(hdrsize);
+	nh->nlmsg_type = type;
+	nh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nh->nlmsg_seq = 1;
+	*(octet *)NLMSG_DATA(nh) = family;	// ifi_family and rtm_family.
+	if (send(fd, buf, nh->nlmsg_len, 0) < 0) {
+		close(fd);
+		return -1;
+	}
+	n = 0;
+	for (;;) {
+		ssize_t len;
+
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return -1;
+		}
+		for (nh = (struct nlmsghdr *)buf;
+		    NLMSG_OK(nh, (size_t)len);
+		    nh = NLMSG_NEXT(nh, len))
+		{
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				close(fd);
+				return n;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *e = NLMSG_DATA(nh);
+				close(fd);
+				errno = -e->error;
+				return -1;
+			}
+			n += fn(nh, arg);
+		}
+	}
+}
+
+typedef struct Scan Scan;
+struct Scan {
+	void (*tunnelfn)(Kif *kif, void *arg);
+	void (*routefn)(Kroute *kr, void *arg);
+	void *arg;
+	int rtable;
+};
+
+// Finds the attributes we care about, nested ones included.
+static void
+nlparse(struct rtattr *rta, int len, struct rtattr *tb[], int max)
+{
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if (rta->rta_type <= max)
+			tb[rta->rta_type] = rta;
+}
+
+static uint32_t
+rtattr32(struct rtattr *rta)
+{
+	uint32_t w;
+
+	memmove(&w, RTA_DATA(rta), sizeof(w));
+
+	return w;
+}
+
+static int
+scanlink(struct nlmsghdr *nh, void *scanp)
+{
+	Scan *scan = scanp;
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct rtattr *tb[IFLA_MAX + 1], *info[IFLA_INFO_MAX + 1];
+	struct rtattr *data[IFLA_IPTUN_MAX + 1];
+	Kif kif;
+
+	if (nh->nlmsg_type != RTM_NEWLINK)
+		return 0;
+	memset(tb, 0, sizeof(tb));
+	memset(info, 0, sizeof(info));
+	memset(data, 0, sizeof(data));
+	nlparse(IFLA_RTA(ifi), IFLA_PAYLOAD(nh), tb, IFLA_MAX);
+	if (tb[IFLA_IFNAME] == NULL || tb[IFLA_LINKINFO] == NULL)
+		return 0;
+	nlparse(RTA_DATA(tb[IFLA_LINKINFO]), RTA_PAYLOAD(tb[IFLA_LINKINFO]),
+	    info, IFLA_INFO_MAX);
+	if (info[IFLA_INFO_KIND] == NULL ||
+	    RTA_PAYLOAD(info[IFLA_INFO_KIND]) < 4 ||
+	    memcmp(RTA_DATA(info[IFLA_INFO_KIND]), "ipip", 4) != 0)
+		return 0;
+	if (info[IFLA_INFO_DATA] != NULL)
+		nlparse(RTA_DATA(info[IFLA_INFO_DATA]),
+		    RTA_PAYLOAD(info[IFLA_INFO_DATA]), data, IFLA_IPTUN_MAX);
+	memset(&kif, 0, sizeof(kif));
+	strlcpy(kif.ifname, RTA_DATA(tb[IFLA_IFNAME]), sizeof(kif.ifname));
+	kif.ifindex = ifi->ifi_index;
+	if (data[IFLA_IPTUN_LOCAL] != NULL)
+		kif.local = ntohl(rtattr32(data[IFLA_IPTUN_LOCAL]));
+	if (data[IFLA_IPTUN_REMOTE] != NULL)
+		kif.remote = ntohl(rtattr32(data[IFLA_IPTUN_REMOTE]));
+	scan->tunnelfn(&kif, scan->arg);
+
+	return 1;
+}
+
+// Reports every ipip interface with its tunnel endpoints.
+static int
+kscantunnels(void (*fn)(Kif *kif, void *arg), void *arg)
+{
+	Scan scan = { fn, NULL, arg, 0 };
+
+	return nldump(RTM_GETLINK, sizeof(struct ifinfomsg), AF_UNSPEC,
+	    scanlink, &scan);
+}
+
+static int
+scanroute(struct nlmsghdr *nh, void *scanp)
+{
+	Scan *scan = scanp;
+	struct rtmsg *rtm = NLMSG_DATA(nh);
+	struct rtattr *tb[RTA_MAX + 1];
+	uint32_t table;
+	Kroute kr;
+
+	if (nh->nlmsg_type != RTM_NEWROUTE || rtm->rtm_family != AF_INET ||
+	    rtm->rtm_type != RTN_UNICAST)
+		return 0;
+	// Only routes we installed; others are not ours to adopt or remove.
+	if (rtm->rtm_protocol != RTPROT_44RIPD)
+		return 0;
+	memset(tb, 0, sizeof(tb));
+	nlparse(RTM_RTA(rtm), RTM_PAYLOAD(nh), tb, RTA_MAX);
+	table = rtm->rtm_table;
+	if (tb[RTA_TABLE] != NULL)
+		table = rtattr32(tb[RTA_TABLE]);
+	if (table != (uint32_t)scan->rtable || tb[RTA_OIF] == NULL)
+		return 0;
+	memset(&kr, 0, sizeof(kr));
+	if (tb[RTA_DST] != NULL)
+		kr.ipnet = ntohl(rtattr32(tb[RTA_DST]));
+	kr.subnetmask = cidr2netmask(rtm->rtm_dst_len);
+	kr.ifindex = rtattr32(tb[RTA_OIF]);
+	if (tb[RTA_GATEWAY] != NULL)
+		kr.gateway = ntohl(rtattr32(tb[RTA_GATEWAY]));
+	scan->routefn(&kr, scan->arg);
+
+	return 1;
+}
+
+// Reports the routes of ours in `rtable` out of some interface.
+static int
+kscanroutes(int rtable, void (*fn)(Kroute *kr, void *arg), void *arg)
+{
+	Scan scan = { NULL, fn, arg, rtable };
+
+	return nldump(RTM_GETROUTE, sizeof(struct rtmsg), AF_INET,
+	    scanroute, &scan);
+}
+
+Backend kernbackend = {
+	.name = "kernel",
+	.multipoint = 1,
+	.initsys = kinitsys,
+	.uptunnel = kuptunnel,
+	.downtunnel = kdowntunnel,
+	.retunnel = kretunnel,
+	.addroute = kaddroute,
+	.chroute = kchroute,
+	.rmroute = krmroute,
+	.flush = kflush,
+	.pollfd = kpollfd,
+	.input = kinput,
+	.busy = kbusy,
+	.stats = kstats,
+	.scantunnels = kscantunnels,
+	.scanroutes = kscanroutes,
+};
+
+void
+ipaddrstr(uint32_t addr, char buf[static INET_ADDRSTRLEN])
+{
+	addr = htonl(addr);
+	inet_ntop(AF_INET, &addr, buf, INET_ADDRSTRLEN);
+}
+
+void
+routestr(Route *route, Tunnel *tunnel, char *buf, size_t size)
+{
+	char gw[INET_ADDRSTRLEN], proute[INET_ADDRSTRLEN];
+	size_t cidr;
+
+	assert(route != NULL);
+	cidr = netmask2cidr(route->subnetmask);
+	ipaddrstr(route->ipnet, proute);
+	ipaddrstr(route->gateway, gw);
+
+	assert(buf != NULL);
+	snprintf(buf, size, "%s/%zu -> %s", proute, cidr, gw);
+	if (tunnel != NULL) {
+		strlcat(buf, " on ", size);
+		strlcat(buf, tunnel->ifname, size);
+	}
+}
@@ -0,0 +1,661 @@
+/*
+ * Logging.
+ *
+ * Once the logger is started, a message is not written where it
+ * is made.  It is captured as a binary record instead: the
+ * format, which must be a string literal, and the raw
+ * arguments, with strings copied.  The record is appended to a
+ * ring that any thread may write to without taking a lock.  A
+ * background thread, or whoever calls logdrain, renders the
+ * records and writes them to syslog or a file.
+ *
+ * When the ring is full, debug and info records are dropped
+ * and counted.  More severe ones are written through at once,
+ * after whatever is in the ring.  Before the logger is
+ * started, and for fatal errors, messages are written on the
+ * spot.
+ */
+#include <sys/types.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "dat.h"
+#include "fns.h"
+
+enum {
+	MAX_LOG_ARGS = 12,
+	MAX_LOG_STRS = 192,	// Bytes of copied strings per record.
+	LOG_DRAIN_MS = 20,
+};
+
+typedef union Logarg Logarg;
+union Logarg {
+	intmax_t i;
+	uintmax_t u;
+	double f;
+	const void *p;
+	size_t off;		// Of a copied string.
+};
+
+typedef struct Logrec Logrec;
+struct Logrec {
+	atomic_size_t seq;
+	int level;
+	struct timespec when;
+	const char *fmt;
+	Logarg args[MAX_LOG_ARGS];
+	char strs[MAX_LOG_STRS];
+};
+
+// A conversion specification, as parsed from a format.
+typedef struct Logspec Logspec;
+struct Logspec {
+	char spec[48];		// With any * as is.
+	int nstars;
+	int lmod;		// 'h', 'H' (hh), 'l', 'L' (ll), 'z', 'j', 't'.
+	int conv;
+};
+
+typedef struct Logstats Logstats;
+struct Logstats {
+	atomic_uint_fast64_t records;
+	atomic_uint_fast64_t dropped;
+	atomic_uint_fast64_t writethrough;
+	atomic_size_t maxdepth;
+	uint64_t drains;
+	uint64_t suppressed;	// By rate-limited call sites.
+	uint64_t summaries;
+};
+
+int loglevel = LOG_INFO;
+
+static Logrec ring[LOG_RING];
+static atomic_size_t head;
+static atomic_size_t tail;
+static int started;
+static FILE *logfp;
+static pthread_mutex_t drainlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static Logstats stats;
+static pthread_mutex_t sitelock = PTHREAD_MUTEX_INITIALIZER;
+static Logsite *sites;
+
+static void vlogmsg(int level, const char *fmt, va_list ap);
+static void capture(Logrec *r, int level, const char *fmt, va_list ap);
+static size_t render(char *buf, size_t size, Logrec *r);
+static const char *parsespec(const char *fmt, Logspec *ls);
+static void emit(Logrec *r);
+static void drainlocked(void);
+static void *drainer(void *arg);
+static void syncatexit(void);
+static void summarize(Logsite *site, time_t now);
+
+void
+initlog(void)
+{
+	openlog("44ripd", LOG_CONS | LOG_PERROR | LOG_PID, LOG_LOCAL0);
+	setlogmask(LOG_UPTO(loglevel));
+}
+
+/*
+ * Starts logging through the ring, to the file at `path` or,
+ * if it is nil, to syslog.  With `threaded` set, a thread
+ * drains the ring; otherwise the caller must call logdrain.
+ */
+void
+startlogger(const char *path, int threaded)
+{
+	if (path != NULL) {
+		logfp = fopen(path, "a");
+		if (logfp == NULL)
+			fatal("cannot open log file %s: %m", path);
+	}
+	for (size_t k = 0; k < LOG_RING; k++)
+		atomic_init(&ring[k].seq, k);
+	atomic_store(&head, 0);
+	atomic_store(&tail, 0);
+	if (threaded) {
+		pthread_t tid;
+		int err;
+
+		err = pthread_create(&tid, NULL, drainer, NULL);
+		if (err != 0) {
+			errno = err;
+			fatal("cannot start logger: %m");
+		}
+		pthread_detach(tid);
+	}
+	if (!started)
+		atexit(syncatexit);
+	started = 1;
+}
+
+// Logs a message; callers check the level first.  See fns.h.
+void
+logmsg(int level, const char *restrict fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vlogmsg(level, fmt, ap);
+	va_end(ap);
+}
+
+void
+error(const char *restrict fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vlogmsg(LOG_ERR, fmt, ap);
+	va_end(ap);
+}
+
+void
+fatal(const char *restrict fmt, ...)
+{
+	Logrec r;
+	va_list ap;
+
+	va_start(ap, fmt);
+	capture(&r, LOG_ERR, fmt, ap);
+	va_end(ap);
+	if (started)
+		logdrain();
+	emit(&r);
+	exit(EXIT_FAILURE);
+}
+
+// Writes out everything in the ring.
+void
+logdrain(void)
+{
+	pthread_mutex_lock(&drainlock);
+	drainlocked();
+	pthread_mutex_unlock(&drainlock);
+}
+
+/*
+ * Returns whether a rate-limited call site may log a message
+ * about `key` at `now`.  If not, the message is counted, to be
+ * summarized when the site's period ends.
+ */
+int
+logallow(Logsite *site, int level, uint64_t key, time_t now)
+{
+	size_t slot;
+	int allow;
+
+	pthread_mutex_lock(&sitelock);
+	if (!site->linked) {
+		site->next = sites;
+		sites = site;
+		site->linked = 1;
+		site->period = now;
+	}
+	site->level = level;
+	if (now - site->period >= LOG_PERIOD)
+		summarize(site, now);
+	slot = (key * 0x9E3779B97F4A7C15ULL) >> 58 & (LOG_SITE_KEYS - 1);
+	allow = 0;
+	if (site->keys[slot].key == key && now < site->keys[slot].quiet)
+		;
+	else if (site->sent < LOG_BURST) {
+		site->keys[slot].key = key;
+		site->keys[slot].quiet = now + LOG_KEY_QUIET;
+		site->sent++;
+		allow = 1;
+	}
+	if (!allow) {
+		site->suppressed++;
+		stats.suppressed++;
+	}
+	pthread_mutex_unlock(&sitelock);
+
+	return allow;
+}
+
+// Summarizes the sites whose periods have ended by `now`.
+void
+logsummary(time_t now)
+{
+	pthread_mutex_lock(&sitelock);
+	for (Logsite *site = sites; site != NULL; site = site->next)
+		if (site->suppressed != 0 && now - site->period >= LOG_PERIOD)
+			summarize(site, now);
+	pthread_mutex_unlock(&sitelock);
+}
+
+void
+statslog(FILE *fp)
+{
+	if (fp == NULL)
+		return;
+	fprintf(fp, "log_records %" PRIu64 "\n",
+	    (uint64_t)atomic_load(&stats.records));
+	fprintf(fp, "log_dropped %" PRIu64 "\n",
+	    (uint64_t)atomic_load(&stats.dropped));
+	fprintf(fp, "log_writethrough %" PRIu64 "\n",
+	    (uint64_t)atomic_load(&stats.writethrough));
+	fprintf(fp, "log_depth %zu\n", atomic_load(&head) - atomic_load(&tail));
+	fprintf(fp, "log_max_depth %zu\n", atomic_load(&stats.maxdepth));
+	fprintf(fp, "log_drains %" PRIu64 "\n", stats.drains);
+	pthread_mutex_lock(&sitelock);
+	fprintf(fp, "log_suppressed %" PRIu64 "\n", stats.suppressed);
+	fprintf(fp, "log_summaries %" PRIu64 "\n", stats.summaries);
+	pthread_mutex_unlock(&sitelock);
+}
+
+/*
+ * Formats a log message into buf, as vsnprintf would, but
+ * with %m and %I (see fns.h).  Returns the length of the
+ * message, which is truncated to fit.
+ */
+size_t
+vlogfmt(char *buf, size_t size, const char *restrict fmt, va_list ap)
+{
+	Logrec r;
+
+	capture(&r, LOG_DEBUG, fmt, ap);
+
+	return render(buf, size, &r);
+}
+
+static void
+vlogmsg(int level, const char *fmt, va_list ap)
+{
+	Logrec *r;
+	size_t pos, depth, max;
+
+	if (!started) {
+		Logrec sync;
+
+		capture(&sync, level, fmt, ap);
+		emit(&sync);
+		return;
+	}
+	pos = atomic_load_explicit(&head, memory_order_relaxed);
+	for (;;) {
+		size_t seq;
+		intptr_t diff;
+
+		r = &ring[pos & (LOG_RING - 1)];
+		seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+		diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&head, &pos,
+			    pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			r = NULL;
+			break;
+		} else
+			pos = atomic_load_explicit(&head, memory_order_relaxed);
+	}
+	if (r == NULL) {
+		Logrec over;
+
+		if (level > LOG_NOTICE) {
+			atomic_fetch_add(&stats.dropped, 1);
+			pthread_cond_signal(&wake);
+			return;
+		}
+		capture(&over, level, fmt, ap);
+		pthread_mutex_lock(&drainlock);
+		drainlocked();
+		emit(&over);
+		if (logfp != NULL)
+			fflush(logfp);
+		pthread_mutex_unlock(&drainlock);
+		atomic_fetch_add(&stats.writethrough, 1);
+		return;
+	}
+	capture(r, level, fmt, ap);
+	atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+	atomic_fetch_add(&stats.records, 1);
+	depth = pos + 1 - atomic_load_explicit(&tail, memory_order_relaxed);
+	max = atomic_load_explicit(&stats.maxdepth, memory_order_relaxed);
+	while (depth > max && !atomic_compare_exchange_weak(&stats.maxdepth,
+	    &max, depth))
+		;
+	if (depth >= LOG_RING/2)
+		pthread_cond_signal(&wake);
+}
+
+/*
+ * Captures a message's arguments into a record.  Strings,
+ * including that for %m, are copied, and cut short if the
+ * record has no more room for them.
+ */
+static void
+capture(Logrec *r, int level, const char *fmt, va_list ap)
+{
+	int saved = errno;
+	size_t nstrs = 0;
+	int n = 0;
+
+	r->level = level;
+	r->fmt = fmt;
+	clock_gettime(CLOCK_REALTIME, &r->when);
+	while (*fmt != '\0') {
+		Logspec ls;
+		const char *s;
+		size_t len;
+
+		if (*fmt++ != '%')
+			continue;
+		fmt = parsespec(fmt, &ls);
+		if (ls.conv == '\0' || ls.conv == '%')
+			continue;
+		if (n + ls.nstars + 1 > MAX_LOG_ARGS)
+			break;
+		for (int k = 0; k < ls.nstars; k++)
+			r->args[n++].i = va_arg(ap, int);
+		switch (ls.conv) {
+		case 'm':
+		case 's':
+			s = (ls.conv == 'm') ? strerror(saved) : va_arg(ap, const char *);
+			if (s == NULL)
+				s = "(null)";
+			len = strnlen(s, MAX_LOG_STRS - 1 - nstrs);
+			memmove(r->strs + nstrs, s, len);
+			r->strs[nstrs + len] = '\0';
+			r->args[n++].off = nstrs;
+			nstrs += len + (nstrs + len < MAX_LOG_STRS - 1);
+			break;
+		case 'I':
+			r->args[n++].u = va_arg(ap, uint32_t);
+			break;
+		case 'd':
+		case 'i':
+			switch (ls.lmod) {
+			case 'l': r->args[n++].i = va_arg(ap, long); break;
+			case 'L': r->args[n++].i = va_arg(ap, long long); break;
+			case 'z': r->args[n++].i = va_arg(ap, ssize_t); break;
+			case 'j': r->args[n++].i = va_arg(ap, intmax_t); break;
+			case 't': r->args[n++].i = va_arg(ap, ptrdiff_t); break;
+			default: r->args[n++].i = va_arg(ap, int); break;
+			}
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			switch (ls.lmod) {
+			case 'l': r->args[n++].u = va_arg(ap, unsigned long); break;
+			case 'L': r->args[n++].u = va_arg(ap, unsigned long long); break;
+			case 'z': r->args[n++].u = va_arg(ap, size_t); break;
+			case 'j': r->args[n++].u = va_arg(ap, uintmax_t); break;
+			case 't': r->args[n++].u = va_arg(ap, ptrdiff_t); break;
+			default: r->args[n++].u = va_arg(ap, unsigned int); break;
+			}
+			break;
+		case 'c':
+			r->args[n++].i = va_arg(ap, int);
+			break;
+		case 'p':
+			r->args[n++].p = va_arg(ap, void *);
+			break;
+		case 'e':
+		case 'f':
+		case 'g':
+			r->args[n++].f = va_arg(ap, double);
+			break;
+		default:
+			// Not ours to guess at; the rest is lost.
+			errno = saved;
+			return;
+		}
+	}
+	errno = saved;
+}
+
+// Renders a record as vlogfmt would have.
+static size_t
+render(char *buf, size_t size, Logrec *r)
+{
+	const char *fmt = r->fmt;
+	size_t n = 0;
+	int a = 0;
+
+	assert(size > 0);
+	buf[0] = '\0';
+	while (*fmt != '\0' && n < size - 1) {
+		Logspec ls;
+		char spec[64], addr[INET_ADDRSTRLEN];
+		size_t k = 0;
+		uint32_t ip;
+
+		if (*fmt != '%') {
+			buf[n++] = *fmt++;
+			buf[n] = '\0';
+			continue;
+		}
+		fmt = parsespec(fmt + 1, &ls);
+		if (ls.conv == '\0')
+			break;
+		if (ls.conv == '%') {
+			buf[n++] = '%';
+			buf[n] = '\0';
+			continue;
+		}
+		if (a + ls.nstars + 1 > MAX_LOG_ARGS)
+			break;
+		for (const char *p = ls.spec; *p != '\0'; p++) {
+			if (*p == '*')
+				k += snprintf(spec + k, sizeof(spec) - k, "%d",
+				    (int)r->args[a++].i);
+			else
+				spec[k++] = *p;
+		}
+		spec[k] = '\0';
+		switch (ls.conv) {
+		case 'm':
+		case 's':
+			spec[k - 1] = 's';
+			n += snprintf(buf + n, size - n, spec,
+			    r->strs + r->args[a++].off);
+			break;
+		case 'I':
+			ip = r->args[a++].u;
+			snprintf(addr, sizeof(addr), "%u.%u.%u.%u", ip >> 24,
+			    (ip >> 16) & 0xFF, (ip >> 8) & 0xFF, ip & 0xFF);
+			spec[k - 1] = 's';
+			n += snprintf(buf + n, size - n, spec, addr);
+			break;
+		case 'd':
+		case 'i':
+			switch (ls.lmod) {
+			case 'l': n += snprintf(buf + n, size - n, spec, (long)r->args[a++].i); break;
+			case 'L': n += snprintf(buf + n, size - n, spec, (long long)r->args[a++].i); break;
+			case 'z': n += snprintf(buf + n, size - n, spec, (ssize_t)r->args[a++].i); break;
+			case 'j': n += snprintf(buf + n, size - n, spec, r->args[a++].i); break;
+			case 't': n += snprintf(buf + n, size - n, spec, (ptrdiff_t)r->args[a++].i); break;
+			default: n += snprintf(buf + n, size - n, spec, (int)r->args[a++].i); break;
+			}
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			switch (ls.lmod) {
+			case 'l': n += snprintf(buf + n, size - n, spec, (unsigned long)r->args[a++].u); break;
+			case 'L': n += snprintf(buf + n, size - n, spec, (unsigned long long)r->args[a++].u); break;
+			case 'z': n += snprintf(buf + n, size - n, spec, (size_t)r->args[a++].u); break;
+			case 'j': n += snprintf(buf + n, size - n, spec, r->args[a++].u); break;
+			case 't': n += snprintf(buf + n, size - n, spec, (ptrdiff_t)r->args[a++].u); break;
+			default: n += snprintf(buf + n, size - n, spec, (unsigned int)r->args[a++].u); break;
+			}
+			break;
+		case 'c':
+			n += snprintf(buf + n, size - n, spec, (int)r->args[a++].i);
+			break;
+		case 'p':
+			n += snprintf(buf + n, size - n, spec, r->args[a++].p);
+			break;
+		case 'e':
+		case 'f':
+		case 'g':
+			n += snprintf(buf + n, size - n, spec, r->args[a++].f);
+			break;
+		default:
+			n += snprintf(buf + n, size - n, "%s", ls.spec);
+			fmt += strlen(fmt);
+			break;
+		}
+		if (n > size - 1)
+			n = size - 1;
+	}
+
+	return n;
+}
+
+// Parses the conversion specification after a '%'.
+static const char *
+parsespec(const char *fmt, Logspec *ls)
+{
+	size_t k = 0;
+
+	ls->spec[k++] = '%';
+	ls->nstars = 0;
+	ls->lmod = 0;
+	while (*fmt != '\0' && strchr("-+ #0", *fmt) != NULL && k < 8)
+		ls->spec[k++] = *fmt++;
+	for (int dot = 0; dot < 2; dot++) {
+		if (dot) {
+			if (*fmt != '.')
+				break;
+			ls->spec[k++] = *fmt++;
+		}
+		if (*fmt == '*') {
+			ls->spec[k++] = *fmt++;
+			ls->nstars++;
+		} else
+			while (isdigit((unsigned char)*fmt) && k < 36)
+				ls->spec[k++] = *fmt++;
+	}
+	switch (*fmt) {
+	case 'h':
+	case 'l':
+		ls->lmod = *fmt;
+		ls->spec[k++] = *fmt++;
+		if (*fmt == ls->lmod) {
+			ls->lmod = (ls->lmod == 'h') ? 'H' : 'L';
+			ls->spec[k++] = *fmt++;
+		}
+		break;
+	case 'z':
+	case 'j':
+	case 't':
+		ls->lmod = *fmt;
+		ls->spec[k++] = *fmt++;
+		break;
+	}
+	ls->conv = *fmt;
+	if (*fmt != '\0')
+		ls->spec[k++] = *fmt++;
+	ls->spec[k] = '\0';
+
+	return fmt;
+}
+
+static void
+emit(Logrec *r)
+{
+	static const char *names[] = {
+		"emerg", "alert", "crit", "err",
+		"warning", "notice", "info", "debug",
+	};
+	char buf[MAX_LOG_MSG], when[32];
+	struct tm tm;
+
+	render(buf, sizeof(buf), r);
+	if (logfp == NULL) {
+		syslog(r->level, "%s", buf);
+		return;
+	}
+	localtime_r(&r->when.tv_sec, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(logfp, "%s.%03ld %s %s\n", when, r->when.tv_nsec/1000000,
+	    names[r->level & 7], buf);
+}
+
+// Writes out the records in the ring; the caller holds drainlock.
+static void
+drainlocked(void)
+{
+	size_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+	int n = 0;
+
+	for (;;) {
+		Logrec *r = &ring[pos & (LOG_RING - 1)];
+		size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+
+		if (seq != pos + 1)
+			break;
+		emit(r);
+		atomic_store_explicit(&r->seq, pos + LOG_RING,
+		    memory_order_release);
+		pos++;
+		atomic_store_explicit(&tail, pos, memory_order_relaxed);
+		n++;
+	}
+	if (n != 0) {
+		stats.drains++;
+		if (logfp != NULL)
+			fflush(logfp);
+	}
+}
+
+static void *
+drainer(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&drainlock);
+	for (;;) {
+		struct timespec ts;
+
+		drainlocked();
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_DRAIN_MS*1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&wake, &drainlock, &ts);
+	}
+
+	return NULL;
+}
+
+static void
+syncatexit(void)
+{
+	logdrain();
+}
+
+// Ends a site's period, reporting what it held back; the caller holds sitelock.
+static void
+summarize(Logsite *site, time_t now)
+{
+	if (site->suppressed != 0) {
+		logmsg(site->level, "%s:%d: suppressed %" PRIu64
+		    " similar messages in %lld s", site->file, site->line,
+		    site->suppressed, (long long)(now - site->period));
+		stats.summaries++;
+	}
+	site->suppressed = 0;
+	site->sent = 0;
+	site->period = now;
+}
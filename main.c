@@ -25,13 +25,45 @@
  * and set up.  If a route referring to a tunnel is removed or
  * changed to a different tunnel, the tunnel's reference count
  * is decremented. If a tunnel's reference count drops to zero,
- * it is torn down and removed.
+ * it is parked in a pool of idle interfaces, from which a new
+ * tunnel is served before any interface is created; parked
+ * interfaces are torn down once they have been idle a while.
  *
  * Each tunnel corresponds to a virtual IP encapsulation
  * interface; see gif(4) for details.  The daemon dynamically
  * creates and destroys these interfaces as required.  A bitmap
- * of active interfaces is kept and the lowest unused interface
- * number is always allocated when a new tunnel is created.
+ * of interfaces in use, parked or not, is kept and the lowest
+ * unused interface number is always allocated when a new
+ * tunnel is created.
+ *
+ * The upstream sends the entire table as a burst of datagrams.
+ * We account for each burst, size the socket receive buffer so
+ * that the largest burst seen fits with room to spare, and note
+ * any datagrams the kernel dropped because the buffer overflowed.
+ *
+ * Several feeds (sockets on different interfaces, groups or
+ * ports) may be given; they are multiplexed in one event loop
+ * and merged into the same table.  When feeds are redundant,
+ * whichever delivers an entry first in a cycle wins and the
+ * others' copies are discarded before any further work.
+ *
+ * Where the system supports it, a socket filter can be attached
+ * to each feed so that the kernel discards anything that is not
+ * an authenticated RIPv2 response before it reaches us.
+ *
+ * For testing and benchmarking, a capture of a feed can be
+ * replayed through the same pipeline with a virtual clock,
+ * either as fast as possible or at the recorded pace.  With
+ * the simulated kernel backend, the resulting kernel state is
+ * checked against our tables afterwards.
+ *
+ * Prefixes that keep flapping are damped: once a prefix has
+ * been withdrawn or moved too often, announcements that would
+ * change it are ignored until it has been stable for a while.
+ *
+ * Between bursts, the kernel's routing table is periodically
+ * compared with ours and any drift is corrected a little at a
+ * time; see reconcile.c.
  */
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -41,6 +73,10 @@
 #include <arpa/inet.h>
 
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,18 +87,45 @@
 #include "dat.h"
 #include "fns.h"
 
-int init(int argc, char *argv[]);
-void riptide(int sd);
-void ripresponse(RIPResponse *response, time_t now);
+void init(int argc, char *argv[]);
+void addfeed(char *spec);
+int waitevents(int timeout);
+int burstwait(void);
+int nextwait(void);
+void endbursts(void);
+int bursting(void);
+int settling(void);
+void riptide(Feed *feed);
+void ripinput(Feed *feed, const octet *packet, size_t len, time_t now);
+void ripentries(Feed *feed, RIPPacket *pkt, uint64_t hash, time_t now);
+void bulkrefresh(Feed *feed, Pktent *ent, time_t now);
+int replay(const char *path, int realtime);
+void replaypkt(const octet *packet, size_t len, uint64_t ts, void *arg);
+void printroute(uint32_t key, size_t keylen, void *routep, void *countp);
+void counttunnel(uint32_t key, size_t keylen, void *tunnel, void *countp);
+void rxpacket(int sd, Rxstats *rx, size_t len, uint32_t kdrops);
+void endburst(int sd, Rxstats *rx);
+void dumpstats(void);
+void onprofsig(int sig);
+Route *ripresponse(Feed *feed, RIPResponse *response, time_t now);
+Route *respond(Feed *feed, RIPResponse *response, time_t now);
 Route *mkroute(uint32_t ipnet, uint32_t subnetmask, uint32_t gateway);
 Tunnel *mktunnel(uint32_t local, uint32_t remote);
+Tunnel *mkpeer(uint32_t remote);
 void alloctunif(Tunnel *tunnel, Bitvec *interfaces);
+void installroute(Route *route, Tunnel *tunnel);
+void uninstallroute(Route *route);
+void tunnelready(Tunnel *tunnel, int err);
 void unlinkroute(Tunnel *tunnel, Route *route);
 void linkroute(Tunnel *tunnel, Route *route);
 void walkexpired(time_t now);
-void destroy(uint32_t key, size_t keylen, void *routep, void *unused);
-void collapse(Tunnel *tunnel);
+void destroy(uint32_t key, size_t keylen, void *routep, void *statep);
+void collapse(Tunnel *tunnel, time_t now);
 void expire(uint32_t key, size_t keylen, void *routep, void *statep);
+void warmstart(void);
+void adopttunnel(Kif *kif, void *warmp);
+void adoptroute(Kroute *kr, void *warmp);
+void dropidle(uint32_t key, size_t keylen, void *tunnelp, void *warmp);
 void usage(const char *restrict prog);
 
 enum {
@@ -84,6 +147,17 @@ IPMap *routes;
 IPMap *tunnels;
 Bitvec *interfaces;
 Bitvec *staticinterfaces;
+Tunpool pool;
+Damper damper;
+Aggregator aggregator;
+Sched sched;
+Tunnel mptunnel;		// The shared interface, in multipoint mode.
+Feed feeds[MAX_FEEDS];
+struct pollfd pollfds[MAX_FEEDS + 2];	// Feeds, the kernel, the workers.
+int nfeeds;
+int npollfds;
+int sysslot = -1;
+int workslot = -1;
 
 const char *prog;
 uint32_t localaddr;
@@ -92,32 +166,77 @@ uint32_t defgwaddr;
 int routedomain;
 int tunneldomain;
 int lowgif;
+const char *statspath;
+const char *logpath;
+const char *tracepath;
+volatile sig_atomic_t profsig;	// SIGUSR1 or SIGUSR2, if one came.
+int usefilter;
+const char *replaypath;
+int replayrealtime;
+int reconcileinterval = RECONCILE_INTERVAL;
+int poolsize = POOL_MAX;
+int usedamping = 1;
+int workerthreads;
+uint64_t routegen;		// Bumped when a route moves or goes.
+unsigned int schedrate;
+int useaggregation;
+const char *mpifname;
+Reconciler reconciler;
+Conv conv;
+uint64_t rxns;			// When the datagram at hand arrived.
 
 int
 main(int argc, char *argv[])
 {
-	int sd;
-
-	sd = init(argc, argv);
-	for (;;)
-		riptide(sd);
-	close(sd);
+	init(argc, argv);
+	if (replaypath != NULL)
+		return replay(replaypath, replayrealtime);
+	for (;;) {
+		if (waitevents(nextwait()) > 0) {
+			for (int k = 0; k < nfeeds; k++)
+				if (pollfds[k].revents != 0)
+					riptide(&feeds[k]);
+			if (sysslot >= 0 && pollfds[sysslot].revents != 0)
+				sysinput();
+			if (workslot >= 0 && pollfds[workslot].revents != 0) {
+				workersinput();
+				aggflush(&aggregator, time(NULL));
+				sysflush();
+				poolflush(&pool);
+			}
+		}
+		if (profsig != 0) {
+			profdump(profsig == SIGUSR2);
+			profsig = 0;
+		}
+		endbursts();
+		convcheck(&conv, nsec(), settling(), bursting());
+		logsummary(time(NULL));
+		if (burstwait() < 0)
+			reconcilestep(&reconciler);
+		if (schedwait(&sched) == 0)
+			sysflush();
+	}
+	for (int k = 0; k < nfeeds; k++)
+		close(feeds[k].sd);
 
 	return 0;
 }
 
-int
+void
 init(int argc, char *argv[])
 {
 	const char *localip, *local44;
-	char *iface = "*";
 	char *slash;
-	int sd, ch, daemonize;
+	int ch, daemonize, backendset;
 	struct in_addr addr;
+	struct sigaction sa;
+	sigset_t profsigs;
 
 	slash = strrchr(argv[0], '/');
 	prog = (slash == NULL) ? argv[0] : slash + 1;
 	daemonize = 1;
+	backendset = 0;
 	interfaces = mkbitvec();
 	staticinterfaces = mkbitvec();
 	routedomain = DEFAULT_ROUTE_TABLE;
@@ -126,11 +245,37 @@ init(int argc, char *argv[])
 	localip = DEFAULT_LOCAL_ADDRESS;
 	routes = mkipmap();
 	tunnels = mkipmap();
-	while ((ch = getopt(argc, argv, "dD:T:L:i:I:s:")) != -1) {
+	while ((ch = getopt(argc, argv, "aA:B:dD:T:K:L:fi:I:M:No:pP:r:Rs:S:t:vW:")) != -1) {
 		switch (ch) {
+		case 'a':
+			useaggregation = 1;
+			break;
+		case 'A':
+			reconcileinterval = strnum(optarg);
+			break;
+		case 'B':
+			if (setbackend(optarg) < 0)
+				fatal("bad backend: %s", optarg);
+			backendset = 1;
+			break;
 		case 'd':
 			daemonize = 0;
 			break;
+		case 'v':
+			loglevel = LOG_DEBUG;
+			break;
+		case 'o':
+			logpath = optarg;
+			break;
+		case 't':
+			tracepath = optarg;
+			break;
+		case 'p':
+			profiling = 1;
+			break;
+		case 'f':
+			usefilter = 1;
+			break;
 		case 'T':
 			tunneldomain = strnum(optarg);
 			break;
@@ -144,7 +289,7 @@ init(int argc, char *argv[])
 			localip = optarg;
 			break;
 		case 'i':
-			iface = optarg;
+			addfeed(optarg);
 			break;
 		case 'I': {
 			static void *IGNORE = (void *)0x10;	// Arbitrary.
@@ -160,20 +305,79 @@ init(int argc, char *argv[])
 			ipmapinsert(ignoreroutes, iroute, icidr, IGNORE);
 			break;
 		}
+		case 'M':
+			mpifname = optarg;
+			break;
+		case 'N':
+			usedamping = 0;
+			break;
+		case 'P':
+			poolsize = strnum(optarg);
+			break;
 		case 's': {
 			unsigned int ifnum = strnum(optarg);
 			bitset(staticinterfaces, ifnum);
 			bitset(interfaces, ifnum);
 			break;
 		}
+		case 'S':
+			statspath = optarg;
+			break;
+		case 'W':
+			workerthreads = strnum(optarg);
+			break;
+		case 'K':
+			schedrate = strnum(optarg);
+			break;
+		case 'r':
+			replaypath = optarg;
+			daemonize = 0;
+			break;
+		case 'R':
+			replayrealtime = 1;
+			break;
 		case '?':
 		case 'h':
 		default:
 			usage(prog);
 		}
 	}
+	if (nfeeds == 0) {
+		char any[] = "*";
+		addfeed(any);
+	}
+	// A replay leaves the kernel alone unless told otherwise.
+	if (replaypath != NULL && !backendset && setbackend("sim") < 0)
+		fatal("no sim backend");
 	initsys(routedomain);
-	sd = initsock(iface, RIPV2_GROUP, RIPV2_PORT, routedomain);
+	if (mpifname != NULL && !sysmultipoint())
+		fatal("backend %s has no multipoint tunnels", backendname());
+	for (int k = 0; k < nfeeds && replaypath == NULL; k++) {
+		Feed *feed = &feeds[k];
+
+		feed->sd = initsock(feed->iface, feed->group, feed->port,
+		    routedomain);
+		feed->rx.rcvbuf = setrcvbuf(feed->sd, MIN_RCVBUF);
+		if (feed->rx.rcvbuf < 0)
+			fatal("setsockopt SO_RCVBUF: %m");
+		pollfds[k].fd = feed->sd;
+		pollfds[k].events = POLLIN;
+		if (usefilter) {
+			Bpfinsn prog[MAX_RIP_FILTER];
+			size_t len;
+
+			len = mkripfilter(PASSWORD, UDP_HEADER_SIZE,
+			    prog, MAX_RIP_FILTER);
+			if (attachfilter(feed->sd, prog, len) < 0)
+				error("cannot attach socket filter: %m");
+		}
+		npollfds = k + 1;
+	}
+	if (npollfds == nfeeds && sysfd() >= 0) {
+		sysslot = npollfds++;
+		pollfds[sysslot].fd = sysfd();
+		pollfds[sysslot].events = POLLIN;
+	}
 
 	memset(&addr, 0, sizeof(addr));
 	inet_pton(AF_INET, localip, &addr);
@@ -192,104 +396,661 @@ init(int argc, char *argv[])
 		const int closeyes = 0;
 		daemon(chdiryes, closeyes);
 	}
+	// Only the main thread takes the profiling signals, so that they interrupt poll.
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onprofsig;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	sigemptyset(&profsigs);
+	sigaddset(&profsigs, SIGUSR1);
+	sigaddset(&profsigs, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &profsigs, NULL);
 	initlog();
+	startlogger(logpath, 1);
+	if (tracepath != NULL)
+		starttrace(tracepath, TRACE_EVENTS);
+	initpool(&pool, poolsize, interfaces);
+	initdamper(&damper, usedamping);
+	initaggregator(&aggregator, routes, routedomain, useaggregation);
+	initconv(&conv, nsec());
+	initsched(&sched, schedrate, schedrate);
+	setsched(&sched);
+	initworkers(workerthreads, routedomain, tunneldomain, local44addr,
+	    tunnelready);
+	if (npollfds == nfeeds && workersfd() >= 0) {
+		workslot = npollfds++;
+		pollfds[workslot].fd = workersfd();
+		pollfds[workslot].events = POLLIN;
+	}
+	if (mpifname != NULL) {
+		mptunnel.local = localaddr;
+		mptunnel.ifnum = nextbit(interfaces);
+		bitset(interfaces, mptunnel.ifnum);
+		strlcpy(mptunnel.ifname, mpifname, sizeof(mptunnel.ifname));
+	}
+	// A replay starts from nothing, whatever the host has.
+	if (replaypath == NULL)
+		warmstart();
+	if (mpifname != NULL && mptunnel.ifindex == 0) {
+		info("Creating multipoint tunnel interface %s", mptunnel.ifname);
+		if (uptunnel(&mptunnel, routedomain, tunneldomain, local44addr) < 0)
+			fatal("cannot create %s: %m", mptunnel.ifname);
+	}
+	if (replaypath != NULL)
+		reconcileinterval = 0;
+	initreconcile(&reconciler, useaggregation ? aggregator.fib : routes,
+	    tunnels, routedomain, reconcileinterval);
+	pthread_sigmask(SIG_UNBLOCK, &profsigs, NULL);
+}
 
-	return sd;
+void
+onprofsig(int sig)
+{
+	profsig = sig;
 }
 
+/*
+ * Parses a feed specification of the form iface[:group[:port]]
+ * where iface is the address of a local interface or "*".
+ */
 void
-riptide(int sd)
+addfeed(char *spec)
+{
+	Feed *feed;
+	char *colon;
+
+	if (nfeeds == MAX_FEEDS)
+		fatal("too many feeds (max %d)", MAX_FEEDS);
+	feed = &feeds[nfeeds];
+	memset(feed, 0, sizeof(*feed));
+	feed->id = nfeeds++;
+	feed->sd = -1;
+	feed->iface = spec;
+	feed->group = RIPV2_GROUP;
+	feed->port = RIPV2_PORT;
+	colon = strchr(spec, ':');
+	if (colon == NULL)
+		return;
+	*colon++ = '\0';
+	feed->group = colon;
+	colon = strchr(colon, ':');
+	if (colon == NULL)
+		return;
+	*colon++ = '\0';
+	feed->port = strnum(colon);
+}
+
+/*
+ * Waits up to `timeout` milliseconds for datagrams on any feed
+ * or replies from the kernel.  A negative timeout waits
+ * indefinitely.
+ */
+int
+waitevents(int timeout)
+{
+	int n;
+
+	n = poll(pollfds, npollfds, timeout);
+	if (n < 0 && errno != EINTR)
+		fatal("poll: %m");
+
+	return n;
+}
+
+// Returns milliseconds until the earliest open burst ends, or -1.
+int
+burstwait(void)
+{
+	uint64_t now = nsec();
+	int timeout = -1;
+
+	for (int k = 0; k < nfeeds; k++) {
+		Rxstats *rx = &feeds[k].rx;
+		uint64_t idle;
+		int left;
+
+		if (rx->burstpkts == 0)
+			continue;
+		idle = (now - rx->lastrx)/1000000;
+		left = (idle >= BURST_GAP_MS) ? 0 : BURST_GAP_MS - idle;
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+
+	return timeout;
+}
+
+/*
+ * Returns milliseconds until there is something to do other
+ * than wait for input.  The reconciler waits for bursts to end;
+ * queued kernel operations wait for the scheduler's tokens.
+ */
+int
+nextwait(void)
+{
+	int timeout, kwait;
+
+	timeout = burstwait();
+	if (timeout < 0)
+		timeout = reconcilewait(&reconciler);
+	kwait = schedwait(&sched);
+	if (kwait >= 0 && (timeout < 0 || kwait < timeout))
+		timeout = kwait;
+
+	return timeout;
+}
+
+void
+endbursts(void)
+{
+	uint64_t now = nsec();
+
+	for (int k = 0; k < nfeeds; k++) {
+		Rxstats *rx = &feeds[k].rx;
+
+		if (rx->burstpkts != 0 &&
+		    (now - rx->lastrx)/1000000 >= BURST_GAP_MS)
+			endburst(feeds[k].sd, rx);
+	}
+}
+
+// Returns whether any feed is in the middle of a burst.
+int
+bursting(void)
+{
+	for (int k = 0; k < nfeeds; k++)
+		if (feeds[k].rx.burstpkts != 0)
+			return 1;
+
+	return 0;
+}
+
+// Returns whether route changes are still on their way to the kernel.
+int
+settling(void)
+{
+	return sysbusy() || workersbusy();
+}
+
+void
+riptide(Feed *feed)
 {
-	struct sockaddr *rem;
-	struct sockaddr_in remote;
-	socklen_t remotelen;
 	ssize_t n;
-	time_t now;
-	RIPPacket pkt;
+	uint32_t kdrops;
 	octet packet[IP_MAXPACKET];
+	uint64_t t0;
 
-	memset(&remote, 0, sizeof(remote));
-	remotelen = 0;
-	rem = (struct sockaddr *)&remote;
-	n = recvfrom(sd, packet, sizeof(packet), 0, rem, &remotelen);
-	if (n < 0)
+	probe1(riptide_start, feed->id);
+	kdrops = feed->rx.kdrops;
+	t0 = profstart();
+	n = recvpkt(feed->sd, packet, sizeof(packet), &kdrops);
+	profend(STAGE_RECV, t0);
+	if (n < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
 		fatal("socket error");
+	}
+	rxpacket(feed->sd, &feed->rx, n, kdrops);
+	ripinput(feed, packet, n, time(NULL));
+	probe2(riptide_done, feed->id, n);
+}
+
+void
+ripinput(Feed *feed, const octet *packet, size_t len, time_t now)
+{
+	RIPPacket pkt;
+	Pktent *ent;
+	uint64_t hash, t0, t1;
+	int r;
+
+	t0 = profstart();
+	rxns = nsec();
+	convrx(&conv, rxns);
+	trace(TRACE_PACKET, feed->id, len, 0, 0);
 	memset(&pkt, 0, sizeof(pkt));
-	if (parserippkt(packet, n, &pkt) < 0) {
-		error("packet parse error\n");
+	t1 = profstart();
+	r = parserippkt(packet, len, &pkt);
+	profend(STAGE_PARSE, t1);
+	if (r < 0) {
+		feed->parseerrs++;
+		ratelog(LOG_ERR, feed->id, now, "packet parse error");
 		return;
 	}
-	if (verifyripauth(&pkt, PASSWORD) < 0) {
-		error("packet authentication failed\n");
+	t1 = profstart();
+	r = verifyripauth(&pkt, PASSWORD);
+	profend(STAGE_AUTH, t1);
+	if (r < 0) {
+		feed->authfails++;
+		ratelog(LOG_ERR, feed->id, now, "packet authentication failed");
 		return;
 	}
-	now = time(NULL);
-	for (int k = 0; k < pkt.nresponse; k++) {
+	hash = pkthash(pkt.data, pkt.datalen);
+	ent = pktlookup(&feed->cache, hash, pkt.data, pkt.datalen, routegen);
+	if (ent != NULL)
+		bulkrefresh(feed, ent, now);
+	else
+		ripentries(feed, &pkt, hash, now);
+	walkexpired(now);
+	workersinput();
+	aggflush(&aggregator, now);
+	sysflush();
+	poolflush(&pool);
+	convcheck(&conv, nsec(), settling(), bursting());
+	profend(STAGE_PACKET, t0);
+}
+
+/*
+ * Processes each entry of a datagram, and remembers the
+ * datagram if every entry refreshed a route.
+ */
+void
+ripentries(Feed *feed, RIPPacket *pkt, uint64_t hash, time_t now)
+{
+	Route *refreshed[IP_MAXPACKET/RIP_RESPONSE_SIZE];
+	size_t nrefreshed = 0;
+	uint64_t gen = routegen;
+
+	for (int k = 0; k < pkt->nresponse; k++) {
 		RIPResponse response;
+		Route *route;
+
 		memset(&response, 0, sizeof(response));
-		if (parseripresponse(&pkt, k, &response) < 0) {
-			notice("bad response, index %d\n", k);
+		if (parseripresponse(pkt, k, &response) < 0) {
+			feed->badentries++;
+			ratelog(LOG_NOTICE, (uint64_t)feed->id << 32 | k, now,
+			    "bad response, index %d", k);
 			continue;
 		}
-		ripresponse(&response, now);
+		route = ripresponse(feed, &response, now);
+		if (route != NULL && nrefreshed == (size_t)k)
+			refreshed[nrefreshed++] = route;
 	}
-	walkexpired(now);
+	// Only if the datagram's entries did nothing but refresh.
+	if (nrefreshed != 0 && nrefreshed == pkt->nresponse && gen == routegen)
+		pktfill(&feed->cache, hash, pkt->data, pkt->datalen, gen,
+		    refreshed, nrefreshed);
+	else
+		pktforget(&feed->cache, hash);
+}
+
+/*
+ * Refreshes the routes of a datagram we have seen before, as
+ * ripresponse would for unchanged entries.
+ */
+void
+bulkrefresh(Feed *feed, Pktent *ent, time_t now)
+{
+	feed->entries += ent->nroutes;
+	for (size_t k = 0; k < ent->nroutes; k++) {
+		Route *route = ent->routes[k];
+
+		if (nfeeds > 1 && route->feed != feed->id &&
+		    now - route->refreshed < DUP_WINDOW) {
+			feed->dups++;
+			continue;
+		}
+		route->expires = now + TIMEOUT;
+		route->refreshed = now;
+		route->feed = feed->id;
+	}
+	feed->bulk += ent->nroutes;
+	trace(TRACE_ROUTE_BULK, feed->id, ent->nroutes, 0, 0);
+}
+
+typedef struct Replay Replay;
+struct Replay {
+	Feed *feed;
+	int realtime;
+	time_t epoch;		// Virtual time of the first datagram.
+	time_t now;		// That of the latest.
+	uint64_t first;		// Capture time of the first datagram.
+	uint64_t start;		// When we started replaying.
+	size_t npkts;
+};
+
+/*
+ * Replays a capture through the full pipeline.  The clock
+ * the daemon sees advances with the capture timestamps;
+ * with `realtime` set, we also sleep to match them.
+ */
+int
+replay(const char *path, int realtime)
+{
+	Replay r;
+	Feed *feed = &feeds[0];
+	double secs;
+	int npkts, nroutes, ntunnels, bad;
+
+	memset(&r, 0, sizeof(r));
+	r.feed = feed;
+	r.realtime = realtime;
+	r.epoch = time(NULL);
+	r.start = nsec();
+	npkts = readcapture(path, replaypkt, &r);
+	if (npkts < 0)
+		fatal("cannot read capture %s: %m", path);
+	// The capture is over; report what was held back.
+	logsummary(r.now + LOG_PERIOD);
+	tunnelsync(NULL);
+	aggflush(&aggregator, r.now);
+	sysflush();
+	poolflush(&pool);
+	sysinput();
+	// The capture is one long burst, over now.
+	feed->rx.burstpkts = 0;
+	convcheck(&conv, nsec(), settling(), 0);
+	secs = (nsec() - r.start)/1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+	nroutes = 0;
+	ipmapdo(routes, printroute, &nroutes);
+	ntunnels = 0;
+	ipmapdo(tunnels, counttunnel, &ntunnels);
+	printf("%d packets, %" PRIu64 " entries in %.6f s: "
+	    "%.0f packets/s, %.0f routes/s\n",
+	    npkts, feed->entries, secs, npkts/secs, feed->entries/secs);
+	printf("%d routes, %d tunnels\n", nroutes, ntunnels);
+	dumpstats();
+	if (profiling)
+		profdump(0);
+	if (strcmp(backendname(), "sim") != 0)
+		return 0;
+	drainpool(&pool);
+	tunnelsync(NULL);
+	scheddrain(&sched);
+	sysflush();
+	bad = simverify(useaggregation ? aggregator.fib : routes, tunnels);
+	printf("kernel state %s (%d discrepancies)\n",
+	    (bad == 0) ? "matches" : "differs", bad);
+
+	return (bad == 0) ? 0 : 1;
+}
+
+void
+replaypkt(const octet *packet, size_t len, uint64_t ts, void *arg)
+{
+	Replay *r = arg;
+	uint64_t offset;
+
+	if (r->npkts++ == 0)
+		r->first = ts;
+	offset = (ts > r->first) ? ts - r->first : 0;
+	if (r->realtime) {
+		uint64_t elapsed = nsec() - r->start;
+		if (offset > elapsed) {
+			struct timespec ts;
+			ts.tv_sec = (offset - elapsed)/1000000000;
+			ts.tv_nsec = (offset - elapsed)%1000000000;
+			nanosleep(&ts, NULL);
+		}
+	}
+	r->feed->rx.packets++;
+	r->feed->rx.bytes += len;
+	r->feed->rx.burstpkts++;
+	r->now = r->epoch + offset/1000000000;
+	ripinput(r->feed, packet, len, r->now);
+}
+
+void
+printroute(uint32_t key, size_t keylen, void *routep, void *countp)
+{
+	Route *route = routep;
+	int *count = countp;
+	char proute[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
+
+	ipaddrstr(route->ipnet, proute);
+	ipaddrstr(route->gateway, gw);
+	printf("%s/%zu -> %s", proute, keylen, gw);
+	if (route->tunnel != NULL)
+		printf(" on %s", route->tunnel->ifname);
+	printf("\n");
+	++*count;
 }
 
 void
-ripresponse(RIPResponse *response, time_t now)
+counttunnel(uint32_t key, size_t keylen, void *tunnel, void *countp)
+{
+	int *count = countp;
+
+	++*count;
+}
+
+/*
+ * Returns true if another feed refreshed the route for this
+ * response during the current cycle, in which case the entry
+ * is a duplicate and needs no further processing.
+ */
+static bool
+isdup(Feed *feed, Route *route, RIPResponse *response, time_t now)
+{
+	if (nfeeds < 2)
+		return false;
+	if (route == NULL || route->feed == feed->id ||
+	    now - route->refreshed >= DUP_WINDOW)
+		return false;
+	feed->dups++;
+	if (route->gateway != response->nexthop)
+		feed->conflicts++;
+
+	return true;
+}
+
+/*
+ * Acts on one entry of a datagram.  Returns the route it
+ * refreshed, or nil.
+ */
+Route *
+ripresponse(Feed *feed, RIPResponse *response, time_t now)
 {
 	Route *route;
-	Tunnel *tunnel;
+	uint64_t t0;
+
+	probe4(response_start, feed->id, response->ipaddr,
+	    response->subnetmask, response->nexthop);
+	t0 = profstart();
+	route = respond(feed, response, now);
+	profend(STAGE_ENTRY, t0);
+	probe1(response_done, route != NULL);
+
+	return route;
+}
+
+Route *
+respond(Feed *feed, RIPResponse *response, time_t now)
+{
+	Route *route;
+	Tunnel *tunnel, *old;
 	size_t cidr;
-	char proute[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
 
+	feed->entries++;
+	trace(TRACE_ENTRY, response->ipaddr, response->subnetmask,
+	    response->nexthop, feed->id);
 	cidr = netmask2cidr(response->subnetmask);
-	ipaddrstr(response->ipaddr, proute);
-	ipaddrstr(response->nexthop, gw);
+	route = ipmapfind(routes, response->ipaddr & response->subnetmask,
+	    cidr);
+	if (isdup(feed, route, response, now))
+		return NULL;
+	// Most entries are just what we have; they need only a refresh.
+	if (route != NULL && route->tunnel != NULL &&
+	    route->tunnel->remote == response->nexthop &&
+	    (response->ipaddr & ~response->subnetmask) == 0 &&
+	    dampquiet(&damper, route->ipnet, cidr)) {
+		route->expires = now + TIMEOUT;
+		route->refreshed = now;
+		route->feed = feed->id;
+		feed->unchanged++;
+		trace(TRACE_ROUTE_REFRESH, route->ipnet, route->subnetmask,
+		    route->gateway, feed->id);
+		return route;
+	}
 	if (response->ipaddr & ~response->subnetmask)
-		error("route ipaddr %s has more bits than netmask, %zu",
-		    proute, cidr);
+		ratelog(LOG_ERR, (uint64_t)response->ipaddr << 8 | cidr, now,
+		    "route ipaddr %I has more bits than netmask, %zu",
+		    response->ipaddr, cidr);
 	response->ipaddr &= response->subnetmask;
 	if (response->nexthop == localaddr) {
-		notice("skipping route for %s/%zu to local address",
-		    proute, cidr);
-		return;
+		ratelog(LOG_NOTICE, (uint64_t)response->ipaddr << 8 | cidr, now,
+		    "skipping route for %I/%zu to local address",
+		    response->ipaddr, cidr);
+		return NULL;
 	}
 	if ((response->nexthop & response->ipaddr) == response->nexthop) {
-		error("skipping gateway inside of subnet (%s/%zu -> %s)",
-		    proute, cidr, gw);
-		return;
+		ratelog(LOG_ERR, (uint64_t)response->ipaddr << 32 |
+		    response->nexthop, now,
+		    "skipping gateway inside of subnet (%I/%zu -> %I)",
+		    response->ipaddr, cidr, response->nexthop);
+		return NULL;
+	}
+	if (damped(&damper, route, response->ipaddr, cidr, response->nexthop,
+	    now))
+	{
+		debug("Damped route %I/%zu -> %I", response->ipaddr, cidr,
+		    response->nexthop);
+		routegen++;
+		return NULL;
 	}
 	tunnel = ipmapfind(tunnels, response->nexthop, CIDR_HOST);
 	if (tunnel == NULL && defgwaddr != response->nexthop) {
-		tunnel = mktunnel(localaddr, response->nexthop);
-		alloctunif(tunnel, interfaces);
-		uptunnel(tunnel, routedomain, tunneldomain, local44addr);
+		if (mpifname != NULL)
+			tunnel = mkpeer(response->nexthop);
+		else
+			tunnel = unpark(&pool, response->nexthop);
+		if (tunnel == NULL) {
+			tunnel = mktunnel(localaddr, response->nexthop);
+			alloctunif(tunnel, interfaces);
+			tunnelup(tunnel);
+		}
 		ipmapinsert(tunnels, response->nexthop, CIDR_HOST, tunnel);
 	}
-	route = ipmapfind(routes, response->ipaddr, cidr);
 	if (route == NULL) {
 		route = mkroute(
 		    response->ipaddr,
 		    response->subnetmask,
 		    response->nexthop);
 		ipmapinsert(routes, route->ipnet, cidr, route);
-		info("Added route %s/%zu -> %s", proute, cidr, gw);
+		info("Added route %I/%zu -> %I", route->ipnet, cidr,
+		    route->gateway);
 	}
 	// The route is new or moved to a different tunnel.
 	if (route->tunnel != tunnel) {
 		if (route->tunnel == NULL)
-			addroute(route, tunnel, routedomain);
+			trace(TRACE_ROUTE_ADD, route->ipnet, route->subnetmask,
+			    response->nexthop, feed->id);
 		else
-			chroute(route, tunnel, routedomain);
+			trace(TRACE_ROUTE_CHANGE, route->ipnet,
+			    route->subnetmask, response->nexthop,
+			    route->gateway);
+		convchange(&conv, rxns);
+		routegen++;
+		installroute(route, tunnel);
+		old = route->tunnel;
 		unlinkroute(tunnel, route);
-		unlinkroute(route->tunnel, route);
-		collapse(route->tunnel);
+		unlinkroute(old, route);
+		// Relink first: collapsing flushes the aggregates.
 		linkroute(tunnel, route);
+		collapse(old, now);
 	}
 	route->expires = now + TIMEOUT;
-	debug("RIPv2 response: %s/%zu -> %s", proute, cidr, gw);
+	route->refreshed = now;
+	route->feed = feed->id;
+	debug("RIPv2 response: %I/%zu -> %I", response->ipaddr, cidr,
+	    response->nexthop);
+
+	return route;
+}
+
+void
+rxpacket(int sd, Rxstats *rx, size_t len, uint32_t kdrops)
+{
+	size_t queued;
+
+	// On the first datagram of a burst, snapshot the drop counter.
+	if (rx->burstpkts == 0)
+		rxdrops(sd, &rx->kdrops);
+	if (kdrops != rx->kdrops) {
+		rx->burstdrops += kdrops - rx->kdrops;
+		rx->kdrops = kdrops;
+	}
+	rx->packets++;
+	rx->bytes += len;
+	rx->burstpkts++;
+	rx->burstbytes += len;
+	queued = rxqueued(sd) + len;
+	if (queued > rx->qhiwat)
+		rx->qhiwat = queued;
+	rx->lastrx = nsec();
+}
+
+/*
+ * Closes out a burst of datagrams and grows the socket
+ * receive buffer if the burst came close to filling it
+ * or the kernel dropped anything.
+ */
+void
+endburst(int sd, Rxstats *rx)
+{
+	uint32_t kdrops;
+	size_t want;
+
+	if (rxdrops(sd, &kdrops) == 0) {
+		rx->burstdrops += kdrops - rx->kdrops;
+		rx->kdrops = kdrops;
+	}
+	rx->drops += rx->burstdrops;
+	rx->bursts++;
+	rx->lastburstpkts = rx->burstpkts;
+	rx->lastburstbytes = rx->burstbytes;
+	rx->lastburstdrops = rx->burstdrops;
+	if (rx->burstbytes > rx->maxburstbytes)
+		rx->maxburstbytes = rx->burstbytes;
+	if (rx->burstdrops != 0)
+		notice("kernel dropped %" PRIu32 " datagrams in a burst of %zu",
+		    rx->burstdrops, rx->burstpkts);
+
+	want = rx->maxburstbytes*RCVBUF_SLACK;
+	if (rx->burstdrops != 0 && want < (size_t)rx->rcvbuf*2)
+		want = (size_t)rx->rcvbuf*2;
+	if (want > MAX_RCVBUF)
+		want = MAX_RCVBUF;
+	if (want > (size_t)rx->rcvbuf) {
+		int rcvbuf = setrcvbuf(sd, want);
+		if (rcvbuf < 0)
+			error("cannot grow receive buffer to %zu: %m", want);
+		else {
+			info("Receive buffer %d -> %d bytes (burst of %zu bytes)",
+			    rx->rcvbuf, rcvbuf, rx->burstbytes);
+			rx->rcvbuf = rcvbuf;
+		}
+	}
+	rx->burstpkts = 0;
+	rx->burstbytes = 0;
+	rx->burstdrops = 0;
+	dumpstats();
+}
+
+void
+dumpstats(void)
+{
+	FILE *fp;
+
+	fp = statsbegin(statspath);
+	if (fp == NULL)
+		return;
+	for (int k = 0; k < nfeeds; k++)
+		statsfeed(fp, &feeds[k]);
+	statspool(fp, &pool);
+	statsdamper(fp, &damper);
+	statsaggregator(fp, &aggregator);
+	statsreconcile(fp, &reconciler);
+	statsworkers(fp);
+	statssched(fp, &sched);
+	statsbackend(fp);
+	statslog(fp);
+	statstrace(fp);
+	statsprof(fp);
+	statsconv(fp, &conv);
+	statsend(fp, statspath);
 }
 
 Route *
@@ -321,6 +1082,25 @@ mktunnel(uint32_t local, uint32_t remote)
 	return tunnel;
 }
 
+/*
+ * In multipoint mode, a peer's Tunnel is only bookkeeping: its
+ * routes go out the shared interface with the peer as their
+ * gateway.
+ */
+Tunnel *
+mkpeer(uint32_t remote)
+{
+	Tunnel *tunnel;
+
+	tunnel = mktunnel(localaddr, remote);
+	tunnel->multipoint = 1;
+	tunnel->ifnum = mptunnel.ifnum;
+	tunnel->ifindex = mptunnel.ifindex;
+	memmove(tunnel->ifname, mptunnel.ifname, sizeof(tunnel->ifname));
+
+	return tunnel;
+}
+
 void
 alloctunif(Tunnel *tunnel, Bitvec *interfaces)
 {
@@ -333,6 +1113,47 @@ alloctunif(Tunnel *tunnel, Bitvec *interfaces)
 	info("Allocating tunnel interface %s", tunnel->ifname);
 }
 
+/*
+ * Points the kernel's route at `tunnel`.  If the tunnel's
+ * interface is still being brought up, this waits for
+ * tunnelready; meanwhile the kernel keeps whatever it had.
+ */
+void
+installroute(Route *route, Tunnel *tunnel)
+{
+	if (aggregator.enabled) {
+		aggchanged(&aggregator);
+		return;
+	}
+	if (tunnel != NULL && tunnel->pending != 0)
+		return;
+	if (route->installed)
+		chroute(route, tunnel, routedomain);
+	else
+		addroute(route, tunnel, routedomain);
+	route->installed = 1;
+}
+
+void
+uninstallroute(Route *route)
+{
+	if (aggregator.enabled)
+		aggchanged(&aggregator);
+	else if (route->installed)
+		rmroute(route, routedomain);
+	route->installed = 0;
+}
+
+// Installs the routes that were waiting for a tunnel to come up.
+void
+tunnelready(Tunnel *tunnel, int err)
+{
+	if (err != 0)
+		return;
+	for (Route *route = tunnel->routes; route != NULL; route = route->rnext)
+		installroute(route, tunnel);
+}
+
 void
 unlinkroute(Tunnel *tunnel, Route *route)
 {
@@ -376,12 +1197,19 @@ void
 walkexpired(time_t now)
 {
 	WalkState state = { now, NULL };
+	uint64_t t0;
 
+	probe1(expire_start, now);
+	t0 = profstart();
 	ipmapdo(routes, expire, &state);
 	if (state.deleting != NULL) {
-		ipmapdo(state.deleting, destroy, NULL);
+		ipmapdo(state.deleting, destroy, &state);
 		freeipmap(state.deleting, free);
 	}
+	prunepool(&pool, now);
+	dampsweep(&damper, now);
+	profend(STAGE_EXPIRE, t0);
+	probe1(expire_done, now);
 }
 
 void
@@ -390,7 +1218,6 @@ expire(uint32_t key, size_t keylen, void *routep, void *statep)
 	Route *route = routep;
 	WalkState *state = statep;
 	size_t cidr;
-	char proute[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
 
 	if (route->expires > state->now)
 		return;
@@ -399,40 +1226,41 @@ expire(uint32_t key, size_t keylen, void *routep, void *statep)
 		state->deleting = mkipmap(); 
 	cidr = netmask2cidr(route->subnetmask);
 	assert(cidr == keylen);
-	ipaddrstr(route->ipnet, proute);
-	ipaddrstr(route->gateway, gw);
-	info("Expiring route %s/%zu -> %s", proute, cidr, gw);
+	info("Expiring route %I/%zu -> %I", route->ipnet, cidr, route->gateway);
+	trace(TRACE_ROUTE_EXPIRE, route->ipnet, route->subnetmask,
+	    route->gateway, 0);
 	ipmapinsert(state->deleting, key, keylen, route);
 }
 
 void
-destroy(uint32_t key, size_t keylen, void *routep, void *unused)
+destroy(uint32_t key, size_t keylen, void *routep, void *statep)
 {
 	Route *route = routep;
+	WalkState *state = statep;
 	Tunnel *tunnel;
 	void *datum;
 	size_t cidr;
-	char proute[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
 
-	(void)unused;
 	if (route == NULL)
 		return;
 	cidr = netmask2cidr(route->subnetmask);
 	assert(cidr == keylen);
-	ipaddrstr(route->ipnet, proute);
-	ipaddrstr(route->gateway, gw);
-	info("Destroying route %s/%zu -> %s", proute, cidr, gw);
+	info("Destroying route %I/%zu -> %I", route->ipnet, cidr, route->gateway);
+	trace(TRACE_ROUTE_DESTROY, route->ipnet, route->subnetmask,
+	    route->gateway, 0);
+	routegen++;
 	datum = ipmapremove(routes, key, keylen);
 	assert(datum == route);
+	dampwithdraw(&damper, key, keylen, route->gateway, state->now);
 	tunnel = route->tunnel;
 	assert(tunnel != NULL);
 	unlinkroute(tunnel, route);
-	rmroute(route, routedomain);
-	collapse(tunnel);
+	uninstallroute(route);
+	collapse(tunnel, state->now);
 }
 
 void
-collapse(Tunnel *tunnel)
+collapse(Tunnel *tunnel, time_t now)
 {
 	if (tunnel == NULL)
 		return;
@@ -440,19 +1268,147 @@ collapse(Tunnel *tunnel)
 	if (tunnel->nref == 0) {
 		void *datum = ipmapremove(tunnels, tunnel->remote, CIDR_HOST);
 		assert(datum == tunnel);
-		info("Tearing down tunnel interface %s", tunnel->ifname);
+		trace(TRACE_TUNNEL_IDLE, tunnel->remote, 0, tunnel->ifnum, 0);
+		// No aggregate may still point at it.
+		aggflush(&aggregator, now);
+		if (tunnel->multipoint)
+			free(tunnel);
+		else
+			park(&pool, tunnel, now);
+	}
+}
+
+typedef struct Warm Warm;
+struct Warm {
+	IPMap *byindex;		// Adopted tunnels, keyed by ifindex.
+	time_t now;
+	int ntunnels;
+	int nroutes;
+};
+
+/*
+ * Adopts the tunnels and routes that a previous run left in
+ * the kernel, so that restarting the daemon does not disturb
+ * traffic.  Adopted routes expire as usual unless the next
+ * broadcast refreshes them.  Tunnels left without routes are
+ * parked.
+ */
+void
+warmstart(void)
+{
+	Warm warm;
+
+	memset(&warm, 0, sizeof(warm));
+	warm.byindex = mkipmap();
+	warm.now = time(NULL);
+	if (scantunnels(adopttunnel, &warm) < 0) {
+		if (errno != EOPNOTSUPP)
+			error("cannot scan tunnel interfaces: %m");
+		freeipmap(warm.byindex, NULL);
+		return;
+	}
+	if (scanroutes(routedomain, adoptroute, &warm) < 0)
+		error("cannot scan routing table %d: %m", routedomain);
+	ipmapdo(warm.byindex, dropidle, &warm);
+	freeipmap(warm.byindex, NULL);
+	sysflush();
+	poolflush(&pool);
+	info("Adopted %d tunnels and %d routes", warm.ntunnels, warm.nroutes);
+}
+
+void
+adopttunnel(Kif *kif, void *warmp)
+{
+	Warm *warm = warmp;
+	Tunnel *tunnel;
+	unsigned int ifnum;
+	int n;
+
+	if (mpifname != NULL && strcmp(kif->ifname, mpifname) == 0) {
+		if (kif->remote != 0)
+			fatal("%s is not a multipoint tunnel", kif->ifname);
+		mptunnel.ifindex = kif->ifindex;
+		ipmapinsert(warm->byindex, kif->ifindex, CIDR_HOST, &mptunnel);
+		return;
+	}
+	n = 0;
+	if (sscanf(kif->ifname, "gif%u%n", &ifnum, &n) != 1 ||
+	    kif->ifname[n] != '\0')
+		return;
+	// Whatever it is, we cannot create another by that name.
+	bitset(interfaces, ifnum);
+	if (bitget(staticinterfaces, ifnum) || kif->local != localaddr ||
+	    kif->remote == 0 || kif->remote == defgwaddr)
+		return;
+	tunnel = mktunnel(kif->local, kif->remote);
+	tunnel->ifnum = ifnum;
+	tunnel->ifindex = kif->ifindex;
+	strlcpy(tunnel->ifname, kif->ifname, sizeof(tunnel->ifname));
+	if (ipmapfind(tunnels, kif->remote, CIDR_HOST) != NULL) {
+		// A second interface to the same place; left from a crash.
+		info("Removing duplicate tunnel interface %s", tunnel->ifname);
 		downtunnel(tunnel);
-		bitclr(interfaces, tunnel->ifnum);
+		bitclr(interfaces, ifnum);
 		free(tunnel);
+		return;
 	}
+	ipmapinsert(tunnels, tunnel->remote, CIDR_HOST, tunnel);
+	ipmapinsert(warm->byindex, kif->ifindex, CIDR_HOST, tunnel);
+	warm->ntunnels++;
+}
+
+void
+adoptroute(Kroute *kr, void *warmp)
+{
+	Warm *warm = warmp;
+	Tunnel *tunnel;
+	Route *route;
+	size_t cidr;
+
+	tunnel = ipmapfind(warm->byindex, kr->ifindex, CIDR_HOST);
+	if (tunnel == NULL || !isvalidnetmask(kr->subnetmask))
+		return;
+	cidr = netmask2cidr(kr->subnetmask);
+	if (ipmapfind(routes, kr->ipnet, cidr) != NULL)
+		return;
+	if (tunnel == &mptunnel) {
+		if (kr->gateway == 0)
+			return;
+		tunnel = ipmapfind(tunnels, kr->gateway, CIDR_HOST);
+		if (tunnel == NULL) {
+			tunnel = mkpeer(kr->gateway);
+			ipmapinsert(tunnels, kr->gateway, CIDR_HOST, tunnel);
+		}
+	}
+	route = mkroute(kr->ipnet, kr->subnetmask, tunnel->remote);
+	ipmapinsert(routes, route->ipnet, cidr, route);
+	linkroute(tunnel, route);
+	route->installed = 1;
+	aggadopt(&aggregator, route);
+	route->expires = warm->now + TIMEOUT;
+	route->feed = -1;
+	warm->nroutes++;
+}
+
+void
+dropidle(uint32_t key, size_t keylen, void *tunnelp, void *warmp)
+{
+	Warm *warm = warmp;
+
+	(void)key;
+	(void)keylen;
+	if (tunnelp != &mptunnel)
+		collapse(tunnelp, warm->now);
 }
 
 void
 usage(const char *restrict prog)
 {
 	fprintf(stderr,
-	    "Usage: %s [ -d ] [ -T rtable ] [ -L local_ip ] "
-	        "[ -I ignore ] [ -s static_ifnum ]\n",
+	    "Usage: %s [ -adfNpv ] [ -A interval ] [ -B backend[:opts] ] "
+	        "[ -T rtable ] [ -K ops_per_sec ] [ -L local_ip ] [ -i iface[:group[:port]] ... ] "
+	        "[ -I ignore ] [ -M mpifname ] [ -o logfile ] [ -P poolsize ] [ -s static_ifnum ] "
+	        "[ -S statsfile ] [ -t tracefile ] [ -W workers ] [ -r capture [ -R ] ]\n",
 	    prog);
 	exit(EXIT_FAILURE);
 }
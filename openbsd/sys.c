@@ -1,16 +1,19 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/sysctl.h>
 #include <net/if.h>
 #include <net/if_dl.h>
 #include <net/route.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/udp.h>
+#include <netinet/udp_var.h>
 #include <arpa/inet.h>
 
 #include <assert.h>
 #include <err.h>
+#include <ifaddrs.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -24,24 +27,55 @@
 #include "dat.h"
 #include "fns.h"
 
-static int ctlfd = -1;
+static void kinitsys(int rtable);
+static int kuptunnel(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint);
+static int kdowntunnel(Tunnel *tunnel);
+static int kaddroute(Route *route, Tunnel *tunnel, int rtable);
+static int kchroute(Route *route, Tunnel *tunnel, int rtable);
+static int krmroute(Route *route, int rtable);
+static void kflush(void);
+static int kpollfd(void);
+static void kinput(void);
+static void kstats(FILE *fp);
+static int kscantunnels(void (*fn)(Kif *kif, void *arg), void *arg);
+static int kscanroutes(int rtable, void (*fn)(Kroute *kr, void *arg), void *arg);
+static void mkrttmpl(void);
+static void ctlopen(void);
+
+enum {
+	RTBUF_SIZE = 64*1024,
+	RTRCVBUF_SIZE = 256*1024,
+	MAX_RTOPS = 4096,	// Must exceed the messages in a full rtbuf.
+	MAX_RTTRIES = 3,
+};
+
+// Tunnels may be set up from worker threads; each has its own.
+static _Thread_local int ctlfd = -1;
 static int rtfd = -1;
 
 uint32_t hostmask;
 
-void
-initsys(int rtable)
+static void
+kinitsys(int rtable)
 {
 	struct in_addr addr;
+	unsigned int filter;
+	int size;
 
-	ctlfd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (ctlfd < 0)
-		fatal("ctl socket: %m");
+	ctlopen();
 	rtfd = socket(PF_ROUTE, SOCK_RAW, AF_INET);
 	if (rtfd < 0)
 		fatal("route socket: %m");
-	if (shutdown(rtfd, SHUT_RD) < 0)
-		fatal("route shutdown read: %m");
+	size = RTRCVBUF_SIZE;
+	if (setsockopt(rtfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+		error("route socket SO_RCVBUF: %m");
+	// We only want to hear about route changes in our table.
+	filter = ROUTE_FILTER(RTM_ADD) | ROUTE_FILTER(RTM_CHANGE) |
+	    ROUTE_FILTER(RTM_DELETE) | ROUTE_FILTER(RTM_DESYNC);
+	if (setsockopt(rtfd, AF_ROUTE, ROUTE_MSGFILTER, &filter, sizeof(filter)) < 0)
+		error("route socket ROUTE_MSGFILTER: %m");
+	if (setsockopt(rtfd, AF_ROUTE, ROUTE_TABLEFILTER, &rtable, sizeof(rtable)) < 0)
+		error("route socket ROUTE_TABLEFILTER: %m");
 	if (0 && setsockopt(rtfd, SOL_SOCKET, SO_RTABLE, &rtable, sizeof(rtable)) < 0)
 		fatal("setsockopt rtfd SO_RTABLE: %m");
 
@@ -49,6 +83,7 @@ initsys(int rtable)
 	memset(&addr, 0, sizeof(addr));
 	inet_pton(AF_INET, "255.255.255.255", &addr);
 	hostmask = addr.s_addr;
+	mkrttmpl();
 }
 
 int
@@ -74,6 +109,14 @@ initsock(const char *restrict iface, const char *restrict group, int port, int r
 	on = 1;
 	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
 		fatal("setsockopt SO_REUSEADDR: %m");
+	// Several feeds may listen on the same port.
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+		fatal("setsockopt SO_REUSEPORT: %m");
+#ifdef SO_RXQ_OVFL
+	// Have the kernel report its drop counter with each datagram.
+	if (setsockopt(sd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+		error("setsockopt SO_RXQ_OVFL: %m");
+#endif
 	// On OpenBSD, we use the `route` command to set the listening rtable.
 	if (0 && setsockopt(sd, SOL_SOCKET, SO_RTABLE, &rtable, sizeof(rtable)) < 0)
 		fatal("setsockopt SO_RTABLE: %m");
@@ -92,6 +135,110 @@ initsock(const char *restrict iface, const char *restrict group, int port, int r
 	return sd;
 }
 
+/*
+ * Receive a datagram.  If the kernel attached its count of
+ * datagrams dropped on the socket, store it in `drops`.
+ */
+ssize_t
+recvpkt(int sd, octet *buf, size_t size, uint32_t *drops)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(uint32_t))];
+	} cmsgbuf;
+	ssize_t n;
+
+	assert(drops != NULL);
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+	n = recvmsg(sd, &msg, 0);
+	if (n < 0)
+		return n;
+#ifdef SO_RXQ_OVFL
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	    cm != NULL;
+	    cm = CMSG_NXTHDR(&msg, cm))
+	{
+		if (cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SO_RXQ_OVFL)
+			memmove(drops, CMSG_DATA(cm), sizeof(*drops));
+	}
+#endif
+
+	return n;
+}
+
+// Returns the number of bytes waiting in the receive queue.
+size_t
+rxqueued(int sd)
+{
+	int nbytes;
+
+	if (ioctl(sd, FIONREAD, &nbytes) < 0 || nbytes < 0)
+		return 0;
+
+	return nbytes;
+}
+
+/*
+ * OpenBSD does not keep a per-socket drop counter, so we
+ * report the system-wide count of UDP datagrams dropped
+ * because the receiving socket was full.  The daemon is
+ * normally the only busy UDP listener on the router.
+ */
+int
+rxdrops(int sd, uint32_t *drops)
+{
+	int mib[] = { CTL_NET, PF_INET, IPPROTO_UDP, UDPCTL_STATS };
+	struct udpstat udpstat;
+	size_t len;
+
+	(void)sd;
+	len = sizeof(udpstat);
+	if (sysctl(mib, 4, &udpstat, &len, NULL, 0) < 0)
+		return -1;
+	*drops = udpstat.udps_fullsock;
+
+	return 0;
+}
+
+// Sets the receive buffer size and returns the size granted.
+int
+setrcvbuf(int sd, int size)
+{
+	socklen_t len;
+
+	if (setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+		return -1;
+	len = sizeof(size);
+	if (getsockopt(sd, SOL_SOCKET, SO_RCVBUF, &size, &len) < 0)
+		return -1;
+
+	return size;
+}
+
+/*
+ * OpenBSD can only attach BPF programs to bpf(4) devices,
+ * not to sockets, so datagrams are filtered in userspace.
+ */
+int
+attachfilter(int sd, const Bpfinsn *prog, size_t len)
+{
+	(void)sd;
+	(void)prog;
+	(void)len;
+	errno = EOPNOTSUPP;
+
+	return -1;
+}
+
 /*
  * Bring a tunnel up in routing domain `rdomain`, with
  * the tunnel endpoints routing in `tunneldomain`.
@@ -110,8 +257,8 @@ initsock(const char *restrict iface, const char *restrict group, int port, int r
  * 5. Configure the interface up and mark it running.
  * 6. Configure IP on the interface.
  */
-int
-uptunnel(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint)
+static int
+kuptunnel(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint)
 {
 	struct ifreq ifr;
 	struct if_laddrreq tr;
@@ -119,7 +266,7 @@ uptunnel(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint)
 	struct sockaddr_in addr;
 
 	assert(tunnel != NULL);
-	assert(ctlfd >= 0);
+	ctlopen();
 
 	// Zero everything.
 	memset(&ifr, 0, sizeof(ifr));
@@ -189,25 +336,83 @@ uptunnel(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint)
 	memmove(&ir.ifra_mask, &addr, sizeof(addr));
 	if (ioctl(ctlfd, SIOCAIFADDR, &ir) < 0)
 		fatal("dummy inet %s failed: %m", tunnel->ifname);
+	tunnel->ifindex = if_nametoindex(tunnel->ifname);
 
 	return 0;
 }
 
-int
-downtunnel(Tunnel *tunnel)
+// Opens this thread's control socket, if it has none yet.
+static void
+ctlopen(void)
+{
+	if (ctlfd >= 0)
+		return;
+	ctlfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (ctlfd < 0)
+		fatal("ctl socket: %m");
+}
+
+/*
+ * Points an existing tunnel at new endpoints.  Everything
+ * else about the interface stays as kuptunnel left it.
+ */
+static int
+kretunnel(Tunnel *tunnel)
+{
+	struct if_laddrreq tr;
+	struct sockaddr_in addr;
+
+	assert(tunnel != NULL);
+	ctlopen();
+	memset(&tr, 0, sizeof(tr));
+	memset(&addr, 0, sizeof(addr));
+	strlcpy(tr.iflr_name, tunnel->ifname, sizeof(tr.iflr_name));
+	addr.sin_len = sizeof(addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(tunnel->local);
+	memmove(&tr.addr, &addr, sizeof(addr));
+	addr.sin_addr.s_addr = htonl(tunnel->remote);
+	memmove(&tr.dstaddr, &addr, sizeof(addr));
+	if (ioctl(ctlfd, SIOCSLIFPHYADDR, &tr) < 0) {
+		error("re-pointing tunnel %s failed: %m", tunnel->ifname);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+kdowntunnel(Tunnel *tunnel)
 {
 	struct ifreq ifr;
 
 	assert(tunnel != NULL);
-	assert(ctlfd >= 0);
+	ctlopen();
 	memset(&ifr, 0, sizeof(ifr));
 	strlcpy(ifr.ifr_name, tunnel->ifname, sizeof(ifr.ifr_name));
 	if (ioctl(ctlfd, SIOCIFDESTROY, &ifr) < 0)
 		fatal("destroying %s failed: %m", tunnel->ifname);
+	tunnel->ifindex = 0;
 
 	return 0;
 }
 
+/*
+ * Route messages are stamped from templates built once at
+ * startup into a buffer, and written to the routing socket
+ * when the daemon ends a transaction.  The OpenBSD routing
+ * socket accepts exactly one message per write, so a flush
+ * still costs a write per route, but a burst no longer pays
+ * for building each message from scratch, nor for getpid and
+ * an interface lookup on every one.
+ *
+ * The kernel echoes each message back to the socket with its
+ * outcome.  We keep a record of every operation in flight,
+ * indexed by sequence number, and settle it when its echo is
+ * read from the event loop.  Failures that may succeed in
+ * another form, such as a change to a route that has gone
+ * away, are collected and sent again as a batch.
+ */
 typedef struct Routemsg Routemsg;
 struct Routemsg {
 	alignas(long) struct rt_msghdr header;
@@ -216,117 +421,561 @@ struct Routemsg {
 	alignas(long) struct sockaddr_in netmask;
 };
 
+// A delete carries no gateway.
+typedef struct Delmsg Delmsg;
+struct Delmsg {
+	alignas(long) struct rt_msghdr header;
+	alignas(long) struct sockaddr_in dst;
+	alignas(long) struct sockaddr_in netmask;
+};
+
+typedef struct Rtop Rtop;
+struct Rtop {
+	int seq;
+	int cmd;
+	int pending;		// Written; waiting for the echo.
+	int werr;		// What write said, if the echo is lost.
+	int tries;
+	int rtable;
+	uint32_t ipnet;
+	uint32_t subnetmask;
+	uint32_t gateway;
+	unsigned int ifindex;
+};
+
+typedef struct Rtstats Rtstats;
+struct Rtstats {
+	uint64_t batches;
+	uint64_t messages;
+	uint64_t writes;
+	uint64_t acks;
+	uint64_t retries;
+	uint64_t errors;
+	uint64_t lost;
+};
+
+static Routemsg addtmpl;
+static Delmsg deltmpl;
+static alignas(long) octet rtbuf[RTBUF_SIZE];
+static size_t rtlen;
+static int rtseq;
+static pid_t rtpid;
+static Rtop rtops[MAX_RTOPS];
+static Rtop rtretry[MAX_RTOPS];
+static Rtop rtresend[MAX_RTOPS];	// The retries kflush is sending.
+static size_t nrtretry;
+static size_t rtpending;	// Operations written and not yet settled.
+static Rtstats rtstats;
+
+static void
+mkrttmpl(void)
+{
+	rtpid = getpid();
+
+	addtmpl.header.rtm_msglen = sizeof(addtmpl);
+	addtmpl.header.rtm_version = RTM_VERSION;
+	addtmpl.header.rtm_hdrlen = sizeof(addtmpl.header);
+	addtmpl.header.rtm_addrs = RTA_DST | RTA_GATEWAY | RTA_NETMASK;
+	addtmpl.header.rtm_flags = RTF_UP | RTF_CLONING /* | RTF_LLINFO | RTF_CONNECTED*/;
+	addtmpl.header.rtm_pid = rtpid;
+	addtmpl.dst.sin_len = sizeof(addtmpl.dst);
+	addtmpl.dst.sin_family = AF_INET;
+	addtmpl.gw.sdl_len = sizeof(addtmpl.gw);
+	addtmpl.gw.sdl_family = AF_LINK;
+	addtmpl.netmask.sin_len = sizeof(addtmpl.netmask);
+	addtmpl.netmask.sin_family = AF_INET;
+
+	deltmpl.header = addtmpl.header;
+	deltmpl.header.rtm_msglen = sizeof(deltmpl);
+	deltmpl.header.rtm_type = RTM_DELETE;
+	deltmpl.header.rtm_addrs = RTA_DST | RTA_NETMASK;
+	deltmpl.dst = addtmpl.dst;
+	deltmpl.netmask = addtmpl.netmask;
+}
+
+static unsigned int
+tunnelindex(Tunnel *tunnel)
+{
+	if (tunnel->ifindex == 0)
+		tunnel->ifindex = if_nametoindex(tunnel->ifname);
+	return tunnel->ifindex;
+}
+
+// Builds the message for `op` in `buf` and returns its length.
 static size_t
-mkrtmsg(int cmd, Route *route, Tunnel *tunnel, int rtable, Routemsg *msg)
+stamp(Rtop *op, void *buf)
 {
-	static int seqno = 0;
-	struct rt_msghdr *header;
-	struct sockaddr_in *dst, *netmask;
-	struct sockaddr_dl *gw;
+	struct rt_msghdr *header = buf;
+
+	if (op->cmd == RTM_DELETE) {
+		Delmsg *msg = buf;
+		*msg = deltmpl;
+		msg->dst.sin_addr.s_addr = htonl(op->ipnet);
+		msg->netmask.sin_addr.s_addr = htonl(op->subnetmask);
+	} else {
+		Routemsg *msg = buf;
+		*msg = addtmpl;
+		msg->header.rtm_type = op->cmd;
+		msg->dst.sin_addr.s_addr = htonl(op->ipnet);
+		msg->gw.sdl_index = op->ifindex;
+		msg->netmask.sin_addr.s_addr = htonl(op->subnetmask);
+	}
+	header->rtm_tableid = op->rtable;
+	header->rtm_seq = op->seq;
+	if (op->subnetmask == hostmask)
+		header->rtm_flags |= RTF_HOST;
 
-	assert(route != NULL);
-	assert(rtable >= 0);
-	assert(msg != NULL);
-
-	memset(msg, 0, sizeof(*msg));
-	header = &msg->header;
-	header->rtm_msglen = sizeof(*msg);
-	header->rtm_version = RTM_VERSION;
-	header->rtm_type = cmd;
-	header->rtm_hdrlen = sizeof(*header);
-	header->rtm_tableid = rtable;
-	header->rtm_addrs = RTA_DST | RTA_NETMASK;
-	if (cmd != RTM_DELETE)
-		header->rtm_addrs |= RTA_GATEWAY;
-	header->rtm_flags = RTF_UP | RTF_CLONING /* | RTF_LLINFO | RTF_CONNECTED*/;
-	header->rtm_fmask = 0;
-	header->rtm_pid = getpid();
-	header->rtm_seq = seqno++;
-	if (seqno == INT_MAX)
-		seqno = 0;
-
-	dst = &msg->dst;
-	dst->sin_len = sizeof(*dst);
-	dst->sin_family = AF_INET;
-	dst->sin_addr.s_addr = htonl(route->ipnet);
-
-	// XXX: copy this into a manually aligned byte buffer.
-	// This is surely undefined behavior.
-	netmask = (struct sockaddr_in *)&msg->gw;
-	if (cmd != RTM_DELETE) {
-		netmask = &msg->netmask;
-		gw = &msg->gw;
-		gw->sdl_len = sizeof(*gw);
-		gw->sdl_family = AF_LINK;
-		gw->sdl_index = if_nametoindex(tunnel->ifname);
+	return header->rtm_msglen;
+}
+
+static void
+rterror(Rtop *op, int err)
+{
+	char proute[128], ifname[IF_NAMESIZE];
+	const char *what;
+	Route route;
+
+	rtstats.errors++;
+	memset(&route, 0, sizeof(route));
+	route.ipnet = op->ipnet;
+	route.subnetmask = op->subnetmask;
+	route.gateway = op->gateway;
+	routestr(&route, NULL, proute, sizeof(proute));
+	if (op->cmd != RTM_DELETE && if_indextoname(op->ifindex, ifname) != NULL) {
+		strlcat(proute, " on ", sizeof(proute));
+		strlcat(proute, ifname, sizeof(proute));
 	}
+	what = "route remove";
+	if (op->cmd == RTM_ADD)
+		what = "route add";
+	else if (op->cmd == RTM_CHANGE)
+		what = "route change";
+	error("%s failure (%s): %s", what, proute, strerror(err));
+}
 
-	netmask->sin_len = sizeof(*netmask);
-	netmask->sin_family = AF_INET;
-	netmask->sin_addr.s_addr = htonl(route->subnetmask);
+static void
+retry(Rtop *op, int cmd, int err)
+{
+	Rtop *r;
 
-	if (cmd == RTM_DELETE)
-		header->rtm_msglen -= sizeof(*gw);
+	if (op->tries >= MAX_RTTRIES || nrtretry == MAX_RTOPS) {
+		rterror(op, err);
+		return;
+	}
+	r = &rtretry[nrtretry++];
+	*r = *op;
+	r->cmd = cmd;
+	r->tries++;
+	rtstats.retries++;
+}
 
-	if (route->subnetmask == hostmask)
-		header->rtm_flags |= RTF_HOST; 
+// Settles an operation with the kernel's verdict.
+static void
+settle(Rtop *op, int err)
+{
+	trace(TRACE_KACK, op->seq, err, op->ipnet, op->subnetmask);
+	probe2(kernel_ack, op->seq, err);
+	if (op->pending)
+		rtpending--;
+	op->pending = 0;
+	switch (err) {
+	case 0:
+		rtstats.acks++;
+		return;
+	case ESRCH:
+		if (op->cmd == RTM_DELETE)
+			return;
+		// The route has gone; put it back.
+		if (op->cmd == RTM_CHANGE) {
+			retry(op, RTM_ADD, err);
+			return;
+		}
+		break;
+	case EEXIST:
+		// Somebody else's route, or one from a previous run.
+		if (op->cmd == RTM_ADD) {
+			retry(op, RTM_CHANGE, err);
+			return;
+		}
+		break;
+	case ENOBUFS:
+	case ENOMEM:
+	case EAGAIN:
+		retry(op, op->cmd, err);
+		return;
+	}
+	rterror(op, err);
+}
 
-	return header->rtm_msglen;
+static void
+settlelost(void)
+{
+	for (size_t k = 0; k < MAX_RTOPS; k++)
+		if (rtops[k].pending) {
+			rtstats.lost++;
+			settle(&rtops[k], rtops[k].werr);
+		}
 }
 
-int
-addroute(Route *route, Tunnel *tunnel, int rtable)
+// Reads the kernel's echoes of our messages until none are waiting.
+static void
+rtreplies(void)
 {
-	Routemsg rtmsg;
-	size_t len;
+	alignas(long) octet buf[2048];
+
+	for (;;) {
+		struct rt_msghdr *header = (struct rt_msghdr *)buf;
+		Rtop *op;
+		ssize_t n;
+
+		n = recv(rtfd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == ENOBUFS) {
+				// The socket overflowed; echoes were lost.
+				settlelost();
+				continue;
+			}
+			fatal("route socket read: %m");
+		}
+		if ((size_t)n < sizeof(*header) || header->rtm_version != RTM_VERSION)
+			continue;
+		if (header->rtm_type == RTM_DESYNC) {
+			settlelost();
+			continue;
+		}
+		if (header->rtm_pid != rtpid)
+			continue;
+		op = &rtops[header->rtm_seq%MAX_RTOPS];
+		if (op->seq != header->rtm_seq || !op->pending)
+			continue;
+		settle(op, header->rtm_errno);
+	}
+}
 
-	len = mkrtmsg(RTM_ADD, route, tunnel, rtable, &rtmsg);
-	if (write(rtfd, &rtmsg, len) != len) {
-		char proute[128];
-		routestr(route, tunnel, proute, sizeof(proute));
-		error("route add failure (%s): %m", proute);
+/*
+ * Records a new operation.  If its slot is still waiting on an
+ * earlier echo, read what has arrived; an echo that still has
+ * not come was lost, and write's verdict stands in for it.
+ */
+static Rtop *
+newop(int cmd, Route *route, unsigned int ifindex, int rtable)
+{
+	Rtop *op;
+	int seq;
+
+	seq = rtseq++;
+	if (rtseq == INT_MAX)
+		rtseq = 0;
+	op = &rtops[seq%MAX_RTOPS];
+	if (op->pending)
+		rtreplies();
+	if (op->pending) {
+		rtstats.lost++;
+		settle(op, op->werr);
+	}
+	memset(op, 0, sizeof(*op));
+	op->seq = seq;
+	op->cmd = cmd;
+	op->rtable = rtable;
+	op->ifindex = ifindex;
+	if (route != NULL) {
+		op->ipnet = route->ipnet;
+		op->subnetmask = route->subnetmask;
+		op->gateway = route->gateway;
 	}
 
-	return 0;
+	return op;
 }
 
-int
-chroute(Route *route, Tunnel *tunnel, int rtable)
+static void
+queue(Rtop *op)
 {
-	Routemsg rtmsg;
-	size_t len;
+	if (rtlen + sizeof(Routemsg) > sizeof(rtbuf))
+		kflush();
+	rtlen += stamp(op, rtbuf + rtlen);
+}
+
+static void
+rtwrite(struct rt_msghdr *header)
+{
+	Rtop *op = &rtops[header->rtm_seq%MAX_RTOPS];
+
+	rtstats.messages++;
+	rtstats.writes++;
+	if (!op->pending)
+		rtpending++;
+	op->pending = 1;
+	op->werr = 0;
+	if (write(rtfd, header, header->rtm_msglen) != header->rtm_msglen)
+		op->werr = errno;
+}
 
-	len = mkrtmsg(RTM_CHANGE, route, tunnel, rtable, &rtmsg);
-	if (write(rtfd, &rtmsg, len) != len) {
-		if (errno == ESRCH) {
-			rmroute(route, rtable);
-			return addroute(route, tunnel, rtable);
+/*
+ * Writes the batch, then the operations to retry.  Their
+ * outcomes arrive later, on the route socket.
+ */
+static void
+kflush(void)
+{
+	size_t nretry;
+
+	if (rtlen == 0 && nrtretry == 0)
+		return;
+	rtstats.batches++;
+	for (size_t off = 0, n = 0; off < rtlen; n++) {
+		struct rt_msghdr *header = (struct rt_msghdr *)(rtbuf + off);
+
+		off += header->rtm_msglen;
+		rtwrite(header);
+		if (off == rtlen) {
+			trace(TRACE_KSEND, ((struct rt_msghdr *)rtbuf)->rtm_seq,
+			    header->rtm_seq, n + 1, 0);
+			probe2(kernel_send, header->rtm_seq, n + 1);
 		}
-		char proute[128];
-		routestr(route, tunnel, proute, sizeof(proute));
-		error("route change failure (%s): %m", proute);
 	}
+	rtlen = 0;
+	/*
+	 * Settling replies may schedule further retries, appending
+	 * to rtretry; those wait for the next flush.  So send from
+	 * a copy.
+	 */
+	nretry = nrtretry;
+	memcpy(rtresend, rtretry, nretry*sizeof(rtretry[0]));
+	nrtretry = 0;
+	for (size_t k = 0; k < nretry; k++) {
+		Rtop r = rtresend[k], *op;
+		Routemsg msg;
+
+		op = newop(r.cmd, NULL, r.ifindex, r.rtable);
+		r.seq = op->seq;
+		*op = r;
+		stamp(op, &msg);
+		rtwrite(&msg.header);
+		trace(TRACE_KSEND, op->seq, op->seq, 1, 0);
+	}
+}
+
+// Whether operations are queued, to retry, or waiting for their echoes.
+static int
+kbusy(void)
+{
+	return rtlen != 0 || nrtretry != 0 || rtpending != 0;
+}
+
+static int
+kpollfd(void)
+{
+	return rtfd;
+}
+
+static void
+kinput(void)
+{
+	rtreplies();
+	if (nrtretry != 0)
+		kflush();
+}
+
+static int
+kaddroute(Route *route, Tunnel *tunnel, int rtable)
+{
+	assert(route != NULL);
+	assert(tunnel != NULL);
+	queue(newop(RTM_ADD, route, tunnelindex(tunnel), rtable));
 
 	return 0;
 }
 
-int
-rmroute(Route *route, int rtable)
+static int
+kchroute(Route *route, Tunnel *tunnel, int rtable)
+{
+	assert(route != NULL);
+	assert(tunnel != NULL);
+	queue(newop(RTM_CHANGE, route, tunnelindex(tunnel), rtable));
+
+	return 0;
+}
+
+static int
+krmroute(Route *route, int rtable)
+{
+	assert(route != NULL);
+	queue(newop(RTM_DELETE, route, 0, rtable));
+
+	return 0;
+}
+
+static void
+kstats(FILE *fp)
+{
+	fprintf(fp, "route_batches %" PRIu64 "\n", rtstats.batches);
+	fprintf(fp, "route_messages %" PRIu64 "\n", rtstats.messages);
+	fprintf(fp, "route_writes %" PRIu64 "\n", rtstats.writes);
+	fprintf(fp, "route_acks %" PRIu64 "\n", rtstats.acks);
+	fprintf(fp, "route_retries %" PRIu64 "\n", rtstats.retries);
+	fprintf(fp, "route_errors %" PRIu64 "\n", rtstats.errors);
+	fprintf(fp, "route_lost_replies %" PRIu64 "\n", rtstats.lost);
+}
+
+/*
+ * Reports every gif(4) interface with its tunnel endpoints.
+ * Interfaces whose endpoints are not set are reported with
+ * zero addresses, since their names are taken all the same.
+ */
+static int
+kscantunnels(void (*fn)(Kif *kif, void *arg), void *arg)
+{
+	struct ifaddrs *ifas, *ifa;
+	int n;
+
+	ctlopen();
+	if (getifaddrs(&ifas) < 0)
+		return -1;
+	n = 0;
+	for (ifa = ifas; ifa != NULL; ifa = ifa->ifa_next) {
+		struct if_laddrreq tr;
+		struct sockaddr_in *sin;
+		Kif kif;
+
+		// Each interface has exactly one link-level entry.
+		if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_LINK)
+			continue;
+		if (strncmp(ifa->ifa_name, "gif", 3) != 0)
+			continue;
+		memset(&kif, 0, sizeof(kif));
+		strlcpy(kif.ifname, ifa->ifa_name, sizeof(kif.ifname));
+		kif.ifindex = if_nametoindex(ifa->ifa_name);
+		memset(&tr, 0, sizeof(tr));
+		strlcpy(tr.iflr_name, ifa->ifa_name, sizeof(tr.iflr_name));
+		if (ioctl(ctlfd, SIOCGLIFPHYADDR, &tr) == 0) {
+			sin = (struct sockaddr_in *)&tr.addr;
+			if (sin->sin_family == AF_INET)
+				kif.local = ntohl(sin->sin_addr.s_addr);
+			sin = (struct sockaddr_in *)&tr.dstaddr;
+			if (sin->sin_family == AF_INET)
+				kif.remote = ntohl(sin->sin_addr.s_addr);
+		}
+		fn(&kif, arg);
+		n++;
+	}
+	freeifaddrs(ifas);
+
+	return n;
+}
+
+// Sockaddrs in routing messages are padded to a long.
+static size_t
+salen(const struct sockaddr *sa)
 {
-	Routemsg rtmsg;
+	if (sa->sa_len == 0)
+		return sizeof(long);
+	return 1 + ((sa->sa_len - 1) | (sizeof(long) - 1));
+}
+
+// Masks may be cut short after their last non-zero byte.
+static uint32_t
+sainaddr(const struct sockaddr *sa)
+{
+	struct sockaddr_in sin;
 	size_t len;
 
-	len = mkrtmsg(RTM_DELETE, route, NULL, rtable, &rtmsg);
-	if (write(rtfd, &rtmsg, len) != len)
-		if (errno != ESRCH) {
-			char proute[128];
-			routestr(route, NULL, proute, sizeof(proute));
-			error("route remove failure (%s): %m", proute);
+	memset(&sin, 0, sizeof(sin));
+	len = sa->sa_len;
+	if (len > sizeof(sin))
+		len = sizeof(sin);
+	memmove(&sin, sa, len);
+
+	return ntohl(sin.sin_addr.s_addr);
+}
+
+/*
+ * Reports the interface routes in `rtable`.  The whole table
+ * comes back from one sysctl; it may grow between sizing the
+ * buffer and filling it, so we allow some slack and retry.
+ */
+static int
+kscanroutes(int rtable, void (*fn)(Kroute *kr, void *arg), void *arg)
+{
+	int mib[] = { CTL_NET, PF_ROUTE, 0, AF_INET, NET_RT_DUMP, 0, rtable };
+	const unsigned int nmib = sizeof(mib)/sizeof(mib[0]);
+	octet *buf, *p, *end;
+	size_t len;
+	int n;
+
+	for (;;) {
+		if (sysctl(mib, nmib, NULL, &len, NULL, 0) < 0)
+			return -1;
+		len += len/8 + 1;
+		buf = malloc(len);
+		if (buf == NULL)
+			fatal("malloc");
+		if (sysctl(mib, nmib, buf, &len, NULL, 0) == 0)
+			break;
+		free(buf);
+		if (errno != ENOMEM)
+			return -1;
+	}
+	n = 0;
+	end = buf + len;
+	for (p = buf; p + sizeof(struct rt_msghdr) <= end; ) {
+		struct rt_msghdr *rtm = (struct rt_msghdr *)p;
+		struct sockaddr *sa;
+		Kroute kr;
+
+		if (rtm->rtm_msglen == 0)
+			break;
+		p += rtm->rtm_msglen;
+		if (rtm->rtm_version != RTM_VERSION ||
+		    (rtm->rtm_flags & (RTF_UP | RTF_GATEWAY)) != RTF_UP ||
+		    (rtm->rtm_addrs & RTA_DST) == 0)
+			continue;
+		// Only routes we add: not the kernel's own for an address.
+		if (rtm->rtm_flags & (RTF_LOCAL | RTF_BROADCAST |
+		    RTF_CONNECTED | RTF_CLONED))
+			continue;
+		memset(&kr, 0, sizeof(kr));
+		kr.ifindex = rtm->rtm_index;
+		kr.subnetmask = 0xFFFFFFFF;	// Host routes carry no mask.
+		sa = (struct sockaddr *)((octet *)rtm + rtm->rtm_hdrlen);
+		for (int k = 0; k < RTAX_MAX && (octet *)sa < p; k++) {
+			if ((rtm->rtm_addrs & (1 << k)) == 0)
+				continue;
+			if (k == RTAX_DST)
+				kr.ipnet = sainaddr(sa);
+			else if (k == RTAX_NETMASK)
+				kr.subnetmask = sainaddr(sa);
+			sa = (struct sockaddr *)((octet *)sa + salen(sa));
 		}
+		fn(&kr, arg);
+		n++;
+	}
+	free(buf);
 
-	return 0;
+	return n;
 }
 
+Backend kernbackend = {
+	.name = "kernel",
+	.initsys = kinitsys,
+	.uptunnel = kuptunnel,
+	.downtunnel = kdowntunnel,
+	.retunnel = kretunnel,
+	.addroute = kaddroute,
+	.chroute = kchroute,
+	.rmroute = krmroute,
+	.flush = kflush,
+	.pollfd = kpollfd,
+	.input = kinput,
+	.busy = kbusy,
+	.stats = kstats,
+	.scantunnels = kscantunnels,
+	.scanroutes = kscanroutes,
+};
+
 void
 ipaddrstr(uint32_t addr, char buf[static INET_ADDRSTRLEN])
 {
@@ -341,9 +990,9 @@ routestr(Route *route, Tunnel *tunnel, char *buf, size_t size)
 	size_t cidr;
 
 	assert(route != NULL);
-	cidr = netmask2cidr(ntohl(route->subnetmask));
-	ipaddrstr(ntohl(route->ipnet), proute);
-	ipaddrstr(ntohl(route->gateway), gw);
+	cidr = netmask2cidr(route->subnetmask);
+	ipaddrstr(route->ipnet, proute);
+	ipaddrstr(route->gateway, gw);
 
 	assert(buf != NULL);
 	snprintf(buf, size, "%s/%zu -> %s", proute, cidr, gw);
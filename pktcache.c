@@ -0,0 +1,103 @@
+/*
+ * The datagram cache; see Pktcache in dat.h.  Slots are
+ * direct-mapped by hash: a datagram simply replaces whatever
+ * was in its slot.
+ */
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+
+static void *grow(void *p, size_t *max, size_t want, size_t size);
+
+// FNV-1a, a word at a time where it can.
+uint64_t
+pkthash(const octet *data, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t k = 0;
+
+	for (; k + sizeof(uint32_t) <= len; k += sizeof(uint32_t)) {
+		uint32_t w;
+
+		memcpy(&w, data + k, sizeof(w));
+		h = (h ^ w)*0x100000001b3ULL;
+	}
+	for (; k < len; k++)
+		h = (h ^ data[k])*0x100000001b3ULL;
+
+	return h;
+}
+
+/*
+ * Returns the cached entry for the datagram, if it is there
+ * and the route table is still at generation `gen`.
+ */
+Pktent *
+pktlookup(Pktcache *c, uint64_t hash, const octet *data, size_t len,
+    uint64_t gen)
+{
+	Pktent *e = &c->slots[hash%PKTCACHE_SLOTS];
+
+	if (e->data == NULL || e->hash != hash || e->len != len ||
+	    memcmp(e->data, data, len) != 0) {
+		c->misses++;
+		return NULL;
+	}
+	if (e->gen != gen) {
+		c->stale++;
+		return NULL;
+	}
+	c->hits++;
+
+	return e;
+}
+
+// Remembers a datagram, and the routes it refreshed.
+void
+pktfill(Pktcache *c, uint64_t hash, const octet *data, size_t len,
+    uint64_t gen, Route **routes, size_t nroutes)
+{
+	Pktent *e = &c->slots[hash%PKTCACHE_SLOTS];
+
+	e->data = grow(e->data, &e->maxlen, len, 1);
+	e->routes = grow(e->routes, &e->maxroutes, nroutes, sizeof(Route *));
+	memmove(e->data, data, len);
+	memmove(e->routes, routes, nroutes*sizeof(Route *));
+	e->hash = hash;
+	e->len = len;
+	e->gen = gen;
+	e->nroutes = nroutes;
+}
+
+// Forgets the datagram, if we have it.
+void
+pktforget(Pktcache *c, uint64_t hash)
+{
+	Pktent *e = &c->slots[hash%PKTCACHE_SLOTS];
+
+	if (e->hash != hash)
+		return;
+	free(e->data);
+	e->data = NULL;
+	e->hash = 0;
+	e->len = e->maxlen = 0;
+	e->nroutes = 0;
+}
+
+static void *
+grow(void *p, size_t *max, size_t want, size_t size)
+{
+	if (want <= *max)
+		return p;
+	p = reallocarray(p, want, size);
+	if (p == NULL)
+		fatal("malloc");
+	*max = want;
+
+	return p;
+}
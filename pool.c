@@ -0,0 +1,195 @@
+/*
+ * A pool of idle tunnel interfaces.  See Tunpool in dat.h.
+ */
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dat.h"
+#include "fns.h"
+
+static void destroyparked(Tunpool *pool, Tunnel *tunnel);
+static void teardown(uint32_t key, size_t keylen, void *tunnelp, void *poolp);
+
+void
+initpool(Tunpool *pool, int max, Bitvec *interfaces)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->max = max;
+	pool->min = max/4;
+	pool->interfaces = interfaces;
+	pool->doomed = mkipmap();
+}
+
+/*
+ * Parks a tunnel that no longer has any routes.  If the pool
+ * is full, the interface parked longest is destroyed to make
+ * room.
+ */
+void
+park(Tunpool *pool, Tunnel *tunnel, time_t now)
+{
+	if (pool->max == 0) {
+		destroyparked(pool, tunnel);
+		return;
+	}
+	if (pool->nparked == pool->max) {
+		Tunnel **tp = &pool->parked;
+
+		while ((*tp)->pnext != NULL)
+			tp = &(*tp)->pnext;
+		destroyparked(pool, *tp);
+		*tp = NULL;
+		pool->nparked--;
+	}
+	info("Parking tunnel interface %s", tunnel->ifname);
+	tunnel->parked = now;
+	tunnel->pnext = pool->parked;
+	pool->parked = tunnel;
+	pool->nparked++;
+	pool->parks++;
+}
+
+/*
+ * Returns a parked interface set up for a tunnel to `remote`,
+ * or nil if the caller must create one.  We prefer the peer's
+ * own interface, even one doomed this cycle; failing that, we
+ * re-point the one parked longest, since recently parked peers
+ * are the likeliest to come back.
+ */
+Tunnel *
+unpark(Tunpool *pool, uint32_t remote)
+{
+	Tunnel **tp, **oldest, *tunnel;
+	uint32_t was;
+
+	tunnel = ipmapfind(pool->doomed, remote, 32);
+	if (tunnel != NULL) {
+		ipmapremove(pool->doomed, remote, 32);
+		pool->ndoomed--;
+		pool->revivals++;
+		info("Reviving tunnel interface %s", tunnel->ifname);
+		return tunnel;
+	}
+	oldest = NULL;
+	for (tp = &pool->parked; *tp != NULL; tp = &(*tp)->pnext) {
+		if ((*tp)->remote == remote)
+			break;
+		oldest = tp;
+	}
+	if (*tp != NULL) {
+		tunnel = *tp;
+		*tp = tunnel->pnext;
+		tunnel->pnext = NULL;
+		pool->nparked--;
+		pool->reuses++;
+		info("Reusing parked tunnel interface %s", tunnel->ifname);
+		return tunnel;
+	}
+	if (oldest == NULL) {
+		pool->misses++;
+		return NULL;
+	}
+	tunnel = *oldest;
+	tunnelsync(tunnel);
+	was = tunnel->remote;
+	tunnel->remote = remote;
+	if (retunnel(tunnel) < 0) {
+		pool->misses++;
+		if (errno == EOPNOTSUPP) {
+			tunnel->remote = was;
+			return NULL;
+		}
+		*oldest = NULL;
+		pool->nparked--;
+		// Not worth reviving.
+		teardown(0, 0, tunnel, pool);
+		return NULL;
+	}
+	*oldest = NULL;
+	pool->nparked--;
+	pool->repoints++;
+	info("Re-pointing parked tunnel interface %s at %I",
+	    tunnel->ifname, remote);
+
+	return tunnel;
+}
+
+/*
+ * Destroys interfaces that have been parked for POOL_IDLE,
+ * keeping the `min` most recently parked.
+ */
+void
+prunepool(Tunpool *pool, time_t now)
+{
+	Tunnel **tp, *tunnel;
+	int kept;
+
+	kept = 0;
+	tp = &pool->parked;
+	while (*tp != NULL) {
+		tunnel = *tp;
+		if (kept < pool->min || now - tunnel->parked < POOL_IDLE) {
+			tp = &tunnel->pnext;
+			kept++;
+			continue;
+		}
+		*tp = tunnel->pnext;
+		pool->nparked--;
+		destroyparked(pool, tunnel);
+	}
+}
+
+void
+drainpool(Tunpool *pool)
+{
+	while (pool->parked != NULL) {
+		Tunnel *tunnel = pool->parked;
+
+		pool->parked = tunnel->pnext;
+		pool->nparked--;
+		destroyparked(pool, tunnel);
+	}
+	poolflush(pool);
+}
+
+// Ends an update cycle, destroying the interfaces doomed in it.
+void
+poolflush(Tunpool *pool)
+{
+	if (pool->ndoomed == 0)
+		return;
+	ipmapdo(pool->doomed, teardown, pool);
+	freeipmap(pool->doomed, NULL);
+	pool->doomed = mkipmap();
+	pool->ndoomed = 0;
+}
+
+static void
+destroyparked(Tunpool *pool, Tunnel *tunnel)
+{
+	if (ipmapfind(pool->doomed, tunnel->remote, 32) != NULL) {
+		teardown(0, 0, tunnel, pool);
+		return;
+	}
+	ipmapinsert(pool->doomed, tunnel->remote, 32, tunnel);
+	pool->ndoomed++;
+}
+
+static void
+teardown(uint32_t key, size_t keylen, void *tunnelp, void *poolp)
+{
+	Tunnel *tunnel = tunnelp;
+	Tunpool *pool = poolp;
+
+	(void)key;
+	(void)keylen;
+	info("Tearing down tunnel interface %s", tunnel->ifname);
+	pool->destroys++;
+	tunneldestroy(tunnel, pool->interfaces);
+}
@@ -0,0 +1,166 @@
+/*
+ * Latency profiling.  Each stage accumulates a histogram of
+ * its durations in power-of-two buckets of nanoseconds.  The
+ * clock is the raw monotonic one where there is one, so that
+ * NTP's slewing does not skew short intervals.  Counters are
+ * atomic, since workers bring tunnels up on their own threads.
+ * The daemon logs the histograms on SIGUSR1, and logs and then
+ * clears them on SIGUSR2.
+ */
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "dat.h"
+#include "fns.h"
+
+#ifdef CLOCK_MONOTONIC_RAW
+#define PROF_CLOCK	CLOCK_MONOTONIC_RAW
+#else
+#define PROF_CLOCK	CLOCK_MONOTONIC
+#endif
+
+enum {
+	HIST_BUCKETS = 40,	// Up to 2^40 ns, some 18 minutes.
+};
+
+typedef struct Hist Hist;
+struct Hist {
+	atomic_uint_fast64_t n;
+	atomic_uint_fast64_t sum;
+	atomic_uint_fast64_t max;
+	atomic_uint_fast64_t buckets[HIST_BUCKETS];	// [k]: < 2^k ns.
+};
+
+int profiling;
+
+static Hist hists[NSTAGE];
+static const char *stagenames[NSTAGE] = {
+	[STAGE_PACKET] = "packet",
+	[STAGE_RECV] = "recv",
+	[STAGE_PARSE] = "parse",
+	[STAGE_AUTH] = "auth",
+	[STAGE_ENTRY] = "entry",
+	[STAGE_TUNNEL] = "tunnel",
+	[STAGE_INSTALL] = "install",
+	[STAGE_EXPIRE] = "expire",
+};
+
+static uint64_t quantile(Hist *h, uint64_t n, int percent);
+
+uint64_t
+profclock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(PROF_CLOCK, &ts);
+
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void
+profadd(int stage, uint64_t ns)
+{
+	Hist *h = &hists[stage];
+	uint_fast64_t max;
+	int k;
+
+	k = (ns == 0) ? 0 : 64 - __builtin_clzll(ns);
+	if (k >= HIST_BUCKETS)
+		k = HIST_BUCKETS - 1;
+	atomic_fetch_add_explicit(&h->buckets[k], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->n, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (ns > max && !atomic_compare_exchange_weak(&h->max, &max, ns))
+		;
+}
+
+/*
+ * Logs a line of summary for each stage that has run, and one
+ * of its non-empty buckets, as "bound:count" with bounds in
+ * nanoseconds.  With `reset` set, starts over afterwards.
+ */
+void
+profdump(int reset)
+{
+	if (!profiling) {
+		notice("not profiling; start with -p");
+		return;
+	}
+	for (int stage = 0; stage < NSTAGE; stage++) {
+		Hist *h = &hists[stage];
+		char buckets[MAX_LOG_MSG];
+		size_t len = 0;
+		uint64_t n;
+
+		n = atomic_load(&h->n);
+		if (n == 0)
+			continue;
+		notice("profile %s: n %" PRIu64 " mean %" PRIu64 " ns "
+		    "p50 < %" PRIu64 " p90 < %" PRIu64 " p99 < %" PRIu64 " "
+		    "max %" PRIu64 " ns", stagenames[stage], n,
+		    (uint64_t)atomic_load(&h->sum)/n, quantile(h, n, 50),
+		    quantile(h, n, 90), quantile(h, n, 99),
+		    (uint64_t)atomic_load(&h->max));
+		buckets[0] = '\0';
+		for (int k = 0; k < HIST_BUCKETS && len < sizeof(buckets); k++) {
+			uint64_t count = atomic_load(&h->buckets[k]);
+
+			if (count != 0)
+				len += snprintf(buckets + len,
+				    sizeof(buckets) - len, " %" PRIu64 ":%" PRIu64,
+				    (uint64_t)1 << k, count);
+		}
+		notice("profile %s buckets:%s", stagenames[stage], buckets);
+	}
+	if (reset) {
+		for (int stage = 0; stage < NSTAGE; stage++) {
+			Hist *h = &hists[stage];
+
+			atomic_store(&h->n, 0);
+			atomic_store(&h->sum, 0);
+			atomic_store(&h->max, 0);
+			for (int k = 0; k < HIST_BUCKETS; k++)
+				atomic_store(&h->buckets[k], 0);
+		}
+		notice("profile reset");
+	}
+}
+
+void
+statsprof(FILE *fp)
+{
+	if (!profiling)
+		return;
+	for (int stage = 0; stage < NSTAGE; stage++) {
+		Hist *h = &hists[stage];
+		const char *name = stagenames[stage];
+
+		fprintf(fp, "prof_%s_count %" PRIu64 "\n", name,
+		    (uint64_t)atomic_load(&h->n));
+		fprintf(fp, "prof_%s_ns_total %" PRIu64 "\n", name,
+		    (uint64_t)atomic_load(&h->sum));
+		fprintf(fp, "prof_%s_ns_max %" PRIu64 "\n", name,
+		    (uint64_t)atomic_load(&h->max));
+	}
+}
+
+// Returns the upper bound of the bucket holding the given percentile.
+static uint64_t
+quantile(Hist *h, uint64_t n, int percent)
+{
+	uint64_t want, seen = 0;
+
+	want = (n*percent + 99)/100;
+	for (int k = 0; k < HIST_BUCKETS; k++) {
+		seen += atomic_load(&h->buckets[k]);
+		if (seen >= want)
+			return (uint64_t)1 << k;
+	}
+
+	return (uint64_t)1 << (HIST_BUCKETS - 1);
+}
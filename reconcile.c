@@ -0,0 +1,293 @@
+/*
+ * Anti-entropy between our routing table and the kernel's.
+ *
+ * We assume that our kernel operations succeed, but they can
+ * fail, be lost when the routing socket overflows, or be undone
+ * by someone else.  Rather than restart the daemon now and then
+ * to get back in sync, we periodically take a snapshot of the
+ * kernel's table and walk it, and then ours, a chunk at a time
+ * from the event loop, issuing just the operations that bring
+ * the kernel back in line:
+ *
+ *	- a route of ours the kernel lacks is added;
+ *	- a route of ours on the wrong interface is changed;
+ *	- a route on one of our tunnels that we do not have
+ *	  is removed.
+ *
+ * Repairs go to the scheduler as refreshes, behind everything
+ * the feeds ask for.  Routes on interfaces that are not ours
+ * are left alone.
+ * Routes refreshed since the snapshot are skipped: the
+ * snapshot is stale for them, and the next run checks them.
+ * So are routes whose tunnel is still being brought up.
+ */
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dat.h"
+#include "fns.h"
+
+enum {
+	CIDR_HOST = 32,
+	TIMECHECK = 32,		// Entries between clock reads.
+};
+
+static void snapkernel(Kroute *kr, void *rcp);
+static void snaptunnel(uint32_t key, size_t keylen, void *tunnelp, void *rcp);
+static void snapours(uint32_t key, size_t keylen, void *routep, void *rcp);
+static int checkkernel(Reconciler *rc, Kroute *kr);
+static int checkours(Reconciler *rc, Kroute *kr);
+static void endreconcile(Reconciler *rc);
+
+void
+initreconcile(Reconciler *rc, IPMap *routes, IPMap *tunnels, int rtable,
+    int interval)
+{
+	memset(rc, 0, sizeof(*rc));
+	rc->routes = routes;
+	rc->tunnels = tunnels;
+	rc->rtable = rtable;
+	rc->interval = interval;
+	rc->nextrun = nsec() + (uint64_t)interval*1000000000;
+}
+
+static Kroute *
+append(Kroute *v, size_t *n, size_t *max, Kroute *kr)
+{
+	if (*n == *max) {
+		size_t nmax = (*max == 0) ? 1024 : *max*2;
+
+		v = recallocarray(v, *max, nmax, sizeof(*v));
+		if (v == NULL)
+			fatal("malloc");
+		*max = nmax;
+	}
+	v[(*n)++] = *kr;
+
+	return v;
+}
+
+/*
+ * Begins a run by taking a snapshot of the kernel's table
+ * and of ours.  If the backend cannot report its table, the
+ * reconciler is disabled.
+ */
+void
+reconcilestart(Reconciler *rc)
+{
+	if (rc->phase != 0)
+		endreconcile(rc);
+	rc->nextrun = nsec() + (uint64_t)rc->interval*1000000000;
+	rc->snaptime = time(NULL);
+	rc->nkroutes = 0;
+	rc->nours = 0;
+	if (scanroutes(rc->rtable, snapkernel, rc) < 0) {
+		if (errno == EOPNOTSUPP)
+			rc->interval = 0;
+		else
+			error("cannot scan routing table %d: %m", rc->rtable);
+		return;
+	}
+	rc->kfib = mkipmap();
+	for (size_t k = 0; k < rc->nkroutes; k++) {
+		Kroute *kr = &rc->kroutes[k];
+
+		if (isvalidnetmask(kr->subnetmask))
+			ipmapinsert(rc->kfib, kr->ipnet,
+			    netmask2cidr(kr->subnetmask), kr);
+	}
+	rc->ifindices = mkipmap();
+	ipmapdo(rc->tunnels, snaptunnel, rc);
+	ipmapdo(rc->routes, snapours, rc);
+	rc->phase = 1;
+	rc->cursor = 0;
+	rc->nextstep = 0;
+	rc->runs++;
+	debug("Reconciling %zu kernel routes with %zu of ours",
+	    rc->nkroutes, rc->nours);
+}
+
+static void
+snapkernel(Kroute *kr, void *rcp)
+{
+	Reconciler *rc = rcp;
+
+	rc->kroutes = append(rc->kroutes, &rc->nkroutes, &rc->maxkroutes, kr);
+}
+
+static void
+snaptunnel(uint32_t key, size_t keylen, void *tunnelp, void *rcp)
+{
+	Tunnel *tunnel = tunnelp;
+	Reconciler *rc = rcp;
+
+	(void)key;
+	(void)keylen;
+	if (tunnel->ifindex != 0)
+		ipmapinsert(rc->ifindices, tunnel->ifindex, CIDR_HOST, tunnel);
+}
+
+// We keep prefixes, not pointers: routes may expire mid-run.
+static void
+snapours(uint32_t key, size_t keylen, void *routep, void *rcp)
+{
+	Route *route = routep;
+	Reconciler *rc = rcp;
+	Kroute kr;
+
+	(void)key;
+	(void)keylen;
+	if (route->tunnel == NULL)
+		return;
+	memset(&kr, 0, sizeof(kr));
+	kr.ipnet = route->ipnet;
+	kr.subnetmask = route->subnetmask;
+	rc->ours = append(rc->ours, &rc->nours, &rc->maxours, &kr);
+}
+
+// Returns milliseconds until the reconciler has work, or -1.
+int
+reconcilewait(Reconciler *rc)
+{
+	uint64_t now, when;
+
+	if (rc->phase == 0 && rc->interval == 0)
+		return -1;
+	when = (rc->phase != 0) ? rc->nextstep : rc->nextrun;
+	now = nsec();
+	if (when <= now)
+		return 0;
+	if ((when - now)/1000000 >= INT_MAX)
+		return INT_MAX;
+
+	return (when - now + 999999)/1000000;
+}
+
+/*
+ * Does one bounded step of a run, starting a new run if one
+ * is due.  Each step examines at most RECONCILE_CHUNK entries
+ * and issues at most RECONCILE_OPS kernel operations.
+ */
+void
+reconcilestep(Reconciler *rc)
+{
+	uint64_t start;
+	int nops, n;
+
+	start = nsec();
+	if (rc->phase == 0) {
+		if (rc->interval == 0 || start < rc->nextrun)
+			return;
+		reconcilestart(rc);
+		if (rc->phase == 0)
+			return;
+	}
+	if (start < rc->nextstep)
+		return;
+	rc->steps++;
+	nops = 0;
+	for (n = 0; n < RECONCILE_CHUNK; n++) {
+		if (nops >= RECONCILE_OPS || (n % TIMECHECK == TIMECHECK - 1 &&
+		    nsec() - start >= RECONCILE_STEP_NS))
+		{
+			rc->deferred++;
+			break;
+		}
+		if (rc->phase == 1 && rc->cursor == rc->nkroutes) {
+			rc->phase = 2;
+			rc->cursor = 0;
+		}
+		if (rc->phase == 2 && rc->cursor == rc->nours) {
+			endreconcile(rc);
+			break;
+		}
+		if (rc->phase == 1)
+			nops += checkkernel(rc, &rc->kroutes[rc->cursor++]);
+		else
+			nops += checkours(rc, &rc->ours[rc->cursor++]);
+		rc->checked++;
+	}
+	if (nops != 0)
+		sysflush();
+	rc->nextstep = nsec() + RECONCILE_PAUSE_MS*1000000;
+}
+
+// Returns the number of kernel operations issued.
+static int
+checkkernel(Reconciler *rc, Kroute *kr)
+{
+	Route *route, stale;
+	size_t cidr;
+
+	if (!isvalidnetmask(kr->subnetmask))
+		return 0;
+	cidr = netmask2cidr(kr->subnetmask);
+	route = ipmapfind(rc->routes, kr->ipnet, cidr);
+	if (route != NULL && route->refreshed >= rc->snaptime)
+		return 0;
+	if (route != NULL && route->tunnel != NULL) {
+		Tunnel *tunnel = route->tunnel;
+
+		if (tunnel->ifindex == 0 || tunnel->pending != 0)
+			return 0;
+		if (tunnel->ifindex == kr->ifindex &&
+		    kr->gateway == (tunnel->multipoint ? tunnel->remote : 0))
+			return 0;
+		notice("Reconcile: moving route %I/%zu to %s",
+		    kr->ipnet, cidr, tunnel->ifname);
+		refreshroute(route, tunnel, rc->rtable);
+		rc->moved++;
+		return 1;
+	}
+	if (ipmapfind(rc->ifindices, kr->ifindex, CIDR_HOST) == NULL)
+		return 0;
+	notice("Reconcile: removing stale route %I/%zu", kr->ipnet, cidr);
+	memset(&stale, 0, sizeof(stale));
+	stale.ipnet = kr->ipnet;
+	stale.subnetmask = kr->subnetmask;
+	rmroute(&stale, rc->rtable);
+	rc->stale++;
+
+	return 1;
+}
+
+static int
+checkours(Reconciler *rc, Kroute *kr)
+{
+	Route *route;
+	size_t cidr;
+
+	cidr = netmask2cidr(kr->subnetmask);
+	if (ipmapfind(rc->kfib, kr->ipnet, cidr) != NULL)
+		return 0;
+	route = ipmapfind(rc->routes, kr->ipnet, cidr);
+	if (route == NULL || route->tunnel == NULL ||
+	    route->tunnel->pending != 0 || route->refreshed >= rc->snaptime)
+		return 0;
+	notice("Reconcile: adding missing route %I/%zu on %s",
+	    kr->ipnet, cidr, route->tunnel->ifname);
+	refreshroute(route, route->tunnel, rc->rtable);
+	route->installed = 1;
+	rc->missing++;
+
+	return 1;
+}
+
+static void
+endreconcile(Reconciler *rc)
+{
+	freeipmap(rc->kfib, NULL);
+	rc->kfib = NULL;
+	freeipmap(rc->ifindices, NULL);
+	rc->ifindices = NULL;
+	rc->phase = 0;
+	rc->cursor = 0;
+	debug("Reconciled routing table %d", rc->rtable);
+}
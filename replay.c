@@ -0,0 +1,326 @@
+/*
+ * Readers for captured RIP traffic, used to replay a feed
+ * through the daemon offline.  Two formats are understood:
+ * pcap files, as written by tcpdump -w, and the one-line
+ * text that tcpdump -v prints for RIPv2 responses (see
+ * testdata/data.tcpdump).  Each datagram is handed to a
+ * callback as a raw RIP payload with its capture timestamp.
+ */
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+
+static const uint32_t PCAP_MAGIC = 0xA1B2C3D4;
+static const uint32_t PCAP_MAGIC_NS = 0xA1B23C4D;
+
+enum {
+	PCAP_HEADER_SIZE = 24,
+	PCAP_RECORD_SIZE = 16,
+
+	LINKTYPE_NULL = 0,
+	LINKTYPE_ETHERNET = 1,
+	LINKTYPE_RAW_BSD = 12,
+	LINKTYPE_RAW_BSDOS = 14,
+	LINKTYPE_RAW = 101,
+	LINKTYPE_LOOP = 108,
+	LINKTYPE_LINUX_SLL = 113,
+
+	ETHERTYPE_IP = 0x0800,
+	ETHERTYPE_VLAN = 0x8100,
+	RIP_PORT = 520,
+};
+
+static uint32_t
+readle32(const octet data[static 4])
+{
+	return data[3] << 24 | data[2] << 16 | data[1] << 8 | data[0];
+}
+
+static uint32_t
+read32(const octet data[static 4], int swap)
+{
+	return swap ? readle32(data) : readnet32(data);
+}
+
+/*
+ * Find the RIP payload in a captured frame.  Returns the
+ * payload length, or -1 if the frame is not an unfragmented
+ * IPv4 UDP datagram to the RIP port.
+ */
+static ssize_t
+rippayload(uint32_t linktype, const octet *frame, size_t len,
+    const octet **payload)
+{
+	size_t off, ihl, iplen;
+	uint16_t ethertype;
+
+	switch (linktype) {
+	case LINKTYPE_NULL:
+	case LINKTYPE_LOOP:
+		off = 4;
+		break;
+	case LINKTYPE_ETHERNET:
+		if (len < 14)
+			return -1;
+		off = 14;
+		ethertype = readnet16(frame + 12);
+		while (ethertype == ETHERTYPE_VLAN && len >= off + 4) {
+			ethertype = readnet16(frame + off + 2);
+			off += 4;
+		}
+		if (ethertype != ETHERTYPE_IP)
+			return -1;
+		break;
+	case LINKTYPE_LINUX_SLL:
+		if (len < 16 || readnet16(frame + 14) != ETHERTYPE_IP)
+			return -1;
+		off = 16;
+		break;
+	case LINKTYPE_RAW:
+	case LINKTYPE_RAW_BSD:
+	case LINKTYPE_RAW_BSDOS:
+		off = 0;
+		break;
+	default:
+		return -1;
+	}
+	if (len < off + 20 || (frame[off] >> 4) != 4)
+		return -1;
+	ihl = (frame[off] & 0x0F)*4;
+	iplen = readnet16(frame + off + 2);
+	if (ihl < 20 || iplen < ihl + UDP_HEADER_SIZE || len < off + iplen)
+		return -1;
+	if ((readnet16(frame + off + 6) & 0x3FFF) != 0)	// MF or offset.
+		return -1;
+	if (frame[off + 9] != IPPROTO_UDP)
+		return -1;
+	off += ihl;
+	if (readnet16(frame + off + 2) != RIP_PORT)
+		return -1;
+	*payload = frame + off + UDP_HEADER_SIZE;
+
+	return iplen - ihl - UDP_HEADER_SIZE;
+}
+
+static int
+readpcap(FILE *fp, void (*fn)(const octet *, size_t, uint64_t, void *),
+    void *arg)
+{
+	octet hdr[PCAP_HEADER_SIZE], rec[PCAP_RECORD_SIZE];
+	octet *frame;
+	uint32_t magic, linktype, snaplen;
+	int swap, nsres, npkts;
+
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1)
+		return -1;
+	magic = readnet32(hdr);
+	swap = (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS);
+	if (swap)
+		magic = readle32(hdr);
+	if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS)
+		return -1;
+	nsres = (magic == PCAP_MAGIC_NS);
+	snaplen = read32(hdr + 16, swap);
+	linktype = read32(hdr + 20, swap) & 0xFFFF;
+	if (snaplen == 0 || snaplen > (1 << 18))
+		snaplen = 1 << 18;
+	frame = malloc(snaplen);
+	if (frame == NULL)
+		fatal("malloc");
+	npkts = 0;
+	while (fread(rec, sizeof(rec), 1, fp) == 1) {
+		uint64_t ts;
+		uint32_t caplen;
+		const octet *payload;
+		ssize_t n;
+
+		ts = (uint64_t)read32(rec + 0, swap)*1000000000;
+		ts += (uint64_t)read32(rec + 4, swap)*(nsres ? 1 : 1000);
+		caplen = read32(rec + 8, swap);
+		if (caplen > snaplen) {
+			free(frame);
+			return -1;
+		}
+		if (fread(frame, 1, caplen, fp) != caplen)
+			break;
+		n = rippayload(linktype, frame, caplen, &payload);
+		if (n < 0)
+			continue;
+		fn(payload, n, ts, arg);
+		npkts++;
+	}
+	free(frame);
+
+	return npkts;
+}
+
+static int
+parseaddr(const char *s, uint32_t *addr)
+{
+	struct in_addr in;
+
+	if (inet_pton(AF_INET, s, &in) != 1)
+		return -1;
+	*addr = ntohl(in.s_addr);
+
+	return 0;
+}
+
+static void
+writenet32(octet *data, uint32_t w)
+{
+	data[0] = w >> 24;
+	data[1] = w >> 16;
+	data[2] = w >> 8;
+	data[3] = w;
+}
+
+/*
+ * Rebuild the datagram for one line of tcpdump output:
+ *
+ *	19:35:30.274592 ... RIPv2-resp [items 25]: [password pw]
+ *	    {44.224.0.0/255.254.0.0->141.75.245.225 tag 0004}(1) ...
+ *
+ * Returns the datagram length, or -1 if the line does not
+ * describe a RIPv2 response.
+ */
+static ssize_t
+parseline(char *line, octet *pkt, size_t size, uint64_t *ts)
+{
+	unsigned int hh, mm, ss;
+	char frac[16], pw[RIP_PASSWORD_SIZE + 1];
+	char *p;
+	size_t len;
+
+	*ts = 0;
+	if (sscanf(line, "%u:%u:%u.%15[0-9]", &hh, &mm, &ss, frac) == 4) {
+		uint64_t ns = strtoull(frac, NULL, 10);
+		for (size_t k = strlen(frac); k < 9; k++)
+			ns *= 10;
+		*ts = ((uint64_t)hh*3600 + mm*60 + ss)*1000000000 + ns;
+	}
+	p = strstr(line, "RIPv2-resp");
+	if (p == NULL)
+		return -1;
+	memset(pkt, 0, MIN_RIP_PACKET_SIZE);
+	pkt[0] = RIP_COMMAND_RESPONSE;
+	pkt[1] = RIP_VERSION_2;
+	len = MIN_RIP_PACKET_SIZE;
+	if ((p = strstr(line, "[password ")) != NULL &&
+	    sscanf(p, "[password %16[^]]]", pw) == 1)
+	{
+		memset(pkt + len, 0, RIP_RESPONSE_SIZE);
+		pkt[len + 0] = 0xFF;
+		pkt[len + 1] = 0xFF;
+		pkt[len + 3] = RIP_AUTH_PASSWORD;
+		memmove(pkt + len + 4, pw, strlen(pw));
+		len += RIP_RESPONSE_SIZE;
+	}
+	for (p = strchr(line, '{'); p != NULL; p = strchr(p, '{')) {
+		char net[INET_ADDRSTRLEN], mask[INET_ADDRSTRLEN];
+		char gw[INET_ADDRSTRLEN];
+		unsigned int tag, metric;
+		uint32_t addr;
+		octet *e;
+		char *close;
+
+		if (len + RIP_RESPONSE_SIZE > size)
+			break;
+		e = pkt + len;
+		close = strchr(p, '}');
+		if (close == NULL)
+			break;
+		if (sscanf(p, "{%15[0-9.]/%15[0-9.]->%15[0-9.] tag %x}",
+		    net, mask, gw, &tag) != 4)
+		{
+			p = close;
+			continue;
+		}
+		metric = 1;
+		sscanf(close, "}(%u)", &metric);
+		memset(e, 0, RIP_RESPONSE_SIZE);
+		e[1] = AF_INET;
+		e[2] = tag >> 8;
+		e[3] = tag;
+		if (parseaddr(net, &addr) < 0)
+			return -1;
+		writenet32(e + 4, addr);
+		if (parseaddr(mask, &addr) < 0)
+			return -1;
+		writenet32(e + 8, addr);
+		if (parseaddr(gw, &addr) < 0)
+			return -1;
+		writenet32(e + 12, addr);
+		writenet32(e + 16, metric);
+		len += RIP_RESPONSE_SIZE;
+		p = close;
+	}
+
+	return len;
+}
+
+static int
+readtext(FILE *fp, void (*fn)(const octet *, size_t, uint64_t, void *),
+    void *arg)
+{
+	char *line = NULL;
+	size_t linesize = 0;
+	octet pkt[IP_MAXPACKET];
+	int npkts = 0;
+
+	while (getline(&line, &linesize, fp) > 0) {
+		uint64_t ts;
+		ssize_t n;
+
+		n = parseline(line, pkt, sizeof(pkt), &ts);
+		if (n < 0)
+			continue;
+		fn(pkt, n, ts, arg);
+		npkts++;
+	}
+	free(line);
+
+	return npkts;
+}
+
+/*
+ * Reads every RIP datagram in the capture at `path`, calling
+ * `fn` with the payload and its capture time in nanoseconds.
+ * Times from text captures are relative to midnight.
+ * Returns the number of datagrams read, or -1 on error.
+ */
+int
+readcapture(const char *path,
+    void (*fn)(const octet *pkt, size_t len, uint64_t ts, void *arg),
+    void *arg)
+{
+	FILE *fp;
+	int c, npkts;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	c = getc(fp);
+	ungetc(c, fp);
+	if (c == EOF)
+		npkts = 0;
+	else if (isdigit(c) || isspace(c))
+		npkts = readtext(fp, fn, arg);
+	else
+		npkts = readpcap(fp, fn, arg);
+	fclose(fp);
+
+	return npkts;
+}
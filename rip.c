@@ -9,8 +9,8 @@
 #include "dat.h"
 #include "fns.h"
 
-int
-parserippkt(const octet *restrict data, size_t len, RIPPacket *restrict packet)
+static int
+parsepkt(const octet *restrict data, size_t len, RIPPacket *restrict packet)
 {
 	assert(data != NULL);
 	assert(packet != NULL);
@@ -31,7 +31,19 @@ parserippkt(const octet *restrict data, size_t len, RIPPacket *restrict packet)
 }
 
 int
-verifyripauth(RIPPacket *restrict packet, const char *restrict password)
+parserippkt(const octet *restrict data, size_t len, RIPPacket *restrict packet)
+{
+	int r;
+
+	probe1(parse_start, len);
+	r = parsepkt(data, len, packet);
+	probe2(parse_done, r, packet->nresponse);
+
+	return r;
+}
+
+static int
+checkauth(RIPPacket *restrict packet, const char *restrict password)
 {
 	char packetpass[16 + 1];
 
@@ -54,6 +66,18 @@ verifyripauth(RIPPacket *restrict packet, const char *restrict password)
 	return 0;
 }
 
+int
+verifyripauth(RIPPacket *restrict packet, const char *restrict password)
+{
+	int r;
+
+	probe(auth_start);
+	r = checkauth(packet, password);
+	probe1(auth_done, r);
+
+	return r;
+}
+
 static int
 parseriprespocts(const octet *data, size_t len, RIPResponse *restrict response)
 {
@@ -87,3 +111,136 @@ parseripresponse(const RIPPacket *restrict packet, int k,
 	return parseriprespocts(packet->data + offset,
 	           packet->datalen - offset, response);
 }
+
+/*
+ * Classic BPF opcodes.  These are fixed by the instruction
+ * set, but not every system exports them to userspace.
+ */
+enum {
+	BPF_LD = 0x00,
+	BPF_ALU = 0x04,
+	BPF_JMP = 0x05,
+	BPF_RET = 0x06,
+	BPF_MISC = 0x07,
+
+	BPF_W = 0x00,
+	BPF_H = 0x08,
+	BPF_B = 0x10,
+	BPF_ABS = 0x20,
+	BPF_LEN = 0x80,
+
+	BPF_SUB = 0x10,
+	BPF_MUL = 0x20,
+	BPF_DIV = 0x30,
+	BPF_JEQ = 0x10,
+	BPF_JGE = 0x30,
+	BPF_K = 0x00,
+	BPF_X = 0x08,
+	BPF_TAX = 0x00,
+};
+
+typedef struct Filter Filter;
+struct Filter {
+	Bpfinsn *prog;
+	size_t max;
+	size_t n;
+};
+
+static void
+emit(Filter *f, uint16_t code, uint32_t k)
+{
+	assert(f->n < f->max);
+	f->prog[f->n].code = code;
+	f->prog[f->n].jt = 0;
+	f->prog[f->n].jf = 0;
+	f->prog[f->n].k = k;
+	f->n++;
+}
+
+/*
+ * Emit a test that falls through on success.  The false
+ * branch is patched to the final reject once the length
+ * of the program is known; we mark it with jf = 0xFF.
+ */
+static void
+check(Filter *f, uint16_t code, uint32_t k)
+{
+	emit(f, BPF_JMP | code, k);
+	f->prog[f->n - 1].jf = 0xFF;
+}
+
+static void
+checkat(Filter *f, uint16_t size, uint32_t off, uint32_t k)
+{
+	emit(f, BPF_LD | size | BPF_ABS, off);
+	check(f, BPF_JEQ | BPF_K, k);
+}
+
+/*
+ * Builds a socket filter that accepts what parserippkt and
+ * verifyripauth would: a RIPv2 response whose length past
+ * the header is a non-zero multiple of RIP_RESPONSE_SIZE,
+ * starting with a simple password entry that matches.
+ * The payload starts `off` bytes into the filtered data.
+ * Returns the number of instructions written to `prog`.
+ */
+size_t
+mkripfilter(const char *password, size_t off, Bpfinsn *prog, size_t max)
+{
+	Filter f = { prog, max, 0 };
+	size_t passlen, reject;
+	uint32_t pwoff;
+	octet pw[RIP_PASSWORD_SIZE];
+
+	assert(password != NULL);
+	assert(prog != NULL);
+	assert(max >= MAX_RIP_FILTER);
+
+	// A password that cannot fit never verifies.
+	passlen = strlen(password);
+	if (passlen > RIP_PASSWORD_SIZE) {
+		emit(&f, BPF_RET | BPF_K, 0);
+		return f.n;
+	}
+
+	emit(&f, BPF_LD | BPF_W | BPF_LEN, 0);
+	check(&f, BPF_JGE | BPF_K, off + MIN_RIP_PACKET_SIZE + RIP_RESPONSE_SIZE);
+	emit(&f, BPF_ALU | BPF_SUB | BPF_K, off + MIN_RIP_PACKET_SIZE);
+	emit(&f, BPF_MISC | BPF_TAX, 0);
+	emit(&f, BPF_ALU | BPF_DIV | BPF_K, RIP_RESPONSE_SIZE);
+	emit(&f, BPF_ALU | BPF_MUL | BPF_K, RIP_RESPONSE_SIZE);
+	check(&f, BPF_JEQ | BPF_X, 0);
+
+	checkat(&f, BPF_B, off + 0, RIP_COMMAND_RESPONSE);
+	checkat(&f, BPF_B, off + 1, RIP_VERSION_2);
+	checkat(&f, BPF_H, off + 4, 0xFFFF);
+	checkat(&f, BPF_H, off + 6, RIP_AUTH_PASSWORD);
+
+	// Compare through the terminating NUL, if there is room for it.
+	memset(pw, 0, sizeof(pw));
+	memmove(pw, password, passlen);
+	if (passlen < RIP_PASSWORD_SIZE)
+		passlen++;
+	pwoff = off + MIN_RIP_PACKET_SIZE + 4;
+	for (size_t k = 0; k < passlen; ) {
+		if (passlen - k >= 4) {
+			checkat(&f, BPF_W, pwoff + k, readnet32(pw + k));
+			k += 4;
+		} else if (passlen - k >= 2) {
+			checkat(&f, BPF_H, pwoff + k, readnet16(pw + k));
+			k += 2;
+		} else {
+			checkat(&f, BPF_B, pwoff + k, pw[k]);
+			k++;
+		}
+	}
+
+	emit(&f, BPF_RET | BPF_K, UINT32_MAX);
+	reject = f.n;
+	emit(&f, BPF_RET | BPF_K, 0);
+	for (size_t k = 0; k < reject; k++)
+		if (f.prog[k].jf == 0xFF)
+			f.prog[k].jf = reject - k - 1;
+
+	return f.n;
+}
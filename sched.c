@@ -0,0 +1,265 @@
+/*
+ * Kernel operation scheduling; see Sched in dat.h.
+ *
+ * The bucket holds up to `burst` tokens and fills at `rate`
+ * tokens a second; each operation issued takes one.  Tokens
+ * are kept in millionths so that slow rates still fill
+ * smoothly between polls.
+ */
+#include <sys/types.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+
+enum {
+	TOKEN = 1000000,	// Millionths of a token.
+};
+
+static int merge(int was, int op);
+static void enqueue(Sched *s, Schedop *op);
+static void refill(Sched *s, uint64_t now);
+static Schedop *dequeue(Sched *s);
+static void issue(Sched *s, Schedop *op, uint64_t now);
+static void detach(Sched *s, Schedop *op);
+
+// Sets up a scheduler issuing `rate` operations a second, or any number if 0.
+void
+initsched(Sched *s, unsigned int rate, unsigned int burst)
+{
+	memset(s, 0, sizeof(*s));
+	s->rate = rate;
+	s->burst = (burst == 0) ? 1 : burst;
+	s->tokens = (uint64_t)s->burst*TOKEN;
+	s->refilled = s->started = nsec();
+	s->pending = mkipmap();
+}
+
+/*
+ * Queues an operation on `route` in class `prio`, merging it
+ * with any already queued for the prefix.
+ */
+int
+schedroute(Sched *s, int op, int prio, Route *route, Tunnel *tunnel, int rtable)
+{
+	size_t cidr = netmask2cidr(route->subnetmask);
+	Schedop *sop;
+
+	s->queued[prio]++;
+	sop = ipmapfind(s->pending, route->ipnet, cidr);
+	if (sop != NULL) {
+		detach(s, sop);
+		s->coalesced++;
+		op = merge(sop->op, op);
+		if (op < 0) {
+			s->cancelled++;
+			free(sop);
+			return 0;
+		}
+		if (op == SCHED_REMOVE)
+			prio = PRIO_WITHDRAW;
+		else if (sop->prio < prio)
+			prio = sop->prio;
+	} else {
+		sop = calloc(1, sizeof(*sop));
+		if (sop == NULL)
+			fatal("malloc");
+		sop->queued = nsec();
+	}
+	sop->op = op;
+	sop->prio = prio;
+	sop->route = *route;
+	sop->route.rnext = NULL;
+	sop->route.tunnel = NULL;
+	sop->hastunnel = (tunnel != NULL);
+	if (tunnel != NULL)
+		sop->tunnel = *tunnel;
+	sop->rtable = rtable;
+	enqueue(s, sop);
+
+	return 0;
+}
+
+/*
+ * Issues queued operations, highest class first, for as long
+ * as there are tokens.  Returns the number issued.
+ */
+int
+schedrun(Sched *s)
+{
+	uint64_t now = nsec();
+	Schedop *op;
+	int n = 0;
+
+	refill(s, now);
+	while (s->depth > 0 && (s->rate == 0 || s->tokens >= TOKEN)) {
+		op = dequeue(s);
+		if (s->rate != 0)
+			s->tokens -= TOKEN;
+		issue(s, op, now);
+		n++;
+	}
+
+	return n;
+}
+
+// Issues everything queued, whatever the bucket says.
+void
+scheddrain(Sched *s)
+{
+	uint64_t now = nsec();
+
+	while (s->depth > 0)
+		issue(s, dequeue(s), now);
+}
+
+/*
+ * Returns milliseconds until the next queued operation may be
+ * issued, or -1 if there are none.
+ */
+int
+schedwait(Sched *s)
+{
+	uint64_t need;
+
+	if (s->depth == 0)
+		return -1;
+	if (s->rate == 0)
+		return 0;
+	refill(s, nsec());
+	if (s->tokens >= TOKEN)
+		return 0;
+	need = TOKEN - s->tokens;
+
+	// Rounded up, so that the token is there when we wake.
+	return (need*1000/TOKEN + s->rate - 1)/s->rate;
+}
+
+void
+statssched(FILE *fp, Sched *s)
+{
+	static const char *names[NPRIO] = {
+		"new", "change", "withdraw", "refresh",
+	};
+	uint64_t issued = 0;
+	double secs;
+
+	if (fp == NULL)
+		return;
+	fprintf(fp, "sched_rate %u\n", s->rate);
+	fprintf(fp, "sched_burst %u\n", s->burst);
+	fprintf(fp, "sched_tokens %" PRIu64 "\n", s->tokens/TOKEN);
+	fprintf(fp, "sched_depth %zu\n", s->depth);
+	fprintf(fp, "sched_max_depth %zu\n", s->maxdepth);
+	for (int k = 0; k < NPRIO; k++) {
+		fprintf(fp, "sched_%s_queued %" PRIu64 "\n", names[k], s->queued[k]);
+		fprintf(fp, "sched_%s_issued %" PRIu64 "\n", names[k], s->issued[k]);
+		issued += s->issued[k];
+	}
+	fprintf(fp, "sched_coalesced %" PRIu64 "\n", s->coalesced);
+	fprintf(fp, "sched_cancelled %" PRIu64 "\n", s->cancelled);
+	fprintf(fp, "sched_wait_avg_us %" PRIu64 "\n",
+	    (issued == 0) ? 0 : s->waitns/issued/1000);
+	fprintf(fp, "sched_wait_max_us %" PRIu64 "\n", s->maxwaitns/1000);
+	secs = (nsec() - s->started)/1e9;
+	fprintf(fp, "sched_ops_per_sec %.1f\n", (secs > 0) ? issued/secs : 0.0);
+}
+
+/*
+ * Returns the net effect of operation `op` following `was` on
+ * the same prefix, or -1 if there is none.
+ */
+static int
+merge(int was, int op)
+{
+	if (op == SCHED_REMOVE)
+		return (was == SCHED_ADD) ? -1 : SCHED_REMOVE;
+
+	return (was == SCHED_ADD) ? SCHED_ADD : SCHED_CHANGE;
+}
+
+// Appends an operation to its class and enters it by prefix.
+static void
+enqueue(Sched *s, Schedop *op)
+{
+	op->next = NULL;
+	op->prev = s->tail[op->prio];
+	if (s->tail[op->prio] == NULL)
+		s->head[op->prio] = op;
+	else
+		s->tail[op->prio]->next = op;
+	s->tail[op->prio] = op;
+	ipmapinsert(s->pending, op->route.ipnet,
+	    netmask2cidr(op->route.subnetmask), op);
+	if (++s->depth > s->maxdepth)
+		s->maxdepth = s->depth;
+}
+
+static void
+refill(Sched *s, uint64_t now)
+{
+	uint64_t full = (uint64_t)s->burst*TOKEN;
+	uint64_t elapsed = now - s->refilled;
+
+	s->refilled = now;
+	if (s->rate == 0 || elapsed/1000 >= full/s->rate) {
+		s->tokens = full;
+		return;
+	}
+	s->tokens += elapsed/1000*s->rate;
+	if (s->tokens > full)
+		s->tokens = full;
+}
+
+// Takes the oldest operation of the highest class off the queue.
+static Schedop *
+dequeue(Sched *s)
+{
+	for (int k = 0; k < NPRIO; k++)
+		if (s->head[k] != NULL) {
+			Schedop *op = s->head[k];
+
+			detach(s, op);
+			return op;
+		}
+
+	return NULL;
+}
+
+static void
+issue(Sched *s, Schedop *op, uint64_t now)
+{
+	uint64_t wait = now - op->queued;
+
+	sysroute(op->op, &op->route, op->hastunnel ? &op->tunnel : NULL,
+	    op->rtable);
+	s->issued[op->prio]++;
+	s->waitns += wait;
+	if (wait > s->maxwaitns)
+		s->maxwaitns = wait;
+	free(op);
+}
+
+// Removes a queued operation from its class and the prefix map.
+static void
+detach(Sched *s, Schedop *op)
+{
+	if (op->prev == NULL)
+		s->head[op->prio] = op->next;
+	else
+		op->prev->next = op->next;
+	if (op->next == NULL)
+		s->tail[op->prio] = op->prev;
+	else
+		op->next->prev = op->prev;
+	op->next = op->prev = NULL;
+	ipmapremove(s->pending, op->route.ipnet,
+	    netmask2cidr(op->route.subnetmask));
+	s->depth--;
+}
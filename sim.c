@@ -0,0 +1,614 @@
+/*
+ * A simulated kernel.  Routes and tunnel interfaces live in
+ * memory, operations can be made to take a fixed time or to
+ * fail at random, and the resulting state can be checked
+ * against the daemon's own tables.  This lets the daemon run
+ * on systems without gif(4) or PF_ROUTE, and lets us measure
+ * how it behaves when the kernel is slow or unreliable.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dat.h"
+#include "fns.h"
+
+typedef struct Simroute Simroute;
+struct Simroute {
+	uint32_t ipnet;
+	uint32_t subnetmask;
+	char ifname[MAX_TUN_IFNAME];
+	unsigned int ifindex;
+	uint32_t gateway;	// On a multipoint interface.
+};
+
+typedef struct Simif Simif;
+struct Simif {
+	char ifname[MAX_TUN_IFNAME];
+	unsigned int ifnum;
+	unsigned int ifindex;
+	uint32_t local;
+	uint32_t remote;
+	uint32_t endpoint;
+};
+
+enum {
+	SIM_IFINDEX_BASE = 100,	// Leave room for lo and friends.
+};
+
+typedef struct Simstats Simstats;
+struct Simstats {
+	uint64_t upifs;
+	uint64_t downifs;
+	uint64_t repoints;
+	uint64_t adds;
+	uint64_t changes;
+	uint64_t removes;
+	uint64_t injected;	// Failures we made up.
+	uint64_t errors;	// Failures the real kernel would report.
+};
+
+static IPMap *simfib;
+static IPMap *simifs;		// Keyed by interface number.
+static unsigned int linkdelay;	// Microseconds.
+static unsigned int routedelay;
+static unsigned int failpct;
+static Simstats simstats;
+
+/*
+ * Interfaces may be set up from worker threads.  The lock
+ * covers the tables, the counters and the failure draws;
+ * operations take their time outside it, as they would in
+ * the kernel.
+ */
+static pthread_mutex_t simlock = PTHREAD_MUTEX_INITIALIZER;
+
+static int mkif(Tunnel *tunnel, uint32_t endpoint);
+static int rmif(Tunnel *tunnel);
+static int repointif(Tunnel *tunnel);
+
+/*
+ * Options are comma-separated: link=usec and route=usec set
+ * the time each interface or route operation takes, fail=pct
+ * the percentage of operations that fail, and seed=n seeds
+ * the failure generator.
+ */
+int
+simconfig(const char *opts)
+{
+	char *copy, *opt, *next, *eq;
+
+	copy = strdup(opts);
+	if (copy == NULL)
+		fatal("malloc");
+	for (opt = copy; opt != NULL && *opt != '\0'; opt = next) {
+		unsigned int val;
+
+		next = strchr(opt, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		eq = strchr(opt, '=');
+		if (eq == NULL) {
+			free(copy);
+			return -1;
+		}
+		*eq++ = '\0';
+		val = strnum(eq);
+		if (strcmp(opt, "link") == 0)
+			linkdelay = val;
+		else if (strcmp(opt, "route") == 0)
+			routedelay = val;
+		else if (strcmp(opt, "fail") == 0 && val <= 100)
+			failpct = val;
+		else if (strcmp(opt, "seed") == 0)
+			srandom(val);
+		else {
+			free(copy);
+			return -1;
+		}
+	}
+	free(copy);
+
+	return 0;
+}
+
+static void
+simdelay(unsigned int usec)
+{
+	struct timespec ts;
+
+	if (usec == 0)
+		return;
+	ts.tv_sec = usec/1000000;
+	ts.tv_nsec = (usec%1000000)*1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+// Decides whether to inject a failure into this operation.
+static int
+simfail(const char *op, const char *what)
+{
+	if (failpct == 0 || random()%100 >= failpct)
+		return 0;
+	simstats.injected++;
+	errno = EIO;
+	error("sim: injected %s failure (%s)", op, what);
+
+	return 1;
+}
+
+static void
+simroutestr(Route *route, char buf[static 32])
+{
+	char net[INET_ADDRSTRLEN];
+
+	ipaddrstr(route->ipnet, net);
+	snprintf(buf, 32, "%s/%u", net, netmask2cidr(route->subnetmask));
+}
+
+// Static interfaces were not made by us; they get an index anyway.
+static unsigned int
+simindex(Tunnel *tunnel)
+{
+	if (tunnel->ifindex == 0)
+		tunnel->ifindex = SIM_IFINDEX_BASE + tunnel->ifnum;
+	return tunnel->ifindex;
+}
+
+static void
+siminitsys(int rtable)
+{
+	(void)rtable;
+	if (simfib == NULL)
+		simfib = mkipmap();
+	if (simifs == NULL)
+		simifs = mkipmap();
+}
+
+static int
+simuptunnel(Tunnel *tunnel, int rdomain, int tunneldomain, uint32_t endpoint)
+{
+	int rv;
+
+	assert(tunnel != NULL);
+	assert(simifs != NULL);
+	(void)rdomain;
+	(void)tunneldomain;
+	simdelay(linkdelay);
+	pthread_mutex_lock(&simlock);
+	rv = mkif(tunnel, endpoint);
+	pthread_mutex_unlock(&simlock);
+
+	return rv;
+}
+
+static int
+simdowntunnel(Tunnel *tunnel)
+{
+	int rv;
+
+	assert(tunnel != NULL);
+	assert(simifs != NULL);
+	simdelay(linkdelay);
+	pthread_mutex_lock(&simlock);
+	rv = rmif(tunnel);
+	pthread_mutex_unlock(&simlock);
+
+	return rv;
+}
+
+static int
+simretunnel(Tunnel *tunnel)
+{
+	int rv;
+
+	assert(tunnel != NULL);
+	assert(simifs != NULL);
+	simdelay(linkdelay);
+	pthread_mutex_lock(&simlock);
+	rv = repointif(tunnel);
+	pthread_mutex_unlock(&simlock);
+
+	return rv;
+}
+
+static int
+mkif(Tunnel *tunnel, uint32_t endpoint)
+{
+	Simif *simif;
+
+	if (simfail("create", tunnel->ifname))
+		return -1;
+	if (ipmapfind(simifs, tunnel->ifnum, 32) != NULL) {
+		simstats.errors++;
+		errno = EEXIST;
+		error("sim: create %s failed: %m", tunnel->ifname);
+		return -1;
+	}
+	simif = calloc(1, sizeof(*simif));
+	if (simif == NULL)
+		fatal("malloc");
+	memmove(simif->ifname, tunnel->ifname, sizeof(simif->ifname));
+	simif->ifnum = tunnel->ifnum;
+	simif->ifindex = SIM_IFINDEX_BASE + tunnel->ifnum;
+	simif->local = tunnel->local;
+	simif->remote = tunnel->remote;
+	simif->endpoint = endpoint;
+	ipmapinsert(simifs, tunnel->ifnum, 32, simif);
+	tunnel->ifindex = simif->ifindex;
+	simstats.upifs++;
+
+	return 0;
+}
+
+static int
+rmif(Tunnel *tunnel)
+{
+	Simif *simif;
+
+	if (simfail("destroy", tunnel->ifname))
+		return -1;
+	if (ipmapfind(simifs, tunnel->ifnum, 32) == NULL) {
+		simstats.errors++;
+		errno = ENXIO;
+		error("sim: destroying %s failed: %m", tunnel->ifname);
+		return -1;
+	}
+	simif = ipmapremove(simifs, tunnel->ifnum, 32);
+	free(simif);
+	tunnel->ifindex = 0;
+	simstats.downifs++;
+
+	return 0;
+}
+
+static int
+repointif(Tunnel *tunnel)
+{
+	Simif *simif;
+
+	if (simfail("re-point", tunnel->ifname))
+		return -1;
+	simif = ipmapfind(simifs, tunnel->ifnum, 32);
+	if (simif == NULL) {
+		simstats.errors++;
+		errno = ENXIO;
+		error("sim: re-pointing %s failed: %m", tunnel->ifname);
+		return -1;
+	}
+	simif->local = tunnel->local;
+	simif->remote = tunnel->remote;
+	simstats.repoints++;
+
+	return 0;
+}
+
+static int
+addfib(Route *route, Tunnel *tunnel, const char *what)
+{
+	Simroute *sr;
+	size_t cidr;
+
+	if (simfail("route add", what))
+		return -1;
+	cidr = netmask2cidr(route->subnetmask);
+	if (ipmapfind(simfib, route->ipnet, cidr) != NULL) {
+		simstats.errors++;
+		errno = EEXIST;
+		error("sim: route add failure (%s): %m", what);
+		return -1;
+	}
+	sr = calloc(1, sizeof(*sr));
+	if (sr == NULL)
+		fatal("malloc");
+	sr->ipnet = route->ipnet;
+	sr->subnetmask = route->subnetmask;
+	memmove(sr->ifname, tunnel->ifname, sizeof(sr->ifname));
+	sr->ifindex = simindex(tunnel);
+	sr->gateway = tunnel->multipoint ? tunnel->remote : 0;
+	ipmapinsert(simfib, route->ipnet, cidr, sr);
+	simstats.adds++;
+
+	return 0;
+}
+
+static int
+chfib(Route *route, Tunnel *tunnel, const char *what)
+{
+	Simroute *sr;
+
+	if (simfail("route change", what))
+		return -1;
+	// As with the kernel backend, a missing route is added.
+	sr = ipmapfind(simfib, route->ipnet, netmask2cidr(route->subnetmask));
+	if (sr == NULL)
+		return addfib(route, tunnel, what);
+	memmove(sr->ifname, tunnel->ifname, sizeof(sr->ifname));
+	sr->ifindex = simindex(tunnel);
+	sr->gateway = tunnel->multipoint ? tunnel->remote : 0;
+	simstats.changes++;
+
+	return 0;
+}
+
+static int
+rmfib(Route *route, const char *what)
+{
+	size_t cidr;
+
+	if (simfail("route remove", what))
+		return -1;
+	cidr = netmask2cidr(route->subnetmask);
+	if (ipmapfind(simfib, route->ipnet, cidr) == NULL)
+		return 0;
+	free(ipmapremove(simfib, route->ipnet, cidr));
+	simstats.removes++;
+
+	return 0;
+}
+
+static int
+simaddroute(Route *route, Tunnel *tunnel, int rtable)
+{
+	char what[32];
+	int rv;
+
+	assert(route != NULL);
+	assert(tunnel != NULL);
+	assert(simfib != NULL);
+	(void)rtable;
+	simroutestr(route, what);
+	simdelay(routedelay);
+	pthread_mutex_lock(&simlock);
+	rv = addfib(route, tunnel, what);
+	pthread_mutex_unlock(&simlock);
+
+	return rv;
+}
+
+static int
+simchroute(Route *route, Tunnel *tunnel, int rtable)
+{
+	char what[32];
+	int rv;
+
+	assert(route != NULL);
+	assert(tunnel != NULL);
+	assert(simfib != NULL);
+	(void)rtable;
+	simroutestr(route, what);
+	simdelay(routedelay);
+	pthread_mutex_lock(&simlock);
+	rv = chfib(route, tunnel, what);
+	pthread_mutex_unlock(&simlock);
+
+	return rv;
+}
+
+static int
+simrmroute(Route *route, int rtable)
+{
+	char what[32];
+	int rv;
+
+	assert(route != NULL);
+	assert(simfib != NULL);
+	(void)rtable;
+	simroutestr(route, what);
+	simdelay(routedelay);
+	pthread_mutex_lock(&simlock);
+	rv = rmfib(route, what);
+	pthread_mutex_unlock(&simlock);
+
+	return rv;
+}
+
+typedef struct Simscan Simscan;
+struct Simscan {
+	void (*tunnelfn)(Kif *kif, void *arg);
+	void (*routefn)(Kroute *kr, void *arg);
+	void *arg;
+	int n;
+};
+
+static void
+scanif(uint32_t key, size_t keylen, void *simifp, void *scanp)
+{
+	Simif *simif = simifp;
+	Simscan *scan = scanp;
+	Kif kif;
+
+	memset(&kif, 0, sizeof(kif));
+	memmove(kif.ifname, simif->ifname, sizeof(kif.ifname));
+	kif.ifindex = simif->ifindex;
+	kif.local = simif->local;
+	kif.remote = simif->remote;
+	scan->tunnelfn(&kif, scan->arg);
+	scan->n++;
+}
+
+static int
+simscantunnels(void (*fn)(Kif *kif, void *arg), void *arg)
+{
+	Simscan scan = { fn, NULL, arg, 0 };
+
+	assert(simifs != NULL);
+	pthread_mutex_lock(&simlock);
+	ipmapdo(simifs, scanif, &scan);
+	pthread_mutex_unlock(&simlock);
+
+	return scan.n;
+}
+
+static void
+scanroute(uint32_t key, size_t keylen, void *srp, void *scanp)
+{
+	Simroute *sr = srp;
+	Simscan *scan = scanp;
+	Kroute kr;
+
+	memset(&kr, 0, sizeof(kr));
+	kr.ipnet = sr->ipnet;
+	kr.subnetmask = sr->subnetmask;
+	kr.ifindex = sr->ifindex;
+	kr.gateway = sr->gateway;
+	scan->routefn(&kr, scan->arg);
+	scan->n++;
+}
+
+static int
+simscanroutes(int rtable, void (*fn)(Kroute *kr, void *arg), void *arg)
+{
+	Simscan scan = { NULL, fn, arg, 0 };
+
+	assert(simfib != NULL);
+	(void)rtable;
+	pthread_mutex_lock(&simlock);
+	ipmapdo(simfib, scanroute, &scan);
+	pthread_mutex_unlock(&simlock);
+
+	return scan.n;
+}
+
+static void simstatsout(FILE *fp);
+
+Backend simbackend = {
+	.name = "sim",
+	.multipoint = 1,
+	.initsys = siminitsys,
+	.uptunnel = simuptunnel,
+	.downtunnel = simdowntunnel,
+	.retunnel = simretunnel,
+	.addroute = simaddroute,
+	.chroute = simchroute,
+	.rmroute = simrmroute,
+	.stats = simstatsout,
+	.scantunnels = simscantunnels,
+	.scanroutes = simscanroutes,
+};
+
+typedef struct Verify Verify;
+struct Verify {
+	IPMap *routes;
+	IPMap *tunnels;
+	int bad;
+};
+
+static void
+verifyroute(uint32_t key, size_t keylen, void *routep, void *arg)
+{
+	Route *route = routep;
+	Verify *v = arg;
+	Simroute *sr;
+	char net[INET_ADDRSTRLEN];
+
+	sr = ipmapfind(simfib, key, keylen);
+	if (route->tunnel == NULL && sr == NULL)
+		return;
+	if (sr != NULL && route->tunnel != NULL &&
+	    strcmp(sr->ifname, route->tunnel->ifname) == 0 &&
+	    sr->gateway == (route->tunnel->multipoint ? route->tunnel->remote : 0))
+		return;
+	ipaddrstr(key, net);
+	error("sim: route %s/%zu is on %s in the kernel but %s in the table",
+	    net, keylen,
+	    (sr == NULL) ? "nothing" : sr->ifname,
+	    (route->tunnel == NULL) ? "nothing" : route->tunnel->ifname);
+	v->bad++;
+}
+
+static void
+verifyfib(uint32_t key, size_t keylen, void *srp, void *arg)
+{
+	Simroute *sr = srp;
+	Verify *v = arg;
+	char net[INET_ADDRSTRLEN];
+
+	if (ipmapfind(v->routes, key, keylen) != NULL)
+		return;
+	ipaddrstr(key, net);
+	error("sim: stale kernel route %s/%zu on %s", net, keylen, sr->ifname);
+	v->bad++;
+}
+
+static void
+verifytunnel(uint32_t key, size_t keylen, void *tunnelp, void *arg)
+{
+	Tunnel *tunnel = tunnelp;
+	Verify *v = arg;
+	Simif *simif;
+
+	// Peers on a multipoint interface have none of their own.
+	if (tunnel->multipoint)
+		return;
+	simif = ipmapfind(simifs, tunnel->ifnum, 32);
+	if (simif != NULL && simif->remote == tunnel->remote &&
+	    simif->local == tunnel->local)
+		return;
+	error("sim: tunnel %s is %s in the kernel", tunnel->ifname,
+	    (simif == NULL) ? "missing" : "misconfigured");
+	v->bad++;
+}
+
+static void
+verifyif(uint32_t key, size_t keylen, void *simifp, void *arg)
+{
+	Simif *simif = simifp;
+	Verify *v = arg;
+	Tunnel *tunnel;
+
+	// A multipoint interface is not in the table of tunnels.
+	if (simif->remote == 0)
+		return;
+	tunnel = ipmapfind(v->tunnels, simif->remote, 32);
+	if (tunnel != NULL && tunnel->ifnum == simif->ifnum)
+		return;
+	error("sim: stale kernel interface %s", simif->ifname);
+	v->bad++;
+}
+
+/*
+ * Checks that the simulated kernel state matches the tables
+ * of routes and tunnels.  Returns the number of discrepancies.
+ */
+int
+simverify(IPMap *routes, IPMap *tunnels)
+{
+	Verify v = { routes, tunnels, 0 };
+
+	if (simfib == NULL || simifs == NULL)
+		return -1;
+	pthread_mutex_lock(&simlock);
+	ipmapdo(routes, verifyroute, &v);
+	ipmapdo(simfib, verifyfib, &v);
+	ipmapdo(tunnels, verifytunnel, &v);
+	ipmapdo(simifs, verifyif, &v);
+	pthread_mutex_unlock(&simlock);
+
+	return v.bad;
+}
+
+static void
+simstatsout(FILE *fp)
+{
+	Simstats st;
+
+	pthread_mutex_lock(&simlock);
+	st = simstats;
+	pthread_mutex_unlock(&simlock);
+	fprintf(fp, "sim_tunnels_up %" PRIu64 "\n", st.upifs);
+	fprintf(fp, "sim_tunnels_down %" PRIu64 "\n", st.downifs);
+	fprintf(fp, "sim_tunnels_repointed %" PRIu64 "\n", st.repoints);
+	fprintf(fp, "sim_route_adds %" PRIu64 "\n", st.adds);
+	fprintf(fp, "sim_route_changes %" PRIu64 "\n", st.changes);
+	fprintf(fp, "sim_route_removes %" PRIu64 "\n", st.removes);
+	fprintf(fp, "sim_injected_failures %" PRIu64 "\n", st.injected);
+	fprintf(fp, "sim_errors %" PRIu64 "\n", st.errors);
+}
@@ -0,0 +1,160 @@
+/*
+ * Counters are exported as a flat file of "name value" lines,
+ * suitable for a monitoring agent's text-file collector.  The
+ * file is written to a temporary name and renamed into place
+ * so that readers never see a partial snapshot.  Suppressed
+ * prefixes are listed individually, with the prefix as a label.
+ */
+#include <inttypes.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dat.h"
+#include "fns.h"
+
+FILE *
+statsbegin(const char *path)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (path == NULL)
+		return NULL;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL)
+		error("cannot open stats file %s: %m", tmp);
+
+	return fp;
+}
+
+void
+statsend(FILE *fp, const char *path)
+{
+	char tmp[PATH_MAX];
+
+	if (fp == NULL)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (fclose(fp) != 0) {
+		error("cannot write stats file %s: %m", tmp);
+		return;
+	}
+	if (rename(tmp, path) < 0)
+		error("cannot rename stats file to %s: %m", path);
+}
+
+void
+statsrx(FILE *fp, const char *prefix, Rxstats *rx)
+{
+	if (fp == NULL)
+		return;
+	fprintf(fp, "%srx_packets %" PRIu64 "\n", prefix, rx->packets);
+	fprintf(fp, "%srx_bytes %" PRIu64 "\n", prefix, rx->bytes);
+	fprintf(fp, "%srx_drops %" PRIu64 "\n", prefix, rx->drops);
+	fprintf(fp, "%srx_bursts %" PRIu64 "\n", prefix, rx->bursts);
+	fprintf(fp, "%srx_queue_hiwat %zu\n", prefix, rx->qhiwat);
+	fprintf(fp, "%srx_rcvbuf %d\n", prefix, rx->rcvbuf);
+	fprintf(fp, "%srx_burst_packets %zu\n", prefix, rx->lastburstpkts);
+	fprintf(fp, "%srx_burst_bytes %zu\n", prefix, rx->lastburstbytes);
+	fprintf(fp, "%srx_burst_drops %" PRIu32 "\n", prefix,
+	    rx->lastburstdrops);
+	fprintf(fp, "%srx_burst_max_bytes %zu\n", prefix, rx->maxburstbytes);
+}
+
+void
+statsfeed(FILE *fp, Feed *feed)
+{
+	char prefix[32];
+
+	if (fp == NULL)
+		return;
+	snprintf(prefix, sizeof(prefix), "feed%d_", feed->id);
+	statsrx(fp, prefix, &feed->rx);
+	fprintf(fp, "%sparse_errors %" PRIu64 "\n", prefix, feed->parseerrs);
+	fprintf(fp, "%sauth_failures %" PRIu64 "\n", prefix, feed->authfails);
+	fprintf(fp, "%sentries %" PRIu64 "\n", prefix, feed->entries);
+	fprintf(fp, "%sbad_entries %" PRIu64 "\n", prefix, feed->badentries);
+	fprintf(fp, "%sduplicates %" PRIu64 "\n", prefix, feed->dups);
+	fprintf(fp, "%sconflicts %" PRIu64 "\n", prefix, feed->conflicts);
+	fprintf(fp, "%sunchanged %" PRIu64 "\n", prefix, feed->unchanged);
+	fprintf(fp, "%sbulk_refreshed %" PRIu64 "\n", prefix, feed->bulk);
+	fprintf(fp, "%scache_hits %" PRIu64 "\n", prefix, feed->cache.hits);
+	fprintf(fp, "%scache_misses %" PRIu64 "\n", prefix, feed->cache.misses);
+	fprintf(fp, "%scache_stale %" PRIu64 "\n", prefix, feed->cache.stale);
+	fprintf(fp, "%sskip_rate %.3f\n", prefix, (feed->entries == 0) ? 0.0 :
+	    (double)(feed->unchanged + feed->bulk)/feed->entries);
+}
+
+void
+statsreconcile(FILE *fp, Reconciler *rc)
+{
+	if (fp == NULL)
+		return;
+	fprintf(fp, "reconcile_runs %" PRIu64 "\n", rc->runs);
+	fprintf(fp, "reconcile_steps %" PRIu64 "\n", rc->steps);
+	fprintf(fp, "reconcile_checked %" PRIu64 "\n", rc->checked);
+	fprintf(fp, "reconcile_missing %" PRIu64 "\n", rc->missing);
+	fprintf(fp, "reconcile_moved %" PRIu64 "\n", rc->moved);
+	fprintf(fp, "reconcile_stale %" PRIu64 "\n", rc->stale);
+	fprintf(fp, "reconcile_deferred %" PRIu64 "\n", rc->deferred);
+}
+
+void
+statsaggregator(FILE *fp, Aggregator *a)
+{
+	if (fp == NULL || !a->enabled)
+		return;
+	fprintf(fp, "aggregate_routes %zu\n", a->nroutes);
+	fprintf(fp, "aggregate_installed %zu\n", a->naggregates);
+	fprintf(fp, "aggregate_runs %" PRIu64 "\n", a->runs);
+	fprintf(fp, "aggregate_adds %" PRIu64 "\n", a->adds);
+	fprintf(fp, "aggregate_changes %" PRIu64 "\n", a->changes);
+	fprintf(fp, "aggregate_removes %" PRIu64 "\n", a->removes);
+}
+
+void
+statspool(FILE *fp, Tunpool *pool)
+{
+	if (fp == NULL)
+		return;
+	fprintf(fp, "pool_parked %d\n", pool->nparked);
+	fprintf(fp, "pool_parks %" PRIu64 "\n", pool->parks);
+	fprintf(fp, "pool_reuses %" PRIu64 "\n", pool->reuses);
+	fprintf(fp, "pool_repoints %" PRIu64 "\n", pool->repoints);
+	fprintf(fp, "pool_misses %" PRIu64 "\n", pool->misses);
+	fprintf(fp, "pool_destroys %" PRIu64 "\n", pool->destroys);
+	fprintf(fp, "pool_doomed %d\n", pool->ndoomed);
+	fprintf(fp, "pool_revivals %" PRIu64 "\n", pool->revivals);
+}
+
+static void
+statsdamp(uint32_t key, size_t keylen, void *dampp, void *fpp)
+{
+	Damp *dp = dampp;
+	FILE *fp = fpp;
+	char net[INET_ADDRSTRLEN];
+
+	if (!dp->suppressed)
+		return;
+	ipaddrstr(key, net);
+	fprintf(fp, "damp_penalty{prefix=\"%s/%zu\"} %u\n", net, keylen,
+	    decay(dp->penalty, time(NULL) - dp->updated));
+}
+
+void
+statsdamper(FILE *fp, Damper *d)
+{
+	if (fp == NULL)
+		return;
+	fprintf(fp, "damp_tracked %zu\n", d->ntracked);
+	fprintf(fp, "damp_suppressed %zu\n", d->nsuppressed);
+	fprintf(fp, "damp_suppressions %" PRIu64 "\n", d->suppressions);
+	fprintf(fp, "damp_reuses %" PRIu64 "\n", d->reuses);
+	fprintf(fp, "damp_ignored %" PRIu64 "\n", d->ignored);
+	ipmapdo(d->prefixes, statsdamp, fp);
+}
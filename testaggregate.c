@@ -0,0 +1,202 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+enum {
+	NTUNNELS = 4,
+	NRANDOM = 2000,
+	NPROBES = 20000,
+	NOW = 1000000,
+};
+
+IPMap *routes;
+IPMap *tunnels;
+Aggregator agg;
+Tunnel *tun[NTUNNELS];
+
+// Announces net/cidr via t, or withdraws it if t is nil.
+void
+set(uint32_t net, size_t cidr, Tunnel *t)
+{
+	Route *r = ipmapfind(routes, net, cidr);
+
+	if (t == NULL) {
+		free(ipmapremove(routes, net, cidr));
+		aggchanged(&agg);
+		return;
+	}
+	if (r == NULL) {
+		r = calloc(1, sizeof(*r));
+		assert(r != NULL);
+		r->ipnet = net;
+		r->subnetmask = cidr2netmask(cidr);
+		ipmapinsert(routes, net, cidr, r);
+	}
+	r->tunnel = t;
+	r->gateway = t->remote;
+	aggchanged(&agg);
+}
+
+void
+clear(uint32_t key, size_t keylen, void *routep, void *arg)
+{
+	IPMap *gone = arg;
+
+	ipmapinsert(gone, key, keylen, routep);
+}
+
+void
+drop(uint32_t key, size_t keylen, void *routep, void *arg)
+{
+	(void)routep;
+	(void)arg;
+	free(ipmapremove(routes, key, keylen));
+}
+
+void
+clearall(void)
+{
+	IPMap *gone = mkipmap();
+
+	ipmapdo(routes, clear, gone);
+	ipmapdo(gone, drop, NULL);
+	freeipmap(gone, NULL);
+	aggchanged(&agg);
+}
+
+// Checks that the kernel forwards every probed address as our table does.
+void
+check(size_t want)
+{
+	uint32_t base = mkkey("44.0.0.0");
+
+	aggflush(&agg, NOW);
+	assert(simverify(agg.fib, tunnels) == 0);
+	for (int k = 0; k < NPROBES; k++) {
+		uint32_t addr = base | (random() & 0x00FFFFFF);
+		Route *r = ipmapnearest(routes, addr, 32);
+		Route *f = ipmapnearest(agg.fib, addr, 32);
+
+		assert((r == NULL) == (f == NULL));
+		assert(r == NULL || r->tunnel == f->tunnel);
+	}
+	if (want != 0 && agg.naggregates != want) {
+		fprintf(stderr, "%zu aggregates, want %zu\n",
+		    agg.naggregates, want);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int
+main(void)
+{
+	uint32_t net = mkkey("44.161.239.0");
+	uint32_t hosts = mkkey("44.153.54.0");
+	uint32_t far = mkkey("44.99.0.0");
+	uint64_t adds, removes, runs;
+	Tunnel *lone;
+
+	assert(setbackend("sim") == 0);
+	initsys(0);
+	srandom(44);
+	routes = mkipmap();
+	tunnels = mkipmap();
+	for (int k = 0; k < NTUNNELS; k++)
+		tun[k] = newtunnel(k, mkkey("10.0.0.1") + k, 1, tunnels);
+	initaggregator(&agg, routes, 0, 1);
+
+	// Siblings merge, all the way up.
+	for (int k = 0; k < 4; k++)
+		set(net + k*64, 26, tun[0]);
+	check(1);
+	assert(ipmapfind(agg.fib, net, 24) != NULL);
+
+	// Host routes under a covering route on the same tunnel go.
+	set(hosts, 24, tun[1]);
+	for (int k = 1; k < 200; k += 3)
+		set(hosts + k, 32, tun[1]);
+	check(2);
+
+	// Those on another tunnel stay.
+	set(hosts + 7, 32, tun[2]);
+	check(3);
+
+	// A prefix wholly shadowed by its children takes their tunnel.
+	set(net, 24, tun[3]);
+	check(3);
+	assert(((Route *)ipmapfind(agg.fib, net, 24))->tunnel == tun[0]);
+
+	// A change splits the aggregate.
+	adds = agg.adds;
+	removes = agg.removes;
+	set(net + 192, 26, tun[1]);
+	check(5);
+	assert(agg.adds == adds + 3 && agg.removes == removes + 1);
+
+	// Only the difference reaches the kernel.
+	adds = agg.adds;
+	removes = agg.removes;
+	set(net + 192, 26, tun[0]);
+	check(3);
+	assert(agg.adds == adds + 1 && agg.removes == removes + 3);
+	assert(agg.changes == 0);
+
+	// An aggregate that moves is changed in place.
+	for (int k = 0; k < 4; k++)
+		set(net + k*64, 26, tun[2]);
+	check(3);
+	assert(agg.changes == 1);
+
+	/*
+	 * A prefix that moves off a tunnel with no other routes is
+	 * relinked before the old tunnel goes, and the flush made
+	 * then moves it in the kernel too.
+	 */
+	lone = newtunnel(NTUNNELS, mkkey("10.0.0.99"), 1, tunnels);
+	set(far, 24, lone);
+	check(4);
+	set(far, 24, tun[3]);
+	aggflush(&agg, NOW);
+	assert(((Route *)ipmapfind(agg.fib, far, 24))->tunnel == tun[3]);
+	ipmapremove(tunnels, lone->remote, 32);
+	assert(downtunnel(lone) == 0);
+	free(lone);
+	check(4);
+	set(far, 24, NULL);
+	check(3);
+
+	// An unchanged table costs nothing.
+	runs = agg.runs;
+	aggflush(&agg, NOW);
+	assert(agg.runs == runs);
+
+	// Random tables.
+	for (int round = 0; round < 4; round++) {
+		clearall();
+		for (int k = 0; k < NRANDOM; k++) {
+			size_t cidr = 16 + random()%17;
+			uint32_t addr = mkkey("44.128.0.0") | (random() & 0x0003FFFF);
+
+			set(addr & cidr2netmask(cidr), cidr,
+			    tun[random()%NTUNNELS]);
+		}
+		check(0);
+		assert(agg.naggregates <= agg.nroutes);
+	}
+
+	// Withdrawing everything empties the kernel.
+	clearall();
+	check(0);
+	assert(agg.naggregates == 0);
+
+	return 0;
+}
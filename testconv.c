@@ -0,0 +1,62 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+
+int
+main(void)
+{
+	Conv c;
+
+	memset(&c, 0, sizeof(c));
+	initconv(&c, 1000);
+
+	// A broadcast announcing two changes, acknowledged together.
+	convrx(&c, 2000);
+	convchange(&c, 2000);
+	convrx(&c, 2500);
+	convchange(&c, 2500);
+	convcheck(&c, 3000, 1, 1);
+	assert(c.nconfirmed == 0);
+	convcheck(&c, 4000, 0, 1);
+	assert(c.nconfirmed == 2);
+	assert(c.episodes == 0);
+	// More of the burst, changing nothing, does not stretch it.
+	convrx(&c, 5000);
+	convcheck(&c, 6000, 0, 1);
+	convcheck(&c, 9000, 0, 0);
+	assert(c.episodes == 1);
+	assert(c.coldstart == 3000);
+	assert(c.last == 2000);
+	assert(c.lastp50 == 1500);
+	assert(c.lastmax == 2000);
+	assert(c.changes == 2);
+
+	// Still busy when the feeds go quiet: the episode stays open.
+	convrx(&c, 20000);
+	for (int k = 0; k < 100; k++)
+		convchange(&c, 20000 + k);
+	convcheck(&c, 21000, 1, 0);
+	assert(c.episodes == 1);
+	convcheck(&c, 30000, 0, 0);
+	assert(c.episodes == 2);
+	assert(c.last == 10000);
+	assert(c.lastp50 == 10000 - 50);
+	assert(c.lastp99 == 10000 - 1);
+	assert(c.lastmax == 10000);
+	assert(c.maxepisode == 10000);
+	assert(c.coldstart == 3000);
+
+	// A broadcast that changes nothing.
+	convrx(&c, 40000);
+	convcheck(&c, 41000, 0, 0);
+	assert(c.episodes == 3);
+	assert(c.quiet == 1);
+	assert(c.last == 10000);
+
+	return 0;
+}
@@ -0,0 +1,98 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+enum {
+	NOW = 1000000,
+	H = DAMP_HALFLIFE,
+};
+
+void
+testdecay(void)
+{
+	unsigned int prev = 8000;
+
+	assert(decay(1000, 0) == 1000);
+	assert(decay(1000, H) == 500);
+	assert(decay(1000, 2*H) == 250);
+	assert(decay(1000, H/2) >= 706 && decay(1000, H/2) <= 708);
+	assert(decay(DAMP_MAX, 32*H) == 0);
+	for (int t = 1; t < 4*H; t += 7) {
+		unsigned int p = decay(8000, t);
+		assert(p <= prev);
+		prev = p;
+	}
+}
+
+int
+main(void)
+{
+	Damper d;
+	Route r;
+	uint32_t net = mkkey("44.1.2.0");
+	uint32_t gw1 = mkkey("10.0.0.1"), gw2 = mkkey("10.0.0.2");
+	time_t now = NOW;
+
+	testdecay();
+
+	// A stable route costs nothing.
+	initdamper(&d, 1);
+	assert(!damped(&d, NULL, net, 24, gw1, now));
+	memset(&r, 0, sizeof(r));
+	r.ipnet = net;
+	r.subnetmask = cidr2netmask(24);
+	r.gateway = gw1;
+	assert(!damped(&d, &r, net, 24, gw1, now));
+	assert(d.ntracked == 0);
+
+	// Bouncing between gateways gets it suppressed.
+	for (int k = 0; k < DAMP_SUPPRESS/DAMP_CHANGE - 1; k++) {
+		uint32_t gw = (r.gateway == gw1) ? gw2 : gw1;
+		assert(!damped(&d, &r, net, 24, gw, now));
+		r.gateway = gw;
+	}
+	assert(d.ntracked == 1 && d.nsuppressed == 0);
+	assert(damped(&d, &r, net, 24, (r.gateway == gw1) ? gw2 : gw1, now));
+	assert(d.nsuppressed == 1 && d.suppressions == 1 && d.ignored == 1);
+
+	// Announcements that agree with what we have still get through.
+	assert(!damped(&d, &r, net, 24, r.gateway, now));
+
+	// Once it decays below the reuse threshold, it is let go.
+	now += H;
+	assert(damped(&d, &r, net, 24, gw1, now) == (r.gateway != gw1));
+	r.gateway = gw1;
+	now += 2*H;
+	dampsweep(&d, now);
+	assert(d.nsuppressed == 0 && d.reuses == 1);
+	assert(!damped(&d, &r, net, 24, gw2, now));
+
+	// And forgotten once it is quiet.
+	now += 4*H;
+	dampsweep(&d, now);
+	assert(d.ntracked == 0);
+
+	// Withdrawals count too; a suppressed prefix is not brought back.
+	dampwithdraw(&d, net, 24, gw1, now);
+	assert(!damped(&d, NULL, net, 24, gw1, now));
+	dampwithdraw(&d, net, 24, gw1, now);
+	assert(d.nsuppressed == 1);
+	assert(damped(&d, NULL, net, 24, gw1, now));
+
+	// Damping can be turned off.
+	initdamper(&d, 0);
+	for (int k = 0; k < 10; k++)
+		dampwithdraw(&d, net, 24, gw1, now);
+	assert(!damped(&d, NULL, net, 24, gw1, now) && d.ntracked == 0);
+
+	return 0;
+}
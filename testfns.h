@@ -1,3 +1,6 @@
 uint32_t mkkey(const char *addr);
 size_t mkkeylen(const char *subnetmask);
 void u32tobin(uint32_t w, size_t len, char bin[static 33]);
+void expect(const char *what, uint64_t got, uint64_t want);
+Tunnel *newtunnel(unsigned int ifnum, uint32_t remote, int up, IPMap *tunnels);
+unsigned int takeif(Bitvec *interfaces);
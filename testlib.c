@@ -32,3 +32,47 @@ u32tobin(uint32_t w, size_t len, char bin[static 33])
 		bin[k] = '0' + ((w >> k) & 0x01);
 	bin[len] = '\0';
 }
+
+// Fails the test unless `got` is `want`.
+void
+expect(const char *what, uint64_t got, uint64_t want)
+{
+	if (got != want) {
+		fprintf(stderr, "%s: got %llu, want %llu\n", what,
+		    (unsigned long long)got, (unsigned long long)want);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Makes tunnel gif`ifnum` to `remote`.  With `up` set, brings
+ * it up; unless `tunnels` is nil, enters it there.
+ */
+Tunnel *
+newtunnel(unsigned int ifnum, uint32_t remote, int up, IPMap *tunnels)
+{
+	Tunnel *t = calloc(1, sizeof(*t));
+
+	assert(t != NULL);
+	t->ifnum = ifnum;
+	snprintf(t->ifname, sizeof(t->ifname), "gif%u", ifnum);
+	t->local = mkkey("23.30.150.141");
+	t->remote = remote;
+	if (up)
+		assert(uptunnel(t, 0, 0, 0) == 0);
+	if (tunnels != NULL)
+		ipmapinsert(tunnels, remote, 32, t);
+
+	return t;
+}
+
+// Takes the lowest free interface number.
+unsigned int
+takeif(Bitvec *interfaces)
+{
+	unsigned int ifnum = nextbit(interfaces);
+
+	bitset(interfaces, ifnum);
+
+	return ifnum;
+}
@@ -0,0 +1,68 @@
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+int failed;
+
+void
+test(const char *expected, const char *fmt, ...)
+{
+	char buf[64];
+	va_list ap;
+	size_t n;
+
+	va_start(ap, fmt);
+	n = vlogfmt(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (strcmp(buf, expected) != 0 || n != strlen(buf)) {
+		printf("vlogfmt(\"%s\") = \"%s\" (%zu), want \"%s\"\n",
+		    fmt, buf, n, expected);
+		failed = 1;
+	}
+}
+
+int
+main(void)
+{
+	uint64_t big = 18446744073709551615ULL;
+	char longer[100];
+
+	test("44.0.0.1/8 -> 10.0.0.1", "%I/%zu -> %I",
+	    mkkey("44.0.0.1"), (size_t)8, mkkey("10.0.0.1"));
+	test("[     1.2.3.4]", "[%12I]", mkkey("1.2.3.4"));
+	test("[1.2.3.4     ]", "[%-12I]", mkkey("1.2.3.4"));
+	test("0.0.0.0 255.255.255.255", "%I %I", 0, 0xFFFFFFFF);
+	test("-7 42 0x2a 052 c", "%d %u %#x %#o %c", -7, 42U, 42U, 42U, 'c');
+	test("18446744073709551615", "%" PRIu64, big);
+	test("-3 4 5", "%ld %lld %jd", -3L, 4LL, (intmax_t)5);
+	test("[  ab] [ab  ]", "[%*s] [%-*s]", 4, "ab", 4, "ab");
+	test("[abc]", "[%.*s]", 3, "abcdef");
+	test("100%", "%d%%", 100);
+	test("1.50", "%.2f", 1.5);
+	errno = ENOENT;
+	test(strerror(ENOENT), "%m");
+	assert(errno == ENOENT);
+
+	// Messages too long are cut short.
+	memset(longer, 'x', sizeof(longer) - 1);
+	longer[sizeof(longer) - 1] = '\0';
+	longer[63] = '\0';
+	test(longer, "%s%s", longer, longer);
+
+	// Below the level, arguments are not even evaluated.
+	loglevel = LOG_INFO;
+	debug("%d", (abort(), 0));
+
+	return failed;
+}
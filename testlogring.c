@@ -0,0 +1,138 @@
+#include <sys/types.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+enum {
+	NTHREADS = 4,
+	NPERTHREAD = 500,
+};
+
+char path[] = "/tmp/testlogring.XXXXXX";
+Logsite site = { "testlogring.c", 1 };
+
+// Returns the number of lines logged so far, and whether `want` is the last.
+size_t
+lines(const char *want, int *last)
+{
+	char buf[MAX_LOG_MSG + 64];
+	FILE *fp;
+	size_t n = 0;
+
+	fp = fopen(path, "r");
+	assert(fp != NULL);
+	*last = 0;
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		n++;
+		*last = (want != NULL && strstr(buf, want) != NULL);
+	}
+	fclose(fp);
+
+	return n;
+}
+
+// Returns the value of a counter from the logger's stats.
+uint64_t
+logstat(const char *name)
+{
+	char buf[128], key[64];
+	unsigned long long v;
+	FILE *fp = tmpfile();
+
+	assert(fp != NULL);
+	statslog(fp);
+	rewind(fp);
+	while (fgets(buf, sizeof(buf), fp) != NULL)
+		if (sscanf(buf, "%63s %llu", key, &v) == 2 &&
+		    strcmp(key, name) == 0) {
+			fclose(fp);
+			return v;
+		}
+	fclose(fp);
+	abort();
+}
+
+void *
+producer(void *idp)
+{
+	int id = (intptr_t)idp;
+
+	for (int k = 0; k < NPERTHREAD; k++)
+		info("thread %d message %d from %I", id, k, mkkey("44.0.0.1"));
+
+	return NULL;
+}
+
+int
+main(void)
+{
+	pthread_t tids[NTHREADS];
+	size_t n;
+	int fd, last;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+	startlogger(path, 0);
+
+	// Nothing is written until the ring is drained.
+	for (int k = 0; k < 10; k++)
+		info("message %d", k);
+	assert(lines(NULL, &last) == 0);
+	logdrain();
+	assert(lines("message 9", &last) == 10 && last);
+
+	// Threads log at once without losing anything.
+	for (int k = 0; k < NTHREADS; k++)
+		assert(pthread_create(&tids[k], NULL, producer,
+		    (void *)(intptr_t)k) == 0);
+	for (int k = 0; k < NTHREADS; k++)
+		pthread_join(tids[k], NULL);
+	logdrain();
+	assert(lines(NULL, &last) == 10 + NTHREADS*NPERTHREAD);
+	assert(logstat("log_records") == 10 + NTHREADS*NPERTHREAD);
+
+	// When the ring is full, chatter is dropped,
+	for (int k = 0; k < LOG_RING + 5; k++)
+		info("filler %d", k);
+	assert(logstat("log_dropped") == 5);
+	assert(logstat("log_depth") == LOG_RING);
+
+	// but a notice is written through, after what was there.
+	notice("the ring was full");
+	assert(logstat("log_writethrough") == 1 && logstat("log_depth") == 0);
+	n = lines("the ring was full", &last);
+	assert(n == 10 + NTHREADS*NPERTHREAD + LOG_RING + 1 && last);
+
+	// A rate-limited site logs a burst a period,
+	for (int k = 0; k < LOG_BURST; k++)
+		assert(logallow(&site, LOG_NOTICE, k, 1000));
+	assert(!logallow(&site, LOG_NOTICE, LOG_BURST, 1000));
+	// and after that, nothing about the same keys for a while.
+	assert(!logallow(&site, LOG_NOTICE, 0, 1000 + LOG_PERIOD));
+	assert(logallow(&site, LOG_NOTICE, 100, 1000 + LOG_PERIOD));
+	assert(logallow(&site, LOG_NOTICE, 0, 1000 + LOG_KEY_QUIET));
+	assert(logstat("log_suppressed") == 2);
+	assert(logstat("log_summaries") == 2);
+
+	// Sites that went quiet are summarized when asked.
+	assert(!logallow(&site, LOG_NOTICE, 0, 1000 + LOG_KEY_QUIET));
+	logsummary(1000 + LOG_KEY_QUIET + LOG_PERIOD - 1);
+	assert(logstat("log_summaries") == 2);
+	logsummary(1000 + LOG_KEY_QUIET + LOG_PERIOD);
+	assert(logstat("log_summaries") == 3);
+	logdrain();
+	assert(lines("suppressed 1 similar messages", &last) == n + 3 && last);
+	unlink(path);
+
+	return 0;
+}
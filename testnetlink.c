@@ -0,0 +1,293 @@
+/*
+ * Exercises the Linux rtnetlink backend in a private user and
+ * network namespace, so no privileges are needed.  Skipped
+ * where unprivileged namespaces are not available.
+ */
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+enum {
+	RTABLE = 44,
+	NROUTES = 1000,
+	RTPROT_44RIPD = 44,
+};
+
+Route routes[NROUTES];
+
+// Returns the value of a counter from the backend's statistics.
+uint64_t
+counter(const char *name)
+{
+	char *buf = NULL, line[128];
+	size_t size = 0;
+	uint64_t val = 0;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &size);
+	assert(fp != NULL);
+	statsbackend(fp);
+	fclose(fp);
+	fp = fmemopen(buf, size, "r");
+	assert(fp != NULL);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char key[64];
+		unsigned long long v;
+
+		if (sscanf(line, "%63s %llu", key, &v) == 2 &&
+		    strcmp(key, name) == 0)
+			val = v;
+	}
+	fclose(fp);
+	free(buf);
+
+	return val;
+}
+
+// Counts our routes in the table by dumping it.
+int
+countroutes(void)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct rtmsg rtm;
+	} req;
+	char buf[32*1024];
+	int fd, n, done;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	assert(fd >= 0);
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = RTM_GETROUTE;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.rtm.rtm_family = AF_INET;
+	assert(send(fd, &req, sizeof(req), 0) == sizeof(req));
+	n = 0;
+	for (done = 0; !done; ) {
+		ssize_t len = recv(fd, buf, sizeof(buf), 0);
+		struct nlmsghdr *nh;
+
+		assert(len > 0);
+		for (nh = (struct nlmsghdr *)buf;
+		    NLMSG_OK(nh, (size_t)len);
+		    nh = NLMSG_NEXT(nh, len))
+		{
+			struct rtmsg *rtm = NLMSG_DATA(nh);
+			struct rtattr *rta;
+			int rtalen;
+			uint32_t table;
+
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				done = 1;
+				break;
+			}
+			assert(nh->nlmsg_type == RTM_NEWROUTE);
+			if (rtm->rtm_protocol != RTPROT_44RIPD)
+				continue;
+			table = rtm->rtm_table;
+			rtalen = RTM_PAYLOAD(nh);
+			for (rta = RTM_RTA(rtm); RTA_OK(rta, rtalen);
+			    rta = RTA_NEXT(rta, rtalen))
+				if (rta->rta_type == RTA_TABLE)
+					memmove(&table, RTA_DATA(rta), sizeof(table));
+			if (table == RTABLE)
+				n++;
+		}
+	}
+	close(fd);
+
+	return n;
+}
+
+void
+uplo(void)
+{
+	struct ifreq ifr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(fd >= 0);
+	memset(&ifr, 0, sizeof(ifr));
+	strlcpy(ifr.ifr_name, "lo", sizeof(ifr.ifr_name));
+	assert(ioctl(fd, SIOCGIFFLAGS, &ifr) == 0);
+	ifr.ifr_flags |= IFF_UP;
+	assert(ioctl(fd, SIOCSIFFLAGS, &ifr) == 0);
+	close(fd);
+}
+
+void
+findtunnel(Kif *kif, void *tp)
+{
+	Tunnel *t = tp;
+
+	if (strcmp(kif->ifname, t->ifname) == 0 && kif->ifindex == t->ifindex &&
+	    kif->local == t->local && kif->remote == t->remote)
+		t->nref++;
+}
+
+void
+findpeer(Kroute *kr, void *tp)
+{
+	Tunnel *t = tp;
+
+	if (kr->ifindex == t->ifindex && kr->gateway == t->remote)
+		t->nref++;
+}
+
+void
+countlo(Kroute *kr, void *np)
+{
+	if (kr->ifindex == if_nametoindex("lo") &&
+	    netmask2cidr(kr->subnetmask) == 24 && (kr->ipnet >> 24) == 44)
+		++*(int *)np;
+}
+
+// Brings a real ipip tunnel up and down, if the kernel has ipip.
+void
+testtunnel(void)
+{
+	Tunnel t, mp, peer;
+	Route r;
+	pid_t pid;
+	int status;
+
+	pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		memset(&t, 0, sizeof(t));
+		strlcpy(t.ifname, "gif7", sizeof(t.ifname));
+		t.local = mkkey("127.0.0.1");
+		t.remote = mkkey("127.0.0.2");
+		uptunnel(&t, RTABLE, RTABLE, mkkey("44.44.48.1"));
+		if (t.ifindex == 0 || if_nametoindex("gif7") != t.ifindex)
+			_exit(2);
+		if (scantunnels(findtunnel, &t) < 1 || t.nref != 1)
+			_exit(2);
+		t.remote = mkkey("127.0.0.3");
+		if (retunnel(&t) < 0 || scantunnels(findtunnel, &t) < 1 ||
+		    t.nref != 2)
+			_exit(2);
+		downtunnel(&t);
+		if (if_nametoindex("gif7") != 0)
+			_exit(2);
+
+		// A multipoint tunnel, with a route via a peer on it.
+		memset(&mp, 0, sizeof(mp));
+		strlcpy(mp.ifname, "ampr0", sizeof(mp.ifname));
+		mp.local = mkkey("127.0.0.1");
+		uptunnel(&mp, RTABLE, RTABLE, mkkey("44.44.48.1"));
+		if (scantunnels(findtunnel, &mp) < 1 || mp.nref != 1)
+			_exit(2);
+		peer = mp;
+		peer.remote = mkkey("127.0.0.4");
+		peer.multipoint = 1;
+		peer.nref = 0;
+		memset(&r, 0, sizeof(r));
+		r.ipnet = mkkey("44.9.9.0");
+		r.subnetmask = cidr2netmask(24);
+		addroute(&r, &peer, RTABLE);
+		sysflush();
+		if (scanroutes(RTABLE, findpeer, &peer) < 1 || peer.nref != 1)
+			_exit(2);
+		downtunnel(&mp);
+		_exit(0);
+	}
+	assert(waitpid(pid, &status, 0) == pid);
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 2) {
+		fprintf(stderr, "tunnel not configured correctly\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		fprintf(stderr, "testnetlink: no ipip, skipping tunnels\n");
+}
+
+int
+main(void)
+{
+	Tunnel lo, nowhere;
+	int n;
+
+	if (unshare(CLONE_NEWUSER | CLONE_NEWNET) < 0) {
+		fprintf(stderr, "testnetlink: unshare: %s, skipping\n",
+		    strerror(errno));
+		return 0;
+	}
+	uplo();
+	assert(setbackend("kernel") == 0);
+	initsys(RTABLE);
+	testtunnel();
+
+	memset(&lo, 0, sizeof(lo));
+	strlcpy(lo.ifname, "lo", sizeof(lo.ifname));
+	for (int k = 0; k < NROUTES; k++) {
+		routes[k].ipnet = 0x2C000000 | k << 8;	// 44.0.0.0/8
+		routes[k].subnetmask = cidr2netmask(24);
+		routes[k].gateway = mkkey("127.0.0.2");
+		addroute(&routes[k], &lo, RTABLE);
+	}
+	expect("sends before flush", counter("netlink_sends"), 0);
+	sysflush();
+	sysinput();
+	expect("routes", countroutes(), NROUTES);
+	expect("messages", counter("netlink_messages"), NROUTES);
+	if (counter("netlink_sends") > 2) {
+		fprintf(stderr, "%llu sends for %d routes\n",
+		    (unsigned long long)counter("netlink_sends"), NROUTES);
+		exit(EXIT_FAILURE);
+	}
+	expect("acks", counter("netlink_acks"), counter("netlink_batches"));
+	expect("errors", counter("netlink_errors"), 0);
+	n = 0;
+	scanroutes(RTABLE, countlo, &n);
+	expect("routes found", n, NROUTES);
+
+	// Changing a route replaces it.
+	for (int k = 0; k < NROUTES; k += 2)
+		chroute(&routes[k], &lo, RTABLE);
+	sysflush();
+	sysinput();
+	expect("routes after change", countroutes(), NROUTES);
+	expect("errors after change", counter("netlink_errors"), 0);
+
+	// Removing a route twice is not an error.
+	for (int k = 0; k < NROUTES; k++)
+		rmroute(&routes[k], RTABLE);
+	rmroute(&routes[0], RTABLE);
+	sysflush();
+	sysinput();
+	expect("routes after remove", countroutes(), 0);
+	expect("errors after remove", counter("netlink_errors"), 0);
+
+	// Failures are reported asynchronously, without stopping the batch.
+	memset(&nowhere, 0, sizeof(nowhere));
+	strlcpy(nowhere.ifname, "nowhere0", sizeof(nowhere.ifname));
+	nowhere.ifindex = 9999;
+	addroute(&routes[0], &nowhere, RTABLE);
+	addroute(&routes[1], &lo, RTABLE);
+	sysflush();
+	sysinput();
+	expect("routes after failure", countroutes(), 1);
+	expect("errors after failure", counter("netlink_errors"), 1);
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+enum {
+	NENTRIES = 25,
+	LEN = NENTRIES*RIP_RESPONSE_SIZE,
+};
+
+Pktcache cache;
+octet pkt[LEN];
+Route rts[NENTRIES];
+Route *refreshed[NENTRIES];
+
+int
+main(void)
+{
+	uint64_t h, h2;
+	Pktent *e;
+
+	srandom(44);
+	for (int k = 0; k < LEN; k++)
+		pkt[k] = random();
+	for (int k = 0; k < NENTRIES; k++)
+		refreshed[k] = &rts[k];
+	h = pkthash(pkt, LEN);
+	assert(h == pkthash(pkt, LEN));
+
+	// Nothing until it is filled.
+	assert(pktlookup(&cache, h, pkt, LEN, 1) == NULL);
+	assert(cache.misses == 1);
+	pktfill(&cache, h, pkt, LEN, 1, refreshed, NENTRIES);
+	e = pktlookup(&cache, h, pkt, LEN, 1);
+	assert(e != NULL && cache.hits == 1);
+	assert(e->nroutes == NENTRIES && e->routes[3] == &rts[3]);
+
+	// Once the table changes, it is of no use.
+	assert(pktlookup(&cache, h, pkt, LEN, 2) == NULL && cache.stale == 1);
+
+	// Any change to the datagram is a different datagram,
+	pkt[LEN - 1] ^= 1;
+	h2 = pkthash(pkt, LEN);
+	assert(h2 != h);
+	assert(pktlookup(&cache, h2, pkt, LEN, 1) == NULL);
+
+	// even if it hashes the same.
+	assert(pktlookup(&cache, h, pkt, LEN, 1) == NULL);
+	assert(pktlookup(&cache, h, pkt, LEN - RIP_RESPONSE_SIZE, 1) == NULL);
+	pkt[LEN - 1] ^= 1;
+	assert(pktlookup(&cache, h, pkt, LEN, 1) != NULL);
+
+	// Forgetting another datagram leaves it alone.
+	pktforget(&cache, h + PKTCACHE_SLOTS);
+	assert(pktlookup(&cache, h, pkt, LEN, 1) != NULL);
+	pktforget(&cache, h);
+	assert(pktlookup(&cache, h, pkt, LEN, 1) == NULL);
+
+	// A datagram takes over its slot.
+	pktfill(&cache, h, pkt, LEN, 1, refreshed, NENTRIES);
+	pkt[0] ^= 1;
+	pktfill(&cache, h + PKTCACHE_SLOTS, pkt, LEN/2, 3, refreshed, 2);
+	assert(pktlookup(&cache, h + PKTCACHE_SLOTS, pkt, LEN/2, 3) != NULL);
+	pkt[0] ^= 1;
+	assert(pktlookup(&cache, h, pkt, LEN, 1) == NULL);
+
+	return 0;
+}
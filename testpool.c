@@ -0,0 +1,102 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+enum {
+	NPEERS = 8,
+	NOW = 1000000,
+};
+
+Bitvec *interfaces;
+
+void
+verify(Tunnel *t)
+{
+	IPMap *routes = mkipmap(), *tunnels = mkipmap();
+
+	ipmapinsert(tunnels, t->remote, 32, t);
+	assert(simverify(routes, tunnels) == 0);
+	freeipmap(routes, NULL);
+	freeipmap(tunnels, NULL);
+}
+
+int
+main(void)
+{
+	Tunpool pool;
+	Tunnel *t, *peers[NPEERS];
+	uint32_t base = mkkey("10.0.0.1");
+
+	assert(setbackend("sim") == 0);
+	initsys(0);
+	interfaces = mkbitvec();
+
+	// Nothing parked.
+	initpool(&pool, 4, interfaces);
+	assert(unpark(&pool, base) == NULL && pool.misses == 1);
+
+	// A peer that returns gets its own interface back.
+	t = newtunnel(takeif(interfaces), base, 1, NULL);
+	park(&pool, t, NOW);
+	assert(pool.nparked == 1 && bitget(interfaces, t->ifnum));
+	assert(unpark(&pool, base) == t && pool.reuses == 1);
+	verify(t);
+
+	// Another peer gets it re-pointed, without a new interface.
+	park(&pool, t, NOW);
+	assert(unpark(&pool, base + 1) == t && t->remote == base + 1);
+	assert(pool.repoints == 1 && pool.nparked == 0);
+	verify(t);
+	assert(nextbit(interfaces) == 1);
+
+	// The longest parked makes room, and is the one re-pointed.
+	peers[0] = t;
+	for (int k = 1; k < NPEERS; k++)
+		peers[k] = newtunnel(takeif(interfaces), base + 1 + k, 1, NULL);
+	for (int k = 0; k < NPEERS; k++)
+		park(&pool, peers[k], NOW + k);
+	assert(pool.nparked == 4 && pool.ndoomed == 4);
+	poolflush(&pool);
+	assert(pool.destroys == 4);
+	for (int k = 0; k < NPEERS - 4; k++)
+		assert(!bitget(interfaces, k));
+	assert(unpark(&pool, base + 100) == peers[4]);
+	park(&pool, peers[4], NOW + NPEERS);
+
+	// Idle interfaces go, down to the low-water mark.
+	prunepool(&pool, NOW + POOL_IDLE - 1);
+	assert(pool.nparked == 4);
+	prunepool(&pool, NOW + NPEERS + POOL_IDLE);
+	poolflush(&pool);
+	assert(pool.nparked == 1 && pool.parked == peers[4]);
+	assert(bitget(interfaces, peers[4]->ifnum));
+	drainpool(&pool);
+	assert(pool.nparked == 0 && nextbit(interfaces) == 0);
+
+	// Without a pool, interfaces are destroyed at the end of the cycle,
+	initpool(&pool, 0, interfaces);
+	t = newtunnel(takeif(interfaces), base, 1, NULL);
+	park(&pool, t, NOW);
+	assert(pool.nparked == 0 && pool.ndoomed == 1);
+	poolflush(&pool);
+	assert(pool.destroys == 1 && nextbit(interfaces) == 0);
+
+	// unless the peer comes back within it.
+	t = newtunnel(takeif(interfaces), base, 1, NULL);
+	park(&pool, t, NOW);
+	assert(unpark(&pool, base) == t && pool.revivals == 1);
+	poolflush(&pool);
+	assert(pool.destroys == 1 && pool.ndoomed == 0);
+	verify(t);
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+
+// Returns the value of a counter from the profiler's stats.
+uint64_t
+profstat(const char *name)
+{
+	char buf[128], key[64];
+	unsigned long long v;
+	FILE *fp = tmpfile();
+
+	assert(fp != NULL);
+	statsprof(fp);
+	rewind(fp);
+	while (fgets(buf, sizeof(buf), fp) != NULL)
+		if (sscanf(buf, "%63s %llu", key, &v) == 2 &&
+		    strcmp(key, name) == 0) {
+			fclose(fp);
+			return v;
+		}
+	fclose(fp);
+	abort();
+}
+
+int
+main(void)
+{
+	uint64_t t0;
+
+	// Off by default, and then nothing is timed.
+	t0 = profstart();
+	assert(t0 == 0);
+	profend(STAGE_PARSE, t0);
+
+	profiling = 1;
+	t0 = profstart();
+	assert(t0 != 0);
+	profend(STAGE_PARSE, t0);
+	assert(profstat("prof_parse_count") == 1);
+	assert(profstat("prof_auth_count") == 0);
+
+	profadd(STAGE_EXPIRE, 0);
+	profadd(STAGE_EXPIRE, 1000);
+	profadd(STAGE_EXPIRE, 5000);
+	profadd(STAGE_EXPIRE, (uint64_t)1 << 50);
+	assert(profstat("prof_expire_count") == 4);
+	assert(profstat("prof_expire_ns_total") == 6000 + ((uint64_t)1 << 50));
+	assert(profstat("prof_expire_ns_max") == (uint64_t)1 << 50);
+
+	// Dumping leaves the counts be, unless asked to reset them.
+	profdump(0);
+	assert(profstat("prof_expire_count") == 4);
+	profdump(1);
+	assert(profstat("prof_expire_count") == 0);
+	assert(profstat("prof_expire_ns_max") == 0);
+	assert(profstat("prof_parse_count") == 0);
+
+	return 0;
+}
@@ -0,0 +1,137 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+enum {
+	NROUTES = 2000,
+};
+
+IPMap *routes;
+IPMap *tunnels;
+
+Route *
+route(uint32_t ipnet, Tunnel *t)
+{
+	Route *r = calloc(1, sizeof(*r));
+
+	assert(r != NULL);
+	r->ipnet = ipnet;
+	r->subnetmask = cidr2netmask(24);
+	r->tunnel = t;
+	r->gateway = t->remote;
+	ipmapinsert(routes, r->ipnet, 24, r);
+	assert(addroute(r, t, 0) == 0);
+
+	return r;
+}
+
+void
+check(int want)
+{
+	int bad = simverify(routes, tunnels);
+
+	if (bad != want) {
+		fprintf(stderr, "simverify: %d discrepancies, want %d\n",
+		    bad, want);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void
+run(Reconciler *rc)
+{
+	reconcilestart(rc);
+	assert(rc->phase != 0);
+	while (rc->phase != 0)
+		reconcilestep(rc);
+}
+
+int
+main(void)
+{
+	Reconciler rc;
+	Tunnel *a, *b, *foreign;
+	Route *r[NROUTES], stray, alien;
+
+	routes = mkipmap();
+	tunnels = mkipmap();
+	assert(setbackend("sim") == 0);
+	initsys(0);
+	a = newtunnel(0, mkkey("141.75.245.225"), 1, tunnels);
+	b = newtunnel(1, mkkey("87.20.94.119"), 1, tunnels);
+	for (int k = 0; k < NROUTES; k++)
+		r[k] = route(0x2C000000 | k << 8, (k & 1) ? b : a);
+	check(0);
+	initreconcile(&rc, routes, tunnels, 0, 0);
+
+	// Nothing to do.
+	run(&rc);
+	expect("runs", rc.runs, 1);
+	expect("checked", rc.checked, 2*NROUTES);
+	expect("clean missing", rc.missing, 0);
+	expect("clean moved", rc.moved, 0);
+	expect("clean stale", rc.stale, 0);
+	if (rc.steps < 2*NROUTES/RECONCILE_CHUNK) {
+		fprintf(stderr, "%llu steps for %d entries\n",
+		    (unsigned long long)rc.steps, 2*NROUTES);
+		exit(EXIT_FAILURE);
+	}
+
+	// Drift behind our back.
+	assert(rmroute(r[0], 0) == 0);
+	assert(rmroute(r[2], 0) == 0);
+	assert(chroute(r[4], b, 0) == 0);
+	memset(&stray, 0, sizeof(stray));
+	stray.ipnet = mkkey("44.128.0.0");
+	stray.subnetmask = cidr2netmask(16);
+	assert(addroute(&stray, a, 0) == 0);
+	check(4);
+
+	// Someone else's route on someone else's interface.
+	foreign = newtunnel(99, mkkey("10.0.0.1"), 1, NULL);
+	memset(&alien, 0, sizeof(alien));
+	alien.ipnet = mkkey("44.129.0.0");
+	alien.subnetmask = cidr2netmask(16);
+	assert(addroute(&alien, foreign, 0) == 0);
+
+	run(&rc);
+	expect("missing", rc.missing, 2);
+	expect("moved", rc.moved, 1);
+	expect("stale", rc.stale, 1);
+	check(2);	// The alien route and its interface.
+	assert(rmroute(&alien, 0) == 0);
+	assert(downtunnel(foreign) == 0);
+	check(0);
+
+	// Routes refreshed since the snapshot are left for next time.
+	assert(rmroute(r[6], 0) == 0);
+	r[6]->refreshed = time(NULL) + 1;
+	run(&rc);
+	expect("refreshed missing", rc.missing, 2);
+	r[6]->refreshed = 0;
+	run(&rc);
+	expect("next run missing", rc.missing, 3);
+
+	// A large repair is spread over steps within the budget.
+	for (int k = 0; k < NROUTES; k++)
+		assert(rmroute(r[k], 0) == 0);
+	rc.steps = 0;
+	run(&rc);
+	expect("bulk missing", rc.missing, 3 + NROUTES);
+	if (rc.steps < NROUTES/RECONCILE_OPS || rc.deferred == 0) {
+		fprintf(stderr, "%d repairs in %llu steps\n", NROUTES,
+		    (unsigned long long)rc.steps);
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
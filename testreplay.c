@@ -0,0 +1,140 @@
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "fns.h"
+
+const char *PASSWORD = "pLaInTeXtpAsSwD";
+
+typedef struct Count Count;
+struct Count {
+	int npkts;
+	int nentries;
+	uint64_t lastts;
+};
+
+void
+count(const octet *packet, size_t len, uint64_t ts, void *arg)
+{
+	Count *c = arg;
+	RIPPacket pkt;
+
+	memset(&pkt, 0, sizeof(pkt));
+	if (parserippkt(packet, len, &pkt) < 0) {
+		fprintf(stderr, "packet %d: parse error\n", c->npkts);
+		exit(EXIT_FAILURE);
+	}
+	if (verifyripauth(&pkt, PASSWORD) < 0) {
+		fprintf(stderr, "packet %d: authentication failed\n", c->npkts);
+		exit(EXIT_FAILURE);
+	}
+	for (int k = 0; k < pkt.nresponse; k++) {
+		RIPResponse response;
+		assert(parseripresponse(&pkt, k, &response) == 0);
+		assert((response.ipaddr >> 24) == 44);
+	}
+	assert(ts >= c->lastts);
+	c->lastts = ts;
+	c->npkts++;
+	c->nentries += pkt.nresponse;
+}
+
+void
+testtext(void)
+{
+	Count c;
+
+	memset(&c, 0, sizeof(c));
+	if (readcapture("testdata/data.tcpdump", count, &c) != 69) {
+		fprintf(stderr, "data.tcpdump: read %d packets\n", c.npkts);
+		exit(EXIT_FAILURE);
+	}
+	// 66 full datagrams of 24 routes and 3 of 3 routes.
+	assert(c.nentries == 66*24 + 3*3);
+}
+
+/*
+ * Writes an Ethernet pcap holding a RIP datagram from
+ * data.tcpdump followed by a datagram to another port.
+ */
+void
+testpcap(void)
+{
+	static const octet hdr[] = {
+		0xD4, 0xC3, 0xB2, 0xA1, 2, 0, 4, 0,
+		0, 0, 0, 0, 0, 0, 0, 0,
+		0xFF, 0xFF, 0, 0, 1, 0, 0, 0,
+	};
+	octet payload[64], frame[128];
+	char path[] = "/tmp/testreplay.XXXXXX";
+	size_t plen, flen;
+	FILE *fp;
+	Count c;
+	int fd;
+
+	memset(payload, 0, sizeof(payload));
+	payload[0] = 2;
+	payload[1] = 2;
+	payload[4] = payload[5] = 0xFF;
+	payload[7] = 2;
+	memmove(payload + 8, PASSWORD, strlen(PASSWORD));
+	plen = 4 + 2*RIP_RESPONSE_SIZE;
+	payload[24 + 1] = 2;
+	payload[24 + 4] = 44;
+	payload[24 + 8] = payload[24 + 9] = 0xFF;
+	payload[24 + 12] = 192;
+	payload[24 + 15] = 1;
+
+	memset(frame, 0, sizeof(frame));
+	frame[12] = 0x08;			// Ethertype IPv4.
+	frame[14] = 0x45;
+	flen = 14 + 20 + 8 + plen;
+	frame[14 + 2] = (flen - 14) >> 8;
+	frame[14 + 3] = (flen - 14) & 0xFF;
+	frame[14 + 9] = 17;			// UDP.
+	frame[34 + 1] = 0x08;			// Source port 520.
+	frame[34 + 3] = 0x08;			// Destination port 520.
+	frame[34 + 0] = frame[34 + 2] = 0x02;
+	memmove(frame + 42, payload, plen);
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	fp = fdopen(fd, "w");
+	fwrite(hdr, sizeof(hdr), 1, fp);
+	for (int k = 0; k < 2; k++) {
+		octet rec[16];
+		memset(rec, 0, sizeof(rec));
+		rec[0] = 100 + k;
+		rec[8] = rec[12] = flen;
+		fwrite(rec, sizeof(rec), 1, fp);
+		fwrite(frame, flen, 1, fp);
+		frame[34 + 3] = 0x09;		// Port 521.
+	}
+	fclose(fp);
+
+	memset(&c, 0, sizeof(c));
+	if (readcapture(path, count, &c) != 1) {
+		fprintf(stderr, "pcap: read %d packets\n", c.npkts);
+		exit(EXIT_FAILURE);
+	}
+	assert(c.nentries == 1);
+	assert(c.lastts == 100ULL*1000000000);
+	unlink(path);
+}
+
+int
+main(void)
+{
+	testtext();
+	testpcap();
+
+	return 0;
+}
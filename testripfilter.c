@@ -0,0 +1,268 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "fns.h"
+
+#define nelem(a) (sizeof(a)/sizeof((a)[0]))
+
+const char *PASSWORD = "pLaInTeXtpAsSwD";
+
+typedef struct Case Case;
+struct Case {
+	const char *name;
+	octet command;
+	octet version;
+	uint16_t authfamily;
+	const char *password;
+	size_t nentries;
+	size_t extra;
+	int pass;
+};
+
+Case cases[] = {
+	{ "good", 2, 2, 0xFFFF, "pLaInTeXtpAsSwD", 25, 0, 1 },
+	{ "one entry", 2, 2, 0xFFFF, "pLaInTeXtpAsSwD", 1, 0, 1 },
+	{ "auth only", 2, 2, 0xFFFF, "pLaInTeXtpAsSwD", 0, 0, 1 },
+	{ "request", 1, 2, 0xFFFF, "pLaInTeXtpAsSwD", 25, 0, 0 },
+	{ "ripv1", 2, 1, 0xFFFF, "pLaInTeXtpAsSwD", 25, 0, 0 },
+	{ "ragged", 2, 2, 0xFFFF, "pLaInTeXtpAsSwD", 25, 7, 0 },
+	{ "no auth", 2, 2, 0x0002, "pLaInTeXtpAsSwD", 25, 0, 0 },
+	{ "bad password", 2, 2, 0xFFFF, "pLaInTeXtpAsSwd", 25, 0, 0 },
+	{ "short password", 2, 2, 0xFFFF, "pLaInTeXtpAsSw", 25, 0, 0 },
+	{ "header only", 2, 2, 0xFFFF, NULL, 0, 0, 0 },
+};
+
+size_t
+mkpacket(Case *c, octet *buf)
+{
+	size_t len;
+
+	memset(buf, 0, IP_MAXPACKET);
+	buf[0] = c->command;
+	buf[1] = c->version;
+	len = MIN_RIP_PACKET_SIZE;
+	if (c->password == NULL)
+		return len;
+	buf[len + 0] = c->authfamily >> 8;
+	buf[len + 1] = c->authfamily & 0xFF;
+	buf[len + 3] = RIP_AUTH_PASSWORD;
+	strncpy((char *)buf + len + 4, c->password, RIP_PASSWORD_SIZE);
+	len += RIP_RESPONSE_SIZE;
+	for (size_t k = 0; k < c->nentries; k++) {
+		octet *e = buf + len;
+		e[1] = AF_INET;
+		e[4] = 44;
+		e[5] = k;
+		e[8] = e[9] = e[10] = 0xFF;
+		e[12] = 192;
+		e[13] = 0;
+		e[14] = 2;
+		e[15] = k + 1;
+		e[19] = 1;
+		len += RIP_RESPONSE_SIZE;
+	}
+
+	return len + c->extra;
+}
+
+/*
+ * A minimal interpreter for the subset of classic BPF
+ * that mkripfilter emits.
+ */
+uint32_t
+runfilter(const Bpfinsn *prog, size_t n, const octet *pkt, size_t len)
+{
+	uint32_t a = 0, x = 0;
+
+	for (size_t pc = 0; pc < n; pc++) {
+		const Bpfinsn *in = &prog[pc];
+		switch (in->code) {
+		case 0x80:	// ld len
+			a = len;
+			break;
+		case 0x20:	// ld [k]
+			if (in->k + 4 > len)
+				return 0;
+			a = readnet32(pkt + in->k);
+			break;
+		case 0x28:	// ldh [k]
+			if (in->k + 2 > len)
+				return 0;
+			a = readnet16(pkt + in->k);
+			break;
+		case 0x30:	// ldb [k]
+			if (in->k + 1 > len)
+				return 0;
+			a = pkt[in->k];
+			break;
+		case 0x14:	// sub #k
+			a -= in->k;
+			break;
+		case 0x24:	// mul #k
+			a *= in->k;
+			break;
+		case 0x34:	// div #k
+			a /= in->k;
+			break;
+		case 0x07:	// tax
+			x = a;
+			break;
+		case 0x15:	// jeq #k
+			pc += (a == in->k) ? in->jt : in->jf;
+			break;
+		case 0x1d:	// jeq x
+			pc += (a == x) ? in->jt : in->jf;
+			break;
+		case 0x35:	// jge #k
+			pc += (a >= in->k) ? in->jt : in->jf;
+			break;
+		case 0x06:	// ret #k
+			return in->k;
+		default:
+			fprintf(stderr, "unknown opcode %#x at %zu\n",
+			    in->code, pc);
+			exit(EXIT_FAILURE);
+		}
+	}
+	fprintf(stderr, "filter fell off the end\n");
+	exit(EXIT_FAILURE);
+}
+
+// Checks that the filter agrees with the parser and verifier.
+void
+testinterp(const Bpfinsn *prog, size_t n)
+{
+	octet buf[IP_MAXPACKET + UDP_HEADER_SIZE];
+
+	for (size_t k = 0; k < nelem(cases); k++) {
+		Case *c = &cases[k];
+		RIPPacket pkt;
+		size_t len;
+		int pass, parsed;
+
+		memset(buf, 0, UDP_HEADER_SIZE);
+		len = mkpacket(c, buf + UDP_HEADER_SIZE);
+		pass = runfilter(prog, n, buf, len + UDP_HEADER_SIZE) != 0;
+		memset(&pkt, 0, sizeof(pkt));
+		parsed = parserippkt(buf + UDP_HEADER_SIZE, len, &pkt) == 0 &&
+		    verifyripauth(&pkt, PASSWORD) == 0;
+		if (pass != c->pass) {
+			fprintf(stderr, "%s: filter %s\n", c->name,
+			    pass ? "accepted" : "rejected");
+			exit(EXIT_FAILURE);
+		}
+		if (pass && !parsed) {
+			fprintf(stderr, "%s: filter accepted, daemon rejects\n",
+			    c->name);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+#ifdef __linux__
+/*
+ * Attaches the filter to a loopback socket and checks that
+ * only the datagrams we expect make it through the kernel.
+ */
+void
+testloopback(const Bpfinsn *prog, size_t n)
+{
+	struct sock_filter insns[MAX_RIP_FILTER];
+	struct sock_fprog fprog;
+	struct sockaddr_in sin;
+	socklen_t sinlen;
+	octet buf[IP_MAXPACKET];
+	int rd, wd, npass;
+
+	rd = socket(AF_INET, SOCK_DGRAM, 0);
+	wd = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(rd >= 0 && wd >= 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(rd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+	sinlen = sizeof(sin);
+	getsockname(rd, (struct sockaddr *)&sin, &sinlen);
+
+	for (size_t k = 0; k < n; k++) {
+		insns[k].code = prog[k].code;
+		insns[k].jt = prog[k].jt;
+		insns[k].jf = prog[k].jf;
+		insns[k].k = prog[k].k;
+	}
+	fprog.len = n;
+	fprog.filter = insns;
+	if (setsockopt(rd, SOL_SOCKET, SO_ATTACH_FILTER,
+	    &fprog, sizeof(fprog)) < 0)
+	{
+		perror("SO_ATTACH_FILTER");
+		exit(EXIT_FAILURE);
+	}
+
+	npass = 0;
+	for (size_t k = 0; k < nelem(cases); k++) {
+		size_t len = mkpacket(&cases[k], buf);
+		buf[2] = k;	// Tag the datagram with its case.
+		sendto(wd, buf, len, 0, (struct sockaddr *)&sin, sizeof(sin));
+		npass += cases[k].pass;
+	}
+	usleep(100*1000);
+	for (int k = 0; ; k++) {
+		ssize_t len = recv(rd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			assert(errno == EAGAIN || errno == EWOULDBLOCK);
+			if (k != npass) {
+				fprintf(stderr, "received %d of %d datagrams\n",
+				    k, npass);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		if (buf[2] >= nelem(cases) || !cases[buf[2]].pass) {
+			fprintf(stderr, "kernel passed %s\n",
+			    cases[buf[2]].name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	close(rd);
+	close(wd);
+}
+#endif  // __linux__
+
+int
+main(void)
+{
+	Bpfinsn prog[MAX_RIP_FILTER];
+	size_t n;
+
+	n = mkripfilter(PASSWORD, UDP_HEADER_SIZE, prog, nelem(prog));
+	assert(n > 0 && n <= MAX_RIP_FILTER);
+	testinterp(prog, n);
+#ifdef __linux__
+	testloopback(prog, n);
+#endif
+
+	// An impossibly long password rejects everything.
+	n = mkripfilter("0123456789abcdefg", UDP_HEADER_SIZE, prog, nelem(prog));
+	assert(n == 1 && prog[0].k == 0);
+
+	return 0;
+}
@@ -0,0 +1,164 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+enum {
+	NROUTES = 200,
+	RATE = 1000,
+	BURST = 10,
+};
+
+IPMap *routes;
+IPMap *tunnels;
+Sched s;
+Tunnel *t1, *t2;
+
+Route *
+route(uint32_t net, Tunnel *t)
+{
+	Route *r = calloc(1, sizeof(*r));
+
+	assert(r != NULL);
+	r->ipnet = net;
+	r->subnetmask = cidr2netmask(24);
+	r->tunnel = t;
+	ipmapinsert(routes, net, 24, r);
+
+	return r;
+}
+
+// Fills the bucket with n tokens.
+void
+grant(int n)
+{
+	s.refilled = nsec();
+	s.tokens = (uint64_t)n*1000000;
+}
+
+void
+check(void)
+{
+	scheddrain(&s);
+	assert(s.depth == 0);
+	assert(simverify(routes, tunnels) == 0);
+}
+
+int
+main(void)
+{
+	uint32_t net = mkkey("44.1.0.0");
+	Route *a, *b, *c, *d, *e;
+	uint64_t start;
+
+	assert(setbackend("sim") == 0);
+	initsys(0);
+	routes = mkipmap();
+	tunnels = mkipmap();
+	t1 = newtunnel(1, mkkey("10.0.0.1"), 1, tunnels);
+	t2 = newtunnel(2, mkkey("10.0.0.2"), 1, tunnels);
+
+	// Nothing reaches the kernel until it is run.
+	initsched(&s, 1, 1);
+	setsched(&s);
+	a = route(net, t1);
+	addroute(a, t1, 0);
+	assert(s.depth == 1 && schedwait(&s) == 0);
+	assert(schedrun(&s) == 1);
+	assert(s.depth == 0 && schedwait(&s) == -1);
+	check();
+
+	// New routes go before withdrawals, whatever the order asked.
+	b = route(net + 256, t1);
+	addroute(b, t1, 0);
+	grant(1);
+	assert(schedrun(&s) == 1);
+	ipmapremove(routes, a->ipnet, 24);
+	rmroute(a, 0);
+	c = route(net + 512, t2);
+	addroute(c, t2, 0);
+	refreshroute(b, t1, 0);
+	chroute(b, t2, 0);
+	b->tunnel = t2;
+	assert(s.depth == 3 && s.coalesced == 1);
+	grant(1);
+	assert(schedrun(&s) == 1);
+	assert(s.issued[PRIO_NEW] == 3 && s.issued[PRIO_WITHDRAW] == 0);
+
+	// The rest waits for tokens, and changes go before withdrawals.
+	assert(schedrun(&s) == 0);
+	assert(schedwait(&s) > 0 && schedwait(&s) <= 1000);
+	grant(1);
+	assert(schedrun(&s) == 1);
+	assert(s.issued[PRIO_CHANGE] == 1 && s.issued[PRIO_WITHDRAW] == 0);
+	check();
+	assert(s.issued[PRIO_WITHDRAW] == 1);
+	free(a);
+
+	// Only the net effect of the operations on a prefix is issued.
+	initsched(&s, 0, 0);
+	d = route(net + 768, t1);
+	addroute(d, t1, 0);
+	chroute(d, t2, 0);
+	d->tunnel = t2;
+	assert(s.depth == 1 && s.head[PRIO_NEW]->op == SCHED_ADD);
+	e = route(net + 1024, t1);
+	addroute(e, t1, 0);
+	rmroute(e, 0);
+	ipmapremove(routes, e->ipnet, 24);
+	free(e);
+	assert(s.depth == 1 && s.cancelled == 1);
+	chroute(b, t1, 0);
+	chroute(b, t2, 0);
+	assert(s.depth == 2 && s.head[PRIO_CHANGE]->tunnel.ifnum == 2);
+	rmroute(c, 0);
+	addroute(c, t1, 0);
+	c->tunnel = t1;
+	assert(s.depth == 3 && s.head[PRIO_NEW]->next->op == SCHED_CHANGE);
+	refreshroute(c, t1, 0);
+	rmroute(c, 0);
+	assert(s.depth == 3 && s.head[PRIO_WITHDRAW]->op == SCHED_REMOVE);
+	ipmapremove(routes, c->ipnet, 24);
+	free(c);
+	assert(s.coalesced == 6 && schedrun(&s) == 3);
+	check();
+
+	// A flood is spread out at the rate asked for.
+	initsched(&s, RATE, BURST);
+	for (int k = 0; k < NROUTES; k++) {
+		Route *r = route(mkkey("44.2.0.0") + k*256, t1);
+
+		addroute(r, t1, 0);
+	}
+	start = nsec();
+	while (s.depth > 0) {
+		schedrun(&s);
+		if (s.depth > 0)
+			poll(NULL, 0, schedwait(&s));
+	}
+	assert(nsec() - start >= (uint64_t)(NROUTES - BURST)*1000000000/RATE*3/4);
+	assert(s.issued[PRIO_NEW] == NROUTES && s.maxdepth == NROUTES);
+	check();
+
+	// Without a rate, everything goes at once.
+	initsched(&s, 0, 0);
+	for (int k = 0; k < NROUTES; k++) {
+		Route *r = ipmapfind(routes, mkkey("44.2.0.0") + k*256, 24);
+
+		chroute(r, t2, 0);
+		r->tunnel = t2;
+	}
+	assert(schedrun(&s) == NROUTES);
+	check();
+
+	return 0;
+}
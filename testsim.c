@@ -0,0 +1,148 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+IPMap *routes;
+IPMap *tunnels;
+
+Route *
+route(const char *net, const char *mask, Tunnel *t)
+{
+	Route *r = calloc(1, sizeof(*r));
+
+	assert(r != NULL);
+	r->ipnet = mkkey(net);
+	r->subnetmask = mkkey(mask);
+	r->tunnel = t;
+	r->gateway = t->remote;
+	ipmapinsert(routes, r->ipnet, mkkeylen(mask), r);
+
+	return r;
+}
+
+// Makes t a peer on the multipoint interface mp.
+void
+share(Tunnel *t, Tunnel *mp)
+{
+	t->multipoint = 1;
+	t->ifnum = mp->ifnum;
+	t->ifindex = mp->ifindex;
+	memmove(t->ifname, mp->ifname, sizeof(t->ifname));
+}
+
+void
+counttunnel(Kif *kif, void *np)
+{
+	Tunnel *t = ipmapfind(tunnels, kif->remote, 32);
+
+	assert(t != NULL && t->ifindex == kif->ifindex);
+	assert(strcmp(t->ifname, kif->ifname) == 0);
+	++*(int *)np;
+}
+
+void
+countroute(Kroute *kr, void *np)
+{
+	Route *r = ipmapfind(routes, kr->ipnet, netmask2cidr(kr->subnetmask));
+
+	assert(r != NULL && r->tunnel->ifindex == kr->ifindex);
+	assert(kr->gateway == (r->tunnel->multipoint ? r->tunnel->remote : 0));
+	++*(int *)np;
+}
+
+void
+check(int want)
+{
+	int bad = simverify(routes, tunnels);
+
+	if (bad != want) {
+		fprintf(stderr, "simverify: %d discrepancies, want %d\n",
+		    bad, want);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int
+main(void)
+{
+	Tunnel *a, *b, *c, *mp;
+	Route *r1, *r2;
+	uint64_t start;
+	int n;
+
+	routes = mkipmap();
+	tunnels = mkipmap();
+	assert(setbackend("kernel:route=1") < 0);
+	assert(setbackend("sim:bogus=1") < 0);
+	assert(setbackend("sim:route=2000") == 0);
+	assert(strcmp(backendname(), "sim") == 0);
+	initsys(0);
+
+	a = newtunnel(0, mkkey("141.75.245.225"), 0, tunnels);
+	b = newtunnel(1, mkkey("87.20.94.119"), 0, tunnels);
+	r1 = route("44.224.0.0", "255.254.0.0", a);
+	r2 = route("44.208.58.0", "255.255.255.240", a);
+	check(4);	// Two routes, two interfaces missing.
+
+	assert(uptunnel(a, 0, 0, 0) == 0);
+	assert(uptunnel(b, 0, 0, 0) == 0);
+	assert(uptunnel(b, 0, 0, 0) < 0);
+	start = nsec();
+	assert(addroute(r1, a, 0) == 0);
+	assert(nsec() - start >= 2000000);
+	assert(addroute(r2, a, 0) == 0);
+	assert(addroute(r2, a, 0) < 0);
+	check(0);
+
+	r2->tunnel = b;
+	check(1);
+	assert(chroute(r2, b, 0) == 0);
+	check(0);
+
+	// What a restarted daemon would find.
+	n = 0;
+	assert(scantunnels(counttunnel, &n) == 2 && n == 2);
+	n = 0;
+	assert(scanroutes(0, countroute, &n) == 2 && n == 2);
+
+	assert(rmroute(r1, 0) == 0);
+	assert(rmroute(r1, 0) == 0);
+	check(1);
+	assert(addroute(r1, a, 0) == 0);
+	check(0);
+
+	assert(setbackend("sim:route=0,fail=100") == 0);
+	assert(rmroute(r1, 0) < 0);
+	assert(downtunnel(b) < 0);
+	check(0);
+	assert(setbackend("sim:fail=0") == 0);
+	assert(downtunnel(b) == 0);
+	check(1);
+
+	// Peers on a multipoint interface are gateways on it.
+	assert(sysmultipoint());
+	mp = newtunnel(2, 0, 1, NULL);
+	c = newtunnel(3, mkkey("95.132.21.61"), 0, tunnels);
+	share(b, mp);
+	share(c, mp);
+	assert(chroute(r2, b, 0) == 0);
+	check(0);
+	n = 0;
+	assert(scanroutes(0, countroute, &n) == 2 && n == 2);
+	r2->tunnel = c;
+	r2->gateway = c->remote;
+	check(1);
+	assert(chroute(r2, c, 0) == 0);
+	check(0);
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+enum {
+	NEVENTS = 8,
+};
+
+int
+main(void)
+{
+	char path[] = "/tmp/testtrace.XXXXXX";
+	Traceev *events;
+	int fd;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	// Nothing is recorded until tracing starts.
+	trace(TRACE_PACKET, 0, 100, 0, 0);
+	assert(tracering == NULL);
+
+	starttrace(path, NEVENTS);
+	assert(memcmp(tracering->magic, TRACE_MAGIC, 8) == 0);
+	assert(tracering->nevents == NEVENTS && tracering->head == 0);
+	events = (Traceev *)(tracering + 1);
+
+	// The ring keeps the latest events.
+	for (uint32_t k = 0; k < NEVENTS + 3; k++)
+		trace(TRACE_ROUTE_ADD, mkkey("44.0.0.0") + k, 0xffffff00,
+		    mkkey("10.0.0.1"), k);
+	assert(tracering->head == NEVENTS + 3);
+	for (uint64_t pos = 3; pos < NEVENTS + 3; pos++) {
+		Traceev *ev = &events[pos % NEVENTS];
+
+		assert(ev->seq == pos + 1);
+		assert(ev->type == TRACE_ROUTE_ADD);
+		assert(ev->a == mkkey("44.0.0.0") + pos && ev->d == pos);
+		assert(ev->ns != 0);
+	}
+
+	// A restart with the same size carries on,
+	starttrace(path, NEVENTS);
+	assert(tracering->head == NEVENTS + 3);
+	events = (Traceev *)(tracering + 1);
+	trace(TRACE_TUNNEL_UP, mkkey("10.0.0.1"), 0, 7, 0);
+	assert(events[(NEVENTS + 3) % NEVENTS].type == TRACE_TUNNEL_UP);
+
+	// but one with another size starts afresh.
+	starttrace(path, 2*NEVENTS);
+	assert(tracering->head == 0 && tracering->nevents == 2*NEVENTS);
+	unlink(path);
+
+	return 0;
+}
@@ -0,0 +1,99 @@
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dat.h"
+#include "fns.h"
+#include "testfns.h"
+
+enum {
+	NSYNC = 50,
+	NTUNNELS = 200,
+	NWORKERS = 8,
+};
+
+Bitvec *interfaces;
+IPMap *tunnels;
+Tunnel *all[NSYNC + NTUNNELS];
+int nready;
+
+void
+ready(Tunnel *tunnel, int err)
+{
+	assert(err == 0 && tunnel->pending == 0 && tunnel->ifindex != 0);
+	nready++;
+}
+
+void
+check(void)
+{
+	IPMap *routes = mkipmap();
+
+	assert(simverify(routes, tunnels) == 0);
+	freeipmap(routes, NULL);
+}
+
+int
+main(void)
+{
+	uint32_t base = mkkey("10.0.0.1");
+	uint64_t start, tsync, tpool;
+	Tunnel *t;
+
+	assert(setbackend("sim:link=2000") == 0);
+	initsys(0);
+	interfaces = mkbitvec();
+	tunnels = mkipmap();
+
+	// Without workers, tunnels are up and ready on return.
+	initworkers(0, 0, 0, 0, ready);
+	start = nsec();
+	for (int k = 0; k < NSYNC; k++) {
+		all[k] = newtunnel(takeif(interfaces), base + k, 0, tunnels);
+		tunnelup(all[k]);
+		assert(all[k]->pending == 0 && nready == k + 1);
+	}
+	tsync = nsec() - start;
+	check();
+
+	// With them, tunnels come up together.
+	initworkers(NWORKERS, 0, 0, 0, ready);
+	start = nsec();
+	for (int k = NSYNC; k < NSYNC + NTUNNELS; k++) {
+		all[k] = newtunnel(takeif(interfaces), base + k, 0, tunnels);
+		tunnelup(all[k]);
+	}
+	tunnelsync(NULL);
+	tpool = nsec() - start;
+	assert(nready == NSYNC + NTUNNELS);
+	for (int k = 0; k < NSYNC + NTUNNELS; k++)
+		assert(all[k]->pending == 0 && all[k]->ifindex != 0);
+	check();
+	printf("%d tunnels: %.0f/s alone, %.0f/s with %d workers\n",
+	    NTUNNELS, NSYNC/(tsync/1e9), NTUNNELS/(tpool/1e9), NWORKERS);
+	assert(tpool/NTUNNELS*2 < tsync/NSYNC);
+
+	// Operations on one interface happen in order.
+	t = newtunnel(takeif(interfaces), base - 1, 0, tunnels);
+	tunnelup(t);
+	ipmapremove(tunnels, t->remote, 32);
+	tunneldestroy(t, interfaces);
+	tunnelsync(NULL);
+	check();
+
+	// Destroyed interfaces give back their numbers.
+	for (int k = 0; k < NSYNC + NTUNNELS; k++) {
+		ipmapremove(tunnels, all[k]->remote, 32);
+		tunneldestroy(all[k], interfaces);
+	}
+	tunnelsync(NULL);
+	check();
+	assert(nextbit(interfaces) == 0);
+
+	return 0;
+}
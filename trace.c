@@ -0,0 +1,108 @@
+/*
+ * Event tracing.  The ring lives in a shared mapping of a file,
+ * so the events survive the daemon crashing or being killed:
+ * the kernel writes the pages back on its own.  Any thread may
+ * add an event; a slot is claimed by bumping the head, and its
+ * sequence number is stored last, so a reader can tell a
+ * complete event from one overwritten or half written.
+ *
+ * Restarting with the same file and size carries on where the
+ * previous run left off.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "fns.h"
+
+Tracehdr *tracering;
+
+static Traceev *events;
+
+/*
+ * Maps the trace at `path`, making it `nevents` events long,
+ * and starts tracing.  Not to be called while other threads
+ * may be tracing.
+ */
+void
+starttrace(const char *path, size_t nevents)
+{
+	Tracehdr *hdr;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	if (nevents == 0 || (nevents & (nevents - 1)) != 0)
+		fatal("trace size %zu is not a power of two", nevents);
+	size = sizeof(Tracehdr) + nevents*sizeof(Traceev);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		fatal("cannot open trace file %s: %m", path);
+	if (fstat(fd, &st) < 0)
+		fatal("cannot stat trace file %s: %m", path);
+	if ((size_t)st.st_size != size && ftruncate(fd, size) < 0)
+		fatal("cannot size trace file %s: %m", path);
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		fatal("cannot map trace file %s: %m", path);
+	close(fd);
+	if (tracering != NULL)
+		munmap(tracering, sizeof(Tracehdr) +
+		    tracering->nevents*sizeof(Traceev));
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != TRACE_VERSION ||
+	    hdr->evsize != sizeof(Traceev) ||
+	    hdr->nevents != nevents)
+	{
+		memset(hdr, 0, size);
+		memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+		hdr->version = TRACE_VERSION;
+		hdr->evsize = sizeof(Traceev);
+		hdr->nevents = nevents;
+	}
+	events = (Traceev *)(hdr + 1);
+	tracering = hdr;
+}
+
+// Adds an event; use the trace macro, which checks first.
+void
+traceev(uint32_t type, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	struct timespec ts;
+	uint64_t pos;
+	Traceev *ev;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	pos = atomic_fetch_add_explicit(&tracering->head, 1,
+	    memory_order_relaxed);
+	ev = &events[pos & (tracering->nevents - 1)];
+	atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	ev->ns = (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+	ev->type = type;
+	ev->a = a;
+	ev->b = b;
+	ev->c = c;
+	ev->d = d;
+	atomic_store_explicit(&ev->seq, pos + 1, memory_order_release);
+}
+
+void
+statstrace(FILE *fp)
+{
+	if (tracering == NULL)
+		return;
+	fprintf(fp, "trace_events %" PRIu64 "\n",
+	    atomic_load_explicit(&tracering->head, memory_order_relaxed));
+	fprintf(fp, "trace_size %" PRIu64 "\n", tracering->nevents);
+}
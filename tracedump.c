@@ -0,0 +1,195 @@
+/*
+ * A program to print the events in a trace written by 44ripd
+ * -t, oldest first.  The trace may be read while the daemon is
+ * still writing it; events overwritten as we read are skipped.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "fns.h"
+
+static void printev(Traceev *ev);
+static const char *addr(uint32_t a, char buf[static INET_ADDRSTRLEN]);
+static const char *prefix(uint32_t ipnet, uint32_t subnetmask, char buf[static 32]);
+
+int
+main(int argc, char *argv[])
+{
+	Tracehdr *hdr;
+	Traceev *events;
+	struct stat st;
+	uint64_t head, first, count;
+	int ch, fd;
+
+	count = 0;
+	while ((ch = getopt(argc, argv, "n:?h")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = strnum(optarg);
+			break;
+		case '?':
+		case 'h':
+		default:
+			fatal("usage: tracedump [ -n count ] tracefile");
+			break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		fatal("usage: tracedump [ -n count ] tracefile");
+
+	fd = open(argv[0], O_RDONLY);
+	if (fd < 0)
+		fatal("cannot open %s: %m", argv[0]);
+	if (fstat(fd, &st) < 0)
+		fatal("cannot stat %s: %m", argv[0]);
+	if ((size_t)st.st_size < sizeof(*hdr))
+		fatal("%s is not a trace", argv[0]);
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		fatal("cannot map %s: %m", argv[0]);
+	close(fd);
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != TRACE_VERSION ||
+	    hdr->evsize != sizeof(Traceev) ||
+	    sizeof(*hdr) + hdr->nevents*sizeof(Traceev) > (size_t)st.st_size)
+		fatal("%s is not a trace, or not one we can read", argv[0]);
+	events = (Traceev *)(hdr + 1);
+
+	head = atomic_load_explicit(&hdr->head, memory_order_acquire);
+	first = (head > hdr->nevents) ? head - hdr->nevents : 0;
+	if (count != 0 && head - first > count)
+		first = head - count;
+	for (uint64_t pos = first; pos < head; pos++) {
+		Traceev *ev = &events[pos & (hdr->nevents - 1)];
+		Traceev copy;
+
+		if (atomic_load_explicit(&ev->seq, memory_order_acquire) != pos + 1)
+			continue;
+		copy.ns = ev->ns;
+		copy.type = ev->type;
+		copy.a = ev->a;
+		copy.b = ev->b;
+		copy.c = ev->c;
+		copy.d = ev->d;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&ev->seq, memory_order_relaxed) != pos + 1)
+			continue;
+		printev(&copy);
+	}
+
+	return 0;
+}
+
+static void
+printev(Traceev *ev)
+{
+	static const char *ops[] = { "add", "change", "remove" };
+	char when[32], p[32], a1[INET_ADDRSTRLEN], a2[INET_ADDRSTRLEN];
+	struct tm tm;
+	time_t secs;
+
+	secs = ev->ns/1000000000;
+	localtime_r(&secs, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	printf("%s.%06" PRIu64 " ", when, ev->ns%1000000000/1000);
+	switch (ev->type) {
+	case TRACE_PACKET:
+		printf("packet feed %" PRIu32 " length %" PRIu32 "\n",
+		    ev->a, ev->b);
+		break;
+	case TRACE_ENTRY:
+		printf("entry %s -> %s feed %" PRIu32 "\n",
+		    prefix(ev->a, ev->b, p), addr(ev->c, a1), ev->d);
+		break;
+	case TRACE_ROUTE_ADD:
+		printf("route-add %s -> %s feed %" PRIu32 "\n",
+		    prefix(ev->a, ev->b, p), addr(ev->c, a1), ev->d);
+		break;
+	case TRACE_ROUTE_CHANGE:
+		printf("route-change %s -> %s was %s\n",
+		    prefix(ev->a, ev->b, p), addr(ev->c, a1), addr(ev->d, a2));
+		break;
+	case TRACE_ROUTE_REFRESH:
+		printf("route-refresh %s -> %s feed %" PRIu32 "\n",
+		    prefix(ev->a, ev->b, p), addr(ev->c, a1), ev->d);
+		break;
+	case TRACE_ROUTE_BULK:
+		printf("route-bulk feed %" PRIu32 " routes %" PRIu32 "\n",
+		    ev->a, ev->b);
+		break;
+	case TRACE_ROUTE_EXPIRE:
+	case TRACE_ROUTE_DESTROY:
+		printf("route-%s %s -> %s\n",
+		    (ev->type == TRACE_ROUTE_EXPIRE) ? "expire" : "destroy",
+		    prefix(ev->a, ev->b, p), addr(ev->c, a1));
+		break;
+	case TRACE_TUNNEL_UP:
+	case TRACE_TUNNEL_DOWN:
+		printf("tunnel-%s %s local %s ifnum %" PRIu32 "%s%s\n",
+		    (ev->type == TRACE_TUNNEL_UP) ? "up" : "down",
+		    addr(ev->a, a1), addr(ev->b, a2), ev->c,
+		    (ev->d != 0) ? ": " : "",
+		    (ev->d != 0) ? strerror(ev->d) : "");
+		break;
+	case TRACE_TUNNEL_IDLE:
+		printf("tunnel-idle %s ifnum %" PRIu32 "\n",
+		    addr(ev->a, a1), ev->c);
+		break;
+	case TRACE_KOP:
+		printf("kernel-%s %s -> %s\n",
+		    (ev->d < sizeof(ops)/sizeof(ops[0])) ? ops[ev->d] : "op",
+		    prefix(ev->a, ev->b, p), addr(ev->c, a1));
+		break;
+	case TRACE_KSEND:
+		printf("kernel-send seq %" PRIu32 "..%" PRIu32
+		    " messages %" PRIu32 "\n", ev->a, ev->b, ev->c);
+		break;
+	case TRACE_KACK:
+		printf("kernel-ack seq %" PRIu32 " %s %s\n", ev->a,
+		    prefix(ev->c, ev->d, p),
+		    (ev->b == 0) ? "ok" : strerror(ev->b));
+		break;
+	default:
+		printf("unknown %" PRIu32 " %" PRIu32 " %" PRIu32
+		    " %" PRIu32 " %" PRIu32 "\n",
+		    ev->type, ev->a, ev->b, ev->c, ev->d);
+		break;
+	}
+}
+
+static const char *
+addr(uint32_t a, char buf[static INET_ADDRSTRLEN])
+{
+	struct in_addr in;
+
+	in.s_addr = htonl(a);
+	inet_ntop(AF_INET, &in, buf, INET_ADDRSTRLEN);
+
+	return buf;
+}
+
+static const char *
+prefix(uint32_t ipnet, uint32_t subnetmask, char buf[static 32])
+{
+	char a[INET_ADDRSTRLEN];
+
+	snprintf(buf, 32, "%s/%u", addr(ipnet, a), netmask2cidr(subnetmask));
+
+	return buf;
+}
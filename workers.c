@@ -0,0 +1,397 @@
+/*
+ * A pool of worker threads that bring tunnel interfaces up and
+ * tear them down.  On a cold start the daemon creates hundreds
+ * of interfaces, each taking several system calls; done by a
+ * few threads at once, that takes a fraction of the time.
+ *
+ * Each worker has its own queue and takes work from the others'
+ * when its own is empty.  The backends give each thread its own
+ * control socket.
+ *
+ * Only the main thread touches the daemon's tables.  A worker
+ * operates on a copy of the tunnel, and the main thread picks
+ * up the result from a completion queue, which wakes the event
+ * loop through a pipe, and only then installs the tunnel's
+ * routes.  An operation on an interface that already has one
+ * in flight waits for it, so operations on an interface happen
+ * in the order they were asked for.
+ *
+ * With no workers, operations are done on the spot.
+ */
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dat.h"
+#include "fns.h"
+
+enum {
+	TUNNEL_UP,
+	TUNNEL_DESTROY,
+};
+
+typedef struct Tunjob Tunjob;
+struct Tunjob {
+	int op;
+	Tunnel *tunnel;		// The main thread's.
+	Tunnel copy;		// The worker's.
+	Bitvec *interfaces;	// For TUNNEL_DESTROY.
+	int err;
+	Tunjob *next;		// In a queue.
+	Tunjob *after;		// Waiting for us, on the same interface.
+};
+
+typedef struct Jobq Jobq;
+struct Jobq {
+	pthread_mutex_t lock;
+	Tunjob *head;
+	Tunjob *tail;
+};
+
+typedef struct Workstats Workstats;
+struct Workstats {
+	uint64_t jobs;
+	uint64_t waits;		// Jobs queued behind another.
+	atomic_uint_fast64_t steals;
+	size_t inflight;
+	size_t maxinflight;
+};
+
+static int nworkers;
+static int nextq;
+static Jobq *queues;
+static atomic_int nqueued;
+static pthread_mutex_t idlelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static Jobq done = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL };
+static int wakefd[2] = { -1, -1 };
+static IPMap *busy;		// Jobs in flight, by interface number.
+static int uprdomain;
+static int uptunneldomain;
+static uint32_t upendpoint;
+static void (*tunnelready)(Tunnel *tunnel, int err);
+static Workstats stats;
+
+static void *worker(void *idp);
+static void submit(Tunjob *job);
+static void dispatch(Tunjob *job);
+static void push(Jobq *q, Tunjob *job);
+static Tunjob *pop(Jobq *q);
+static void runjob(Tunjob *job, Tunnel *tunnel);
+static void complete(Tunjob *job);
+
+/*
+ * Starts `n` workers.  Tunnels are brought up in the given
+ * domains with the given local endpoint; `ready` is called
+ * in the main thread once a tunnel is up.
+ */
+void
+initworkers(int n, int rdomain, int tunneldomain, uint32_t endpoint,
+    void (*ready)(Tunnel *tunnel, int err))
+{
+	uprdomain = rdomain;
+	uptunneldomain = tunneldomain;
+	upendpoint = endpoint;
+	tunnelready = ready;
+	if (n <= 0)
+		return;
+	if (n > MAX_WORKERS)
+		n = MAX_WORKERS;
+	if (pipe(wakefd) < 0)
+		fatal("pipe: %m");
+	if (fcntl(wakefd[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(wakefd[1], F_SETFL, O_NONBLOCK) < 0)
+		fatal("fcntl: %m");
+	queues = calloc(n, sizeof(*queues));
+	if (queues == NULL)
+		fatal("malloc");
+	busy = mkipmap();
+	// Workers steal from every queue, so ready them all first.
+	for (int k = 0; k < n; k++)
+		pthread_mutex_init(&queues[k].lock, NULL);
+	nworkers = n;
+	for (int k = 0; k < n; k++) {
+		pthread_t tid;
+		int err;
+
+		err = pthread_create(&tid, NULL, worker, (void *)(intptr_t)k);
+		if (err != 0) {
+			errno = err;
+			fatal("cannot start worker: %m");
+		}
+		pthread_detach(tid);
+	}
+}
+
+// Brings a tunnel up.
+void
+tunnelup(Tunnel *tunnel)
+{
+	Tunjob job, *jp;
+
+	memset(&job, 0, sizeof(job));
+	job.op = TUNNEL_UP;
+	job.tunnel = tunnel;
+	tunnel->pending++;
+	if (nworkers == 0) {
+		runjob(&job, tunnel);
+		complete(&job);
+		return;
+	}
+	jp = malloc(sizeof(*jp));
+	if (jp == NULL)
+		fatal("malloc");
+	*jp = job;
+	submit(jp);
+}
+
+/*
+ * Tears a tunnel down, then frees it and its bit in
+ * `interfaces`.
+ */
+void
+tunneldestroy(Tunnel *tunnel, Bitvec *interfaces)
+{
+	Tunjob job, *jp;
+
+	memset(&job, 0, sizeof(job));
+	job.op = TUNNEL_DESTROY;
+	job.tunnel = tunnel;
+	job.interfaces = interfaces;
+	tunnel->pending++;
+	if (nworkers == 0) {
+		runjob(&job, tunnel);
+		complete(&job);
+		return;
+	}
+	jp = malloc(sizeof(*jp));
+	if (jp == NULL)
+		fatal("malloc");
+	*jp = job;
+	submit(jp);
+}
+
+/*
+ * Waits until `tunnel` has no operations in flight, or, if it
+ * is nil, until no tunnel has.
+ */
+void
+tunnelsync(Tunnel *tunnel)
+{
+	struct pollfd pfd;
+
+	if (nworkers == 0)
+		return;
+	pfd.fd = wakefd[0];
+	pfd.events = POLLIN;
+	for (;;) {
+		workersinput();
+		if (tunnel == NULL ? stats.inflight == 0 : tunnel->pending == 0)
+			return;
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			fatal("poll: %m");
+	}
+}
+
+// Returns a descriptor that is readable when work completes, or -1.
+int
+workersfd(void)
+{
+	return wakefd[0];
+}
+
+// Finishes whatever the workers have completed.
+void
+workersinput(void)
+{
+	char buf[64];
+	Tunjob *job, *next;
+
+	if (nworkers == 0)
+		return;
+	while (read(wakefd[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&done.lock);
+	job = done.head;
+	done.head = done.tail = NULL;
+	pthread_mutex_unlock(&done.lock);
+	for (; job != NULL; job = next) {
+		next = job->next;
+		complete(job);
+		free(job);
+	}
+}
+
+// Returns whether tunnel jobs are still in flight.
+int
+workersbusy(void)
+{
+	return stats.inflight != 0;
+}
+
+void
+statsworkers(FILE *fp)
+{
+	if (fp == NULL)
+		return;
+	fprintf(fp, "workers %d\n", nworkers);
+	fprintf(fp, "workers_jobs %" PRIu64 "\n", stats.jobs);
+	fprintf(fp, "workers_waits %" PRIu64 "\n", stats.waits);
+	fprintf(fp, "workers_steals %" PRIu64 "\n",
+	    (uint64_t)atomic_load(&stats.steals));
+	fprintf(fp, "workers_inflight %zu\n", stats.inflight);
+	fprintf(fp, "workers_max_inflight %zu\n", stats.maxinflight);
+}
+
+static void *
+worker(void *idp)
+{
+	int id = (intptr_t)idp;
+
+	for (;;) {
+		Tunjob *job = NULL;
+		int k;
+
+		for (k = 0; k < nworkers && job == NULL; k++)
+			job = pop(&queues[(id + k)%nworkers]);
+		if (job == NULL) {
+			pthread_mutex_lock(&idlelock);
+			while (atomic_load(&nqueued) == 0)
+				pthread_cond_wait(&idle, &idlelock);
+			pthread_mutex_unlock(&idlelock);
+			continue;
+		}
+		if (k > 1)
+			atomic_fetch_add(&stats.steals, 1);
+		runjob(job, &job->copy);
+		push(&done, job);
+		while (write(wakefd[1], "", 1) < 0 && errno == EINTR)
+			;
+	}
+
+	return NULL;
+}
+
+// Queues a job, behind any other for the same interface.
+static void
+submit(Tunjob *job)
+{
+	Tunjob *prev;
+
+	stats.jobs++;
+	if (++stats.inflight > stats.maxinflight)
+		stats.maxinflight = stats.inflight;
+	prev = ipmapfind(busy, job->tunnel->ifnum, 32);
+	if (prev != NULL) {
+		while (prev->after != NULL)
+			prev = prev->after;
+		prev->after = job;
+		stats.waits++;
+		return;
+	}
+	ipmapinsert(busy, job->tunnel->ifnum, 32, job);
+	dispatch(job);
+}
+
+// Hands a job to a worker, taking a copy of the tunnel as it is now.
+static void
+dispatch(Tunjob *job)
+{
+	job->copy = *job->tunnel;
+	push(&queues[nextq], job);
+	nextq = (nextq + 1)%nworkers;
+	atomic_fetch_add(&nqueued, 1);
+	pthread_mutex_lock(&idlelock);
+	pthread_cond_signal(&idle);
+	pthread_mutex_unlock(&idlelock);
+}
+
+static void
+push(Jobq *q, Tunjob *job)
+{
+	job->next = NULL;
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == NULL)
+		q->head = job;
+	else
+		q->tail->next = job;
+	q->tail = job;
+	pthread_mutex_unlock(&q->lock);
+}
+
+static Tunjob *
+pop(Jobq *q)
+{
+	Tunjob *job;
+
+	pthread_mutex_lock(&q->lock);
+	job = q->head;
+	if (job != NULL) {
+		q->head = job->next;
+		if (q->head == NULL)
+			q->tail = NULL;
+		atomic_fetch_sub(&nqueued, 1);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return job;
+}
+
+static void
+runjob(Tunjob *job, Tunnel *tunnel)
+{
+	int rv = 0;
+
+	errno = 0;
+	switch (job->op) {
+	case TUNNEL_UP:
+		rv = uptunnel(tunnel, uprdomain, uptunneldomain, upendpoint);
+		break;
+	case TUNNEL_DESTROY:
+		rv = downtunnel(tunnel);
+		break;
+	}
+	job->err = (rv < 0) ? errno : 0;
+}
+
+// Applies the outcome of a job, in the main thread.
+static void
+complete(Tunjob *job)
+{
+	Tunnel *tunnel = job->tunnel;
+
+	if (nworkers != 0) {
+		tunnel->ifindex = job->copy.ifindex;
+		if (job->after != NULL) {
+			ipmapinsert(busy, tunnel->ifnum, 32, job->after);
+			dispatch(job->after);
+		} else
+			ipmapremove(busy, tunnel->ifnum, 32);
+		stats.inflight--;
+	}
+	tunnel->pending--;
+	switch (job->op) {
+	case TUNNEL_UP:
+		if (job->err != 0) {
+			errno = job->err;
+			error("cannot bring up tunnel %s: %m", tunnel->ifname);
+		}
+		if (tunnel->pending == 0 && tunnelready != NULL)
+			tunnelready(tunnel, job->err);
+		break;
+	case TUNNEL_DESTROY:
+		bitclr(job->interfaces, tunnel->ifnum);
+		free(tunnel);
+		break;
+	}
+}